@@ -0,0 +1,1088 @@
+/*
+ * wayboard: A keyboard input display for Wayland.
+ * Licensed under GPL v3.0 only.
+ *
+ * End-to-end benchmark harness. This creates a virtual keyboard, mouse and gamepad with uinput,
+ * runs a minimal headless Wayland compositor, starts wayboard against it, and then injects scripted
+ * (or replayed) event storms through the kernel. Every injected key event is matched against what
+ * wayboard published through its shared memory ring, and every injected event against the damaged
+ * commits the compositor received, which gives the number of dropped and coalesced events and the
+ * latency from injection to the frame which showed the event.
+ *
+ * Creating uinput devices requires write access to /dev/uinput.
+ */
+
+#define _GNU_SOURCE
+
+#include "../wayboard-log.h"
+#include "../wayboard-shm.h"
+#include "xdg-shell-server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <linux/uinput.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-server-core.h>
+#include <wayland-server-protocol.h>
+
+#define ARRAY_LEN(x) ((sizeof((x)) / sizeof(*(x))))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Each scenario is limited to this many injected events.
+#define MAX_EVENTS (1 << 20)
+#define MAX_COMMITS (1 << 20)
+
+// Keys pressed by the keyboard scenarios. The generated configuration displays each of them.
+static const uint16_t bench_keys[] = {
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_A, KEY_S, KEY_D, KEY_F, KEY_Z, KEY_X, KEY_C, KEY_V,
+};
+static const uint16_t bench_buttons[] = {
+    BTN_LEFT,
+    BTN_RIGHT,
+    BTN_MIDDLE,
+};
+static const uint16_t bench_pad_buttons[] = {
+    BTN_SOUTH,
+    BTN_EAST,
+};
+
+// Axes of the virtual gamepad: a stick and a trigger, with the ranges of a typical controller.
+static const struct {
+    uint16_t code;
+    int32_t min, max;
+} bench_pad_axes[] = {
+    {ABS_X, -32768, 32767},
+    {ABS_Y, -32768, 32767},
+    {ABS_Z, 0, 255},
+};
+
+enum bench_device {
+    DEVICE_KEYBOARD,
+    DEVICE_MOUSE,
+    DEVICE_GAMEPAD,
+};
+
+struct bench_event {
+    uint64_t at_usec; // scheduled time, relative to the start of the scenario
+    uint16_t type, code;
+    int32_t value;
+};
+
+struct bench_commit {
+    uint64_t usec;
+};
+
+struct bench {
+    // Options
+    const char *wayboard_path;
+    char **wayboard_args;
+    int refresh_hz;
+    double duration;
+    FILE *report;
+
+    // Virtual devices
+    int kbd_fd, mouse_fd, pad_fd;
+
+    // Compositor
+    struct wl_display *display;
+    struct wl_event_loop *loop;
+    const char *socket;
+    struct wl_list frame_callbacks; // callbacks to send on the next refresh
+    int refresh_fd;
+
+    // wayboard
+    pid_t wayboard_pid;
+    char config_path[64];
+    char shm_name[64];
+    struct wb_shm *shm;
+    uint64_t shm_cursor;
+    bool ready;
+
+    // Current scenario
+    struct bench_event *events;
+    size_t num_events;
+    size_t num_key_events; // events which wayboard publishes, as opposed to axis events
+    uint64_t *inject_usec; // actual injection time of each event
+    _Atomic size_t injected;
+    _Atomic bool injecting;
+
+    struct wb_shm_event *seen;
+    size_t num_seen;
+    uint64_t lost;
+
+    struct bench_commit *commits;
+    size_t num_commits;
+};
+
+struct bench_surface {
+    struct bench *bench;
+
+    struct wl_resource *buffer;
+    bool damaged;
+    struct wl_list pending_frames;
+};
+
+static inline uint64_t
+usec_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void
+resource_destroy(struct wl_client *client, struct wl_resource *resource) {
+    wl_resource_destroy(resource);
+}
+
+static void
+resource_unlink(struct wl_resource *resource) {
+    wl_list_remove(wl_resource_get_link(resource));
+}
+
+// wl_region
+
+static void
+region_add(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y,
+           int32_t width, int32_t height) {
+    // Unused.
+}
+
+static const struct wl_region_interface region_impl = {
+    .destroy = resource_destroy,
+    .add = region_add,
+    .subtract = region_add,
+};
+
+// wl_surface
+
+static void
+surface_attach(struct wl_client *client, struct wl_resource *resource, struct wl_resource *buffer,
+               int32_t x, int32_t y) {
+    struct bench_surface *surface = wl_resource_get_user_data(resource);
+
+    surface->buffer = buffer;
+}
+
+static void
+surface_damage(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y,
+               int32_t width, int32_t height) {
+    struct bench_surface *surface = wl_resource_get_user_data(resource);
+
+    surface->damaged = true;
+}
+
+static void
+surface_frame(struct wl_client *client, struct wl_resource *resource, uint32_t callback) {
+    struct bench_surface *surface = wl_resource_get_user_data(resource);
+
+    struct wl_resource *cb =
+        wl_resource_create(client, &wl_callback_interface, 1, callback);
+    if (!cb) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(cb, NULL, NULL, resource_unlink);
+    wl_list_insert(surface->pending_frames.prev, wl_resource_get_link(cb));
+}
+
+static void
+surface_set_region(struct wl_client *client, struct wl_resource *resource,
+                   struct wl_resource *region) {
+    // Unused.
+}
+
+static void
+surface_commit(struct wl_client *client, struct wl_resource *resource) {
+    struct bench_surface *surface = wl_resource_get_user_data(resource);
+    struct bench *bench = surface->bench;
+
+    if (surface->damaged && bench->injecting && bench->num_commits < MAX_COMMITS) {
+        bench->commits[bench->num_commits++] = (struct bench_commit){usec_now()};
+    }
+    surface->damaged = false;
+
+    // The stand-in never reads the buffer, so it can be released immediately. This measures
+    // wayboard rather than the compositor.
+    if (surface->buffer) {
+        wl_buffer_send_release(surface->buffer);
+        surface->buffer = NULL;
+    }
+
+    wl_list_insert_list(bench->frame_callbacks.prev, &surface->pending_frames);
+    wl_list_init(&surface->pending_frames);
+}
+
+static void
+surface_set_int(struct wl_client *client, struct wl_resource *resource, int32_t value) {
+    // Unused.
+}
+
+static const struct wl_surface_interface surface_impl = {
+    .destroy = resource_destroy,
+    .attach = surface_attach,
+    .damage = surface_damage,
+    .frame = surface_frame,
+    .set_opaque_region = surface_set_region,
+    .set_input_region = surface_set_region,
+    .commit = surface_commit,
+    .set_buffer_transform = surface_set_int,
+    .set_buffer_scale = surface_set_int,
+    .damage_buffer = surface_damage,
+};
+
+static void
+surface_destroy(struct wl_resource *resource) {
+    struct bench_surface *surface = wl_resource_get_user_data(resource);
+
+    struct wl_resource *cb, *tmp;
+    wl_resource_for_each_safe(cb, tmp, &surface->pending_frames) {
+        wl_resource_destroy(cb);
+    }
+    free(surface);
+}
+
+// wl_compositor
+
+static void
+compositor_create_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    struct bench_surface *surface = calloc(1, sizeof(*surface));
+    struct wl_resource *surface_resource =
+        wl_resource_create(client, &wl_surface_interface, wl_resource_get_version(resource), id);
+    if (!surface || !surface_resource) {
+        free(surface);
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    surface->bench = wl_resource_get_user_data(resource);
+    wl_list_init(&surface->pending_frames);
+    wl_resource_set_implementation(surface_resource, &surface_impl, surface, surface_destroy);
+}
+
+static void
+compositor_create_region(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    struct wl_resource *region = wl_resource_create(client, &wl_region_interface, 1, id);
+    if (!region) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(region, &region_impl, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_impl = {
+    .create_surface = compositor_create_surface,
+    .create_region = compositor_create_region,
+};
+
+static void
+compositor_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource =
+        wl_resource_create(client, &wl_compositor_interface, version, id);
+    if (!resource) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &compositor_impl, data, NULL);
+}
+
+// xdg_toplevel
+
+static void
+toplevel_set_parent(struct wl_client *client, struct wl_resource *resource,
+                    struct wl_resource *parent) {
+    // Unused.
+}
+
+static void
+toplevel_set_string(struct wl_client *client, struct wl_resource *resource, const char *str) {
+    // Unused.
+}
+
+static void
+toplevel_show_window_menu(struct wl_client *client, struct wl_resource *resource,
+                          struct wl_resource *seat, uint32_t serial, int32_t x, int32_t y) {
+    // Unused.
+}
+
+static void
+toplevel_move(struct wl_client *client, struct wl_resource *resource, struct wl_resource *seat,
+              uint32_t serial) {
+    // Unused.
+}
+
+static void
+toplevel_resize(struct wl_client *client, struct wl_resource *resource, struct wl_resource *seat,
+                uint32_t serial, uint32_t edges) {
+    // Unused.
+}
+
+static void
+toplevel_set_size(struct wl_client *client, struct wl_resource *resource, int32_t width,
+                  int32_t height) {
+    // Unused.
+}
+
+static void
+toplevel_set_state(struct wl_client *client, struct wl_resource *resource) {
+    // Unused.
+}
+
+static void
+toplevel_set_fullscreen(struct wl_client *client, struct wl_resource *resource,
+                        struct wl_resource *output) {
+    // Unused.
+}
+
+static const struct xdg_toplevel_interface toplevel_impl = {
+    .destroy = resource_destroy,
+    .set_parent = toplevel_set_parent,
+    .set_title = toplevel_set_string,
+    .set_app_id = toplevel_set_string,
+    .show_window_menu = toplevel_show_window_menu,
+    .move = toplevel_move,
+    .resize = toplevel_resize,
+    .set_max_size = toplevel_set_size,
+    .set_min_size = toplevel_set_size,
+    .set_maximized = toplevel_set_state,
+    .unset_maximized = toplevel_set_state,
+    .set_fullscreen = toplevel_set_fullscreen,
+    .unset_fullscreen = toplevel_set_state,
+    .set_minimized = toplevel_set_state,
+};
+
+// xdg_surface
+
+static void
+xdg_surface_get_toplevel(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    struct wl_resource *toplevel =
+        wl_resource_create(client, &xdg_toplevel_interface, wl_resource_get_version(resource), id);
+    if (!toplevel) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(toplevel, &toplevel_impl, NULL, NULL);
+
+    struct wl_array states;
+    wl_array_init(&states);
+    xdg_toplevel_send_configure(toplevel, 0, 0, &states);
+    wl_array_release(&states);
+
+    struct bench *bench = wl_resource_get_user_data(resource);
+    xdg_surface_send_configure(resource, wl_display_next_serial(bench->display));
+}
+
+static void
+xdg_surface_get_popup(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+                      struct wl_resource *parent, struct wl_resource *positioner) {
+    wl_resource_post_error(resource, XDG_WM_BASE_ERROR_INVALID_POPUP_PARENT,
+                           "popups are not supported");
+}
+
+static void
+xdg_surface_set_window_geometry(struct wl_client *client, struct wl_resource *resource, int32_t x,
+                                int32_t y, int32_t width, int32_t height) {
+    // Unused.
+}
+
+static void
+xdg_surface_ack_configure(struct wl_client *client, struct wl_resource *resource,
+                          uint32_t serial) {
+    // Unused.
+}
+
+static const struct xdg_surface_interface xdg_surface_impl = {
+    .destroy = resource_destroy,
+    .get_toplevel = xdg_surface_get_toplevel,
+    .get_popup = xdg_surface_get_popup,
+    .set_window_geometry = xdg_surface_set_window_geometry,
+    .ack_configure = xdg_surface_ack_configure,
+};
+
+// xdg_wm_base
+
+static void
+wm_base_create_positioner(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    wl_resource_post_error(resource, XDG_WM_BASE_ERROR_INVALID_POSITIONER,
+                           "positioners are not supported");
+}
+
+static void
+wm_base_get_xdg_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+                        struct wl_resource *surface) {
+    struct wl_resource *xdg_surface =
+        wl_resource_create(client, &xdg_surface_interface, wl_resource_get_version(resource), id);
+    if (!xdg_surface) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(xdg_surface, &xdg_surface_impl,
+                                   wl_resource_get_user_data(resource), NULL);
+}
+
+static void
+wm_base_pong(struct wl_client *client, struct wl_resource *resource, uint32_t serial) {
+    // Unused.
+}
+
+static const struct xdg_wm_base_interface wm_base_impl = {
+    .destroy = resource_destroy,
+    .create_positioner = wm_base_create_positioner,
+    .get_xdg_surface = wm_base_get_xdg_surface,
+    .pong = wm_base_pong,
+};
+
+static void
+wm_base_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &xdg_wm_base_interface, version, id);
+    if (!resource) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &wm_base_impl, data, NULL);
+}
+
+static int
+on_refresh(int fd, uint32_t mask, void *data) {
+    struct bench *bench = data;
+
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return 0;
+    }
+
+    uint32_t time = usec_now() / 1000;
+    struct wl_resource *cb, *tmp;
+    wl_resource_for_each_safe(cb, tmp, &bench->frame_callbacks) {
+        wl_callback_send_done(cb, time);
+        wl_resource_destroy(cb);
+    }
+
+    return 0;
+}
+
+static int
+init_compositor(struct bench *bench) {
+    bench->display = wl_display_create();
+    if (!bench->display) {
+        fprintf(stderr, "failed to create wayland display\n");
+        return 1;
+    }
+    bench->loop = wl_display_get_event_loop(bench->display);
+    wl_list_init(&bench->frame_callbacks);
+
+    bench->socket = wl_display_add_socket_auto(bench->display);
+    if (!bench->socket) {
+        fprintf(stderr, "failed to add wayland socket\n");
+        goto fail;
+    }
+    if (wl_display_init_shm(bench->display) != 0) {
+        fprintf(stderr, "failed to initialize wl_shm\n");
+        goto fail;
+    }
+    if (!wl_global_create(bench->display, &wl_compositor_interface, 4, bench, compositor_bind) ||
+        !wl_global_create(bench->display, &xdg_wm_base_interface, 4, bench, wm_base_bind)) {
+        fprintf(stderr, "failed to create wayland globals\n");
+        goto fail;
+    }
+
+    // Frame callbacks are sent at a fixed rate to stand in for the vertical blank.
+    bench->refresh_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (bench->refresh_fd < 0) {
+        perror("failed to create refresh timer");
+        goto fail;
+    }
+    long interval_nsec = 1000000000L / bench->refresh_hz;
+    struct itimerspec spec = {
+        .it_interval = {.tv_nsec = interval_nsec},
+        .it_value = {.tv_nsec = interval_nsec},
+    };
+    timerfd_settime(bench->refresh_fd, 0, &spec, NULL);
+    wl_event_loop_add_fd(bench->loop, bench->refresh_fd, WL_EVENT_READABLE, on_refresh, bench);
+
+    return 0;
+
+fail:
+    wl_display_destroy(bench->display);
+    return 1;
+}
+
+static int
+create_uinput_device(const char *name, const uint16_t *codes, size_t num_codes,
+                     enum bench_device type) {
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        perror("failed to open /dev/uinput");
+        return -1;
+    }
+
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    for (size_t i = 0; i < num_codes; i++) {
+        ioctl(fd, UI_SET_KEYBIT, codes[i]);
+    }
+
+    // libinput only treats a device as a pointer if it can also report relative motion.
+    if (type == DEVICE_MOUSE) {
+        ioctl(fd, UI_SET_EVBIT, EV_REL);
+        ioctl(fd, UI_SET_RELBIT, REL_X);
+        ioctl(fd, UI_SET_RELBIT, REL_Y);
+    }
+
+    if (type == DEVICE_GAMEPAD) {
+        ioctl(fd, UI_SET_EVBIT, EV_ABS);
+        for (size_t i = 0; i < ARRAY_LEN(bench_pad_axes); i++) {
+            struct uinput_abs_setup abs = {
+                .code = bench_pad_axes[i].code,
+                .absinfo = {.minimum = bench_pad_axes[i].min, .maximum = bench_pad_axes[i].max},
+            };
+            ioctl(fd, UI_SET_ABSBIT, abs.code);
+            ioctl(fd, UI_ABS_SETUP, &abs);
+        }
+    }
+
+    struct uinput_setup setup = {
+        .id = {.bustype = BUS_VIRTUAL, .vendor = 0x1234, .product = type + 1},
+    };
+    snprintf(setup.name, sizeof(setup.name), "%s", name);
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+        perror("failed to create uinput device");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+write_config(struct bench *bench) {
+    snprintf(bench->shm_name, sizeof(bench->shm_name), "wayboard-bench-%d", getpid());
+    snprintf(bench->config_path, sizeof(bench->config_path), "/tmp/wayboard-bench-%d.cfg",
+             getpid());
+
+    FILE *file = fopen(bench->config_path, "w");
+    if (!file) {
+        perror("failed to write benchmark config");
+        return 1;
+    }
+
+    fprintf(file, "background = \"000000\"\n"
+                  "foreground_inactive = \"202020\"\n"
+                  "foreground_active = \"ffffff\"\n"
+                  "font = \"monospace:size=10\"\n"
+                  "width = 360\nheight = 80\n"
+                  "shm_name = \"%s\"\n"
+                  "sticks = ( { x = 180, y = 40, w = 28, h = 28, axes = [%d, %d] } )\n"
+                  "triggers = ( { x = 210, y = 40, w = 10, h = 28, axis = %d } )\n"
+                  "keys = (\n",
+            bench->shm_name, ABS_X, ABS_Y, ABS_Z);
+    for (size_t i = 0; i < ARRAY_LEN(bench_keys); i++) {
+        fprintf(file, "  { x = %zu, y = 0, w = 28, h = 28, scancode = %d },\n", i * 30,
+                bench_keys[i] + 8);
+    }
+    for (size_t i = 0; i < ARRAY_LEN(bench_buttons); i++) {
+        fprintf(file, "  { x = %zu, y = 40, w = 28, h = 28, scancode = %d },\n", i * 30,
+                bench_buttons[i]);
+    }
+    for (size_t i = 0; i < ARRAY_LEN(bench_pad_buttons); i++) {
+        fprintf(file, "  { x = %zu, y = 40, w = 28, h = 28, scancode = %d }%s\n", 90 + i * 30,
+                bench_pad_buttons[i], i + 1 < ARRAY_LEN(bench_pad_buttons) ? "," : "");
+    }
+    fprintf(file, ")\n");
+
+    return fclose(file) == 0 ? 0 : 1;
+}
+
+static int
+spawn_wayboard(struct bench *bench) {
+    bench->wayboard_pid = fork();
+    if (bench->wayboard_pid < 0) {
+        perror("failed to fork");
+        return 1;
+    }
+    if (bench->wayboard_pid == 0) {
+        setenv("WAYLAND_DISPLAY", bench->socket, 1);
+
+        size_t num_args = 0;
+        while (bench->wayboard_args[num_args]) {
+            num_args++;
+        }
+
+        char **argv = calloc(num_args + 3, sizeof(char *));
+        argv[0] = (char *)bench->wayboard_path;
+        memcpy(argv + 1, bench->wayboard_args, num_args * sizeof(char *));
+        argv[num_args + 1] = bench->config_path;
+
+        execv(bench->wayboard_path, argv);
+        perror("failed to exec wayboard");
+        _exit(127);
+    }
+
+    return 0;
+}
+
+static void
+poll_shm(struct bench *bench) {
+    if (!bench->shm) {
+        char path[128];
+        snprintf(path, sizeof(path), "/%s", bench->shm_name);
+
+        int fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct wb_shm)) {
+            close(fd);
+            return;
+        }
+        bench->shm = mmap(NULL, sizeof(struct wb_shm), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (bench->shm == MAP_FAILED) {
+            bench->shm = NULL;
+            return;
+        }
+        bench->shm_cursor = atomic_load(&bench->shm->head);
+    }
+
+    while (bench->num_seen < MAX_EVENTS) {
+        size_t n = wb_shm_read_events(bench->shm, &bench->shm_cursor, bench->seen + bench->num_seen,
+                                      MAX_EVENTS - bench->num_seen, &bench->lost);
+        if (n == 0) {
+            break;
+        }
+
+        // Only events injected during the scenario are of interest.
+        if (bench->injecting) {
+            bench->num_seen += n;
+        }
+    }
+}
+
+static void
+dispatch_for(struct bench *bench, uint64_t usec) {
+    uint64_t end = usec_now() + usec;
+    while (usec_now() < end) {
+        wl_display_flush_clients(bench->display);
+        wl_event_loop_dispatch(bench->loop, 1);
+        poll_shm(bench);
+    }
+}
+
+static void *
+inject_thread(void *data) {
+    struct bench *bench = data;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (size_t i = 0; i < bench->num_events; i++) {
+        struct bench_event *event = &bench->events[i];
+
+        uint64_t at_nsec = (uint64_t)start.tv_nsec + event->at_usec * 1000;
+        struct timespec at = {
+            .tv_sec = start.tv_sec + at_nsec / 1000000000,
+            .tv_nsec = at_nsec % 1000000000,
+        };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL);
+
+        int fd = bench->kbd_fd;
+        if (event->type == EV_ABS || (event->code >= BTN_JOYSTICK && event->code < BTN_DIGI)) {
+            fd = bench->pad_fd;
+        } else if (event->code >= BTN_MISC && event->code <= BTN_GEAR_UP) {
+            fd = bench->mouse_fd;
+        }
+        struct input_event ev[] = {
+            {.type = event->type, .code = event->code, .value = event->value},
+            {.type = EV_SYN, .code = SYN_REPORT, .value = 0},
+        };
+
+        bench->inject_usec[i] = usec_now();
+        if (write(fd, ev, sizeof(ev)) != sizeof(ev)) {
+            perror("failed to inject event");
+        }
+        atomic_store(&bench->injected, i + 1);
+    }
+
+    return NULL;
+}
+
+static void
+add_axis(struct bench *bench, uint64_t at_usec, uint16_t axis, int32_t value) {
+    if (bench->num_events < MAX_EVENTS) {
+        bench->events[bench->num_events++] = (struct bench_event){at_usec, EV_ABS, axis, value};
+    }
+}
+
+static void
+add_event(struct bench *bench, uint64_t at_usec, uint16_t code, bool pressed) {
+    if (bench->num_events < MAX_EVENTS) {
+        bench->events[bench->num_events++] = (struct bench_event){at_usec, EV_KEY, code, pressed};
+        bench->num_key_events++;
+    }
+}
+
+static void
+scenario_rollover(struct bench *bench) {
+    // Press every key 1 ms apart, hold them for 20 ms, then release them 1 ms apart.
+    uint64_t duration = bench->duration * 1000000;
+    for (uint64_t t = 0; t < duration;) {
+        for (size_t i = 0; i < ARRAY_LEN(bench_keys); i++, t += 1000) {
+            add_event(bench, t, bench_keys[i], true);
+        }
+        t += 20000;
+        for (size_t i = 0; i < ARRAY_LEN(bench_keys); i++, t += 1000) {
+            add_event(bench, t, bench_keys[i], false);
+        }
+        t += 20000;
+    }
+}
+
+static void
+scenario_taps(struct bench *bench) {
+    // 1 kHz taps, cycling through the keys, each held for half of the period.
+    uint64_t duration = bench->duration * 1000000;
+    for (uint64_t t = 0, i = 0; t < duration; t += 1000, i++) {
+        uint16_t key = bench_keys[i % ARRAY_LEN(bench_keys)];
+        add_event(bench, t, key, true);
+        add_event(bench, t + 500, key, false);
+    }
+}
+
+static void
+scenario_gamepad(struct bench *bench) {
+    // The stick circles and the trigger sweeps at 1 kHz, as from a controller polled that fast,
+    // with a button tap every 10 ms. Only the button events are published by wayboard, but every
+    // event should show up on the next frame. Gamepads are only read by the evdev backend.
+    uint64_t duration = bench->duration * 1000000;
+    for (uint64_t t = 0, i = 0; t < duration; t += 1000, i++) {
+        double angle = 2 * 3.14159265358979 * (i % 500) / 500;
+        add_axis(bench, t, ABS_X, 30000 * cos(angle));
+        add_axis(bench, t + 1, ABS_Y, 30000 * sin(angle));
+        add_axis(bench, t + 2, ABS_Z, i % 256);
+
+        if (i % 10 == 0) {
+            uint16_t button = bench_pad_buttons[(i / 10) % ARRAY_LEN(bench_pad_buttons)];
+            add_event(bench, t + 3, button, true);
+            add_event(bench, t + 500, button, false);
+        }
+    }
+}
+
+static void
+scenario_mouse(struct bench *bench) {
+    // A mouse button event every 125 us, as from an 8 kHz mouse.
+    uint64_t duration = bench->duration * 1000000;
+    for (uint64_t t = 0, i = 0; t < duration; t += 125, i++) {
+        add_event(bench, t, bench_buttons[(i / 2) % ARRAY_LEN(bench_buttons)], i % 2 == 0);
+    }
+}
+
+static int
+scenario_replay(struct bench *bench, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "failed to open session log '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    struct wb_log_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != WB_LOG_MAGIC ||
+        header.version != WB_LOG_VERSION || header.record_size != sizeof(struct wb_log_record)) {
+        fprintf(stderr, "'%s' is not a wayboard session log\n", path);
+        fclose(file);
+        return 1;
+    }
+    fseek(file, header.header_size, SEEK_SET);
+
+    // Replay the recorded timings, but onto the keys and buttons which the generated config shows.
+    struct wb_log_record record;
+    uint64_t first_usec = 0;
+    while (fread(&record, sizeof(record), 1, file) == 1 && record.usec != 0) {
+        if (first_usec == 0) {
+            first_usec = record.usec;
+        }
+
+        bool button = record.code >= BTN_MISC && record.code <= BTN_GEAR_UP;
+        uint16_t code = button ? bench_buttons[record.code % ARRAY_LEN(bench_buttons)]
+                               : bench_keys[record.code % ARRAY_LEN(bench_keys)];
+        add_event(bench, record.usec - first_usec, code, record.pressed);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static int
+compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+report(struct bench *bench, const char *scenario) {
+    size_t injected = atomic_load(&bench->injected);
+
+    // Every injected event is attributed to the first damaged commit after it. Events which share
+    // a commit with an earlier event were coalesced into one frame.
+    uint64_t *latencies = calloc(MAX(injected, 1), sizeof(uint64_t));
+    size_t num_latencies = 0, commits_used = 0;
+    for (size_t i = 0, commit = 0, last_commit = SIZE_MAX; i < injected; i++) {
+        while (commit < bench->num_commits && bench->commits[commit].usec < bench->inject_usec[i]) {
+            commit++;
+        }
+        if (commit == bench->num_commits) {
+            break;
+        }
+
+        if (commit != last_commit) {
+            commits_used++;
+            last_commit = commit;
+        }
+        latencies[num_latencies++] = bench->commits[commit].usec - bench->inject_usec[i];
+    }
+    qsort(latencies, num_latencies, sizeof(uint64_t), compare_u64);
+
+    // Axis events are not published, so only key events can be counted as dropped.
+    size_t keys = bench->num_key_events;
+    size_t dropped = keys > bench->num_seen ? keys - bench->num_seen : 0;
+    size_t coalesced = num_latencies - commits_used;
+
+#define PERCENTILE(p) (num_latencies ? latencies[(num_latencies - 1) * (p) / 100] : 0)
+
+    fprintf(bench->report,
+            "%-10s %8zu %8zu %8zu %8zu %10zu %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64
+            "\n",
+            scenario, injected, bench->num_seen, dropped, bench->num_commits, coalesced,
+            PERCENTILE(50), PERCENTILE(90), PERCENTILE(99), PERCENTILE(100));
+    fflush(bench->report);
+
+#undef PERCENTILE
+
+    free(latencies);
+}
+
+static int
+run_scenario(struct bench *bench, const char *scenario, const char *replay_path) {
+    bench->num_events = 0;
+    bench->num_key_events = 0;
+    bench->num_seen = 0;
+    bench->num_commits = 0;
+    bench->lost = 0;
+    atomic_store(&bench->injected, 0);
+
+    if (strcmp(scenario, "rollover") == 0) {
+        scenario_rollover(bench);
+    } else if (strcmp(scenario, "taps") == 0) {
+        scenario_taps(bench);
+    } else if (strcmp(scenario, "mouse") == 0) {
+        scenario_mouse(bench);
+    } else if (strcmp(scenario, "gamepad") == 0) {
+        scenario_gamepad(bench);
+    } else if (strcmp(scenario, "replay") == 0) {
+        if (scenario_replay(bench, replay_path) != 0) {
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "unknown scenario '%s'\n", scenario);
+        return 1;
+    }
+
+    // Drain anything left over from the previous scenario first.
+    dispatch_for(bench, 100000);
+
+    atomic_store(&bench->injecting, true);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, inject_thread, bench) != 0) {
+        fprintf(stderr, "failed to create injection thread\n");
+        return 1;
+    }
+    while (atomic_load(&bench->injected) < bench->num_events) {
+        dispatch_for(bench, 1000);
+    }
+    pthread_join(thread, NULL);
+
+    // Give wayboard time to render the last events.
+    dispatch_for(bench, 200000);
+    atomic_store(&bench->injecting, false);
+
+    report(bench, scenario);
+    return 0;
+}
+
+int
+main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        {"duration", required_argument, NULL, 'd'},
+        {"output", required_argument, NULL, 'o'},
+        {"refresh", required_argument, NULL, 'r'},
+        {"replay", required_argument, NULL, 'R'},
+        {"scenario", required_argument, NULL, 's'},
+        {0},
+    };
+    const char *name = argv[0] ? argv[0] : "wayboard-bench";
+
+    struct bench bench = {
+        .refresh_hz = 240,
+        .duration = 2.0,
+        .report = stdout,
+    };
+    const char *scenarios = "rollover,taps,mouse";
+    const char *replay_path = NULL;
+
+    for (;;) {
+        int opt = getopt_long(argc, argv, "+d:o:r:R:s:", long_options, NULL);
+        if (opt == -1) {
+            break;
+        }
+
+        switch (opt) {
+        case 'd':
+            bench.duration = strtod(optarg, NULL);
+            break;
+        case 'o':
+            bench.report = fopen(optarg, "w");
+            if (!bench.report) {
+                fprintf(stderr, "failed to open '%s': %s\n", optarg, strerror(errno));
+                return 1;
+            }
+            break;
+        case 'r':
+            bench.refresh_hz = atoi(optarg);
+            break;
+        case 'R':
+            replay_path = optarg;
+            scenarios = "replay";
+            break;
+        case 's':
+            scenarios = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind >= argc || bench.duration <= 0 || bench.refresh_hz <= 0) {
+        goto usage;
+    }
+    bench.wayboard_path = argv[optind];
+    bench.wayboard_args = argv + optind + 1;
+
+    bench.events = calloc(MAX_EVENTS, sizeof(*bench.events));
+    bench.inject_usec = calloc(MAX_EVENTS, sizeof(*bench.inject_usec));
+    bench.seen = calloc(MAX_EVENTS, sizeof(*bench.seen));
+    bench.commits = calloc(MAX_COMMITS, sizeof(*bench.commits));
+    if (!bench.events || !bench.inject_usec || !bench.seen || !bench.commits) {
+        fprintf(stderr, "failed to allocate event buffers\n");
+        return 1;
+    }
+
+    int ret = 1;
+
+    // The virtual devices must exist before wayboard starts so that the evdev backend sees them.
+    bench.kbd_fd = create_uinput_device("wayboard-bench keyboard", bench_keys,
+                                        ARRAY_LEN(bench_keys), DEVICE_KEYBOARD);
+    if (bench.kbd_fd < 0) {
+        goto fail_kbd;
+    }
+    bench.mouse_fd = create_uinput_device("wayboard-bench mouse", bench_buttons,
+                                          ARRAY_LEN(bench_buttons), DEVICE_MOUSE);
+    if (bench.mouse_fd < 0) {
+        goto fail_mouse;
+    }
+    bench.pad_fd = create_uinput_device("wayboard-bench gamepad", bench_pad_buttons,
+                                        ARRAY_LEN(bench_pad_buttons), DEVICE_GAMEPAD);
+    if (bench.pad_fd < 0) {
+        goto fail_pad;
+    }
+
+    if (init_compositor(&bench) != 0) {
+        goto fail_compositor;
+    }
+    if (write_config(&bench) != 0) {
+        goto fail_config;
+    }
+
+    // Give udev a moment to announce the new devices before wayboard enumerates them.
+    dispatch_for(&bench, 250000);
+    if (spawn_wayboard(&bench) != 0) {
+        goto fail_spawn;
+    }
+
+    // Wait for wayboard to start publishing to its shared memory segment.
+    uint64_t deadline = usec_now() + 10000000;
+    while (!bench.shm && usec_now() < deadline) {
+        dispatch_for(&bench, 10000);
+    }
+    if (!bench.shm) {
+        fprintf(stderr, "wayboard did not start within 10 seconds\n");
+        goto fail_start;
+    }
+    dispatch_for(&bench, 250000);
+
+    fprintf(bench.report, "# refresh %d Hz, duration %.1f s, args:", bench.refresh_hz,
+            bench.duration);
+    for (char **arg = bench.wayboard_args; *arg; arg++) {
+        fprintf(bench.report, " %s", *arg);
+    }
+    fprintf(bench.report, "\n%-10s %8s %8s %8s %8s %10s %8s %8s %8s %8s\n", "scenario", "events",
+            "seen", "dropped", "commits", "coalesced", "p50_us", "p90_us", "p99_us", "max_us");
+
+    char *list = strdup(scenarios);
+    ret = 0;
+    for (char *save, *scenario = strtok_r(list, ",", &save); scenario;
+         scenario = strtok_r(NULL, ",", &save)) {
+        if (run_scenario(&bench, scenario, replay_path) != 0) {
+            ret = 1;
+            break;
+        }
+    }
+    free(list);
+
+fail_start:
+    kill(bench.wayboard_pid, SIGTERM);
+    waitpid(bench.wayboard_pid, NULL, 0);
+    if (bench.shm) {
+        munmap(bench.shm, sizeof(struct wb_shm));
+    }
+
+fail_spawn:
+    unlink(bench.config_path);
+
+fail_config:
+    wl_display_destroy(bench.display);
+
+fail_compositor:
+    ioctl(bench.pad_fd, UI_DEV_DESTROY);
+    close(bench.pad_fd);
+
+fail_pad:
+    ioctl(bench.mouse_fd, UI_DEV_DESTROY);
+    close(bench.mouse_fd);
+
+fail_mouse:
+    ioctl(bench.kbd_fd, UI_DEV_DESTROY);
+    close(bench.kbd_fd);
+
+fail_kbd:
+    return ret;
+
+usage:
+    fprintf(stderr,
+            "USAGE: %s [--scenario rollover,taps,mouse,gamepad] [--replay SESSION_LOG]\n"
+            "       [--duration SEC] [--refresh HZ] [--output REPORT]\n"
+            "       WAYBOARD [WAYBOARD_ARGS...]\n",
+            name);
+    return 1;
+}
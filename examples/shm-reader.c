@@ -0,0 +1,188 @@
+/*
+ * wayboard: A keyboard input display for Wayland.
+ * Licensed under GPL v3.0 only.
+ *
+ * Example reader for the shared memory segment which wayboard publishes key events to. Run it with
+ * the `shm_name` from your wayboard configuration to print every key event as it happens, or with
+ * `--bench` to measure the throughput of the segment without wayboard running.
+ */
+
+#include "../wayboard-shm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARRAY_LEN(x) ((sizeof((x)) / sizeof(*(x))))
+
+struct bench {
+    struct wb_shm *shm;
+    uint64_t count;
+
+    _Atomic uint64_t consumed;
+    uint64_t read, lost;
+};
+
+static inline uint64_t
+nsec_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void *
+bench_reader(void *data) {
+    struct bench *bench = data;
+
+    struct wb_shm_event events[256];
+    uint64_t cursor = 0;
+
+    while (bench->read + bench->lost < bench->count) {
+        size_t n =
+            wb_shm_read_events(bench->shm, &cursor, events, ARRAY_LEN(events), &bench->lost);
+        bench->read += n;
+
+        atomic_store_explicit(&bench->consumed, bench->read + bench->lost, memory_order_release);
+        if (n == 0) {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static int
+run_bench(uint64_t count) {
+    struct bench bench = {.count = count};
+
+    bench.shm = mmap(NULL, sizeof(struct wb_shm), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (bench.shm == MAP_FAILED) {
+        perror("failed to mmap benchmark segment");
+        return 1;
+    }
+    wb_shm_init(bench.shm);
+
+    // First, measure the cost of publishing on its own. This is what wayboard pays per event.
+    uint64_t start = nsec_now();
+    for (uint64_t i = 0; i < count; i++) {
+        wb_shm_publish(bench.shm, i % WB_SHM_MAX_KEYS, i & 1, i);
+    }
+    uint64_t write_nsec = nsec_now() - start;
+
+    // Then, measure how quickly a reader can drain the ring. The writer is throttled to stay
+    // within half of the ring of the reader so that no events are lost to lapping.
+    wb_shm_init(bench.shm);
+    atomic_store(&bench.shm->head, 0);
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, bench_reader, &bench) != 0) {
+        fprintf(stderr, "failed to create reader thread\n");
+        munmap(bench.shm, sizeof(struct wb_shm));
+        return 1;
+    }
+
+    start = nsec_now();
+    for (uint64_t i = 0; i < count; i++) {
+        while (i - atomic_load_explicit(&bench.consumed, memory_order_acquire) >
+               WB_SHM_RING_LEN / 2) {
+            // Wait for the reader to catch up, without starving it if both threads share a core.
+            sched_yield();
+        }
+
+        wb_shm_publish(bench.shm, i % WB_SHM_MAX_KEYS, i & 1, i);
+    }
+    pthread_join(reader, NULL);
+    uint64_t read_nsec = nsec_now() - start;
+
+    munmap(bench.shm, sizeof(struct wb_shm));
+
+    printf("events:       %" PRIu64 "\n", count);
+    printf("publish:      %.2f ns/event\n", (double)write_nsec / count);
+    printf("throughput:   %.1f Mevents/s\n", bench.read * 1e3 / read_nsec);
+    printf("lost:         %" PRIu64 "\n", bench.lost);
+    return 0;
+}
+
+static int
+run_reader(const char *name) {
+    char path[256];
+    snprintf(path, sizeof(path), "/%s", name);
+
+    int fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open shared memory segment '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    const struct wb_shm *shm = mmap(NULL, sizeof(struct wb_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("failed to mmap shared memory segment");
+        return 1;
+    }
+    if (!wb_shm_valid(shm)) {
+        fprintf(stderr, "shared memory segment '%s' has an incompatible layout\n", path);
+        munmap((void *)shm, sizeof(struct wb_shm));
+        return 1;
+    }
+
+    struct wb_shm_state state;
+    wb_shm_read_state(shm, &state);
+    for (size_t i = 0; i < WB_SHM_MAX_KEYS; i++) {
+        if (state.pressed[i / 64] & ((uint64_t)1 << (i % 64))) {
+            printf("held %4zu\n", i);
+        }
+    }
+
+    // Reading events never requires a syscall. This example sleeps when there is nothing to read
+    // to avoid burning a CPU core, but a reader with a frame loop of its own can simply poll.
+    struct wb_shm_event events[256];
+    uint64_t cursor = atomic_load_explicit(&shm->head, memory_order_acquire);
+    uint64_t lost = 0, last_lost = 0;
+    for (;;) {
+        size_t n = wb_shm_read_events(shm, &cursor, events, ARRAY_LEN(events), &lost);
+        if (lost != last_lost) {
+            printf("lost %" PRIu64 " events\n", lost - last_lost);
+            last_lost = lost;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            printf("%" PRIu64 " %4u %s\n", events[i].usec, events[i].code,
+                   events[i].pressed ? "pressed" : "released");
+        }
+        fflush(stdout);
+
+        if (n == 0) {
+            nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+        }
+    }
+}
+
+int
+main(int argc, char **argv) {
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+        uint64_t count = argc >= 3 ? strtoull(argv[2], NULL, 10) : 100000000;
+        if (count == 0) {
+            fprintf(stderr, "invalid event count '%s'\n", argv[2]);
+            return 1;
+        }
+
+        return run_bench(count);
+    }
+
+    if (argc != 2) {
+        const char *name = argv[0] ? argv[0] : "wayboard-shm-reader";
+        fprintf(stderr, "USAGE: %s SHM_NAME\n       %s --bench [EVENTS]\n", name, name);
+        return 1;
+    }
+
+    return run_reader(argv[1]);
+}
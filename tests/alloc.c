@@ -0,0 +1,161 @@
+/*
+ * wayboard: A keyboard input display for Wayland.
+ * Licensed under GPL v3.0 only.
+ *
+ * Allocation regression test. This replays a storm of key presses, pointer motion and scrolling
+ * through wayboard_process_code and render_frame, with malloc, calloc and realloc interposed, and
+ * fails if any of them are called once the font, the text cache and pixman have been warmed up.
+ * Drawing input events is meant to never allocate, see init_render.
+ *
+ * Windows are set up the same way as for offline rendering, so no compositor is needed. The test
+ * is skipped when the font in the config cannot be loaded.
+ */
+
+// wayboard.c is built into the test so that its static functions can be called directly.
+#define main wayboard_main
+#include "../wayboard.c"
+#undef main
+
+#define PASSES 3
+#define EVENTS_PER_PASS 5000
+#define FRAME_USEC 16667
+
+static bool counting;
+static size_t allocations;
+
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_malloc(size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *
+calloc(size_t nmemb, size_t size) {
+    allocations += counting;
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+malloc(size_t size) {
+    allocations += counting;
+    return __libc_malloc(size);
+}
+
+void *
+realloc(void *ptr, size_t size) {
+    allocations += counting;
+    return __libc_realloc(ptr, size);
+}
+
+static const uint16_t codes[] = {KEY_A, KEY_S, KEY_D, KEY_F};
+
+static void
+replay(struct wayboard *wb, uint64_t *usec) {
+    struct wb_window *win = &wb->windows[0];
+
+    // Holds range from taps under the time threshold to presses which outlast the fade, and
+    // some keys are released before the previous key has finished animating.
+    for (size_t i = 0; i < EVENTS_PER_PASS; i++) {
+        uint16_t code = codes[rand() % ARRAY_LEN(codes)];
+        uint64_t hold = 1000 + rand() % 600000;
+
+        wb->state.offline_usec = *usec;
+        wayboard_process_code(wb, code, true, *usec);
+        wayboard_process_motion(wb, rand() % 50 - 25, rand() % 50 - 25);
+        wayboard_process_scroll(wb, 0, (rand() % 5 - 2) * 120, *usec);
+        for (uint64_t frame = *usec; frame < *usec + hold; frame += FRAME_USEC) {
+            wb->state.offline_usec = frame;
+            render_frame(win);
+        }
+
+        *usec += hold;
+        wb->state.offline_usec = *usec;
+        wayboard_process_code(wb, code, false, *usec);
+        for (int frames = rand() % 30; frames > 0; frames--) {
+            *usec += FRAME_USEC;
+            wb->state.offline_usec = *usec;
+            render_frame(win);
+        }
+    }
+}
+
+static void
+warm_up(struct wayboard *wb, uint64_t *usec) {
+    struct wb_window *win = &wb->windows[0];
+
+    // Labels which are built at runtime are drawn one character at a time, and a character which
+    // has not been drawn yet is a cache miss. Taps of 1 to 10 ms draw every digit, whereas the
+    // random holds of the first pass might not.
+    for (size_t i = 0; i < ARRAY_LEN(codes); i++) {
+        for (uint64_t ms = 1; ms <= 10; ms++) {
+            wb->state.offline_usec = *usec;
+            wayboard_process_code(wb, codes[i], true, *usec);
+            *usec += ms * 1000;
+            wb->state.offline_usec = *usec;
+            wayboard_process_code(wb, codes[i], false, *usec);
+            for (int frames = 0; frames < 60; frames++) {
+                *usec += FRAME_USEC;
+                wb->state.offline_usec = *usec;
+                render_frame(win);
+            }
+        }
+    }
+}
+
+int
+main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <config>\n", argv[0]);
+        return 1;
+    }
+
+    static struct wayboard wb;
+    if (init_read_config(&wb, argv[1], NULL) != 0) {
+        return 1;
+    }
+
+    wb.render_threads = 1;
+    wb.windows = calloc(1, sizeof(*wb.windows));
+    assert(wb.windows);
+    wb.num_windows = 1;
+
+    struct wb_window *win = &wb.windows[0];
+    win->wb = &wb;
+    win->cfg = &wb.cfg.windows[0];
+    win->layouts = calloc(1, sizeof(*win->layouts));
+    assert(win->layouts);
+    win->layouts[0].cfg = win->cfg;
+    win->layout = &win->layouts[0];
+    win->state.shm_data = calloc((size_t)win->cfg->width * win->cfg->height, 4);
+    assert(win->state.shm_data);
+    win->state.buf_released = true;
+
+    // Meson treats exit code 77 as a skipped test.
+    if (init_fcft(&wb) != 0) {
+        return 77;
+    }
+    if (init_shapes(&wb) != 0 || init_icons(&wb) != 0) {
+        return 1;
+    }
+    init_overlaps(&wb);
+    if (init_render(&wb) != 0) {
+        return 1;
+    }
+
+    int ret = 0;
+    uint64_t usec = 1000000;
+    warm_up(&wb, &usec);
+    srand(1);
+    for (int pass = 0; pass < PASSES; pass++) {
+        allocations = 0;
+        counting = pass > 0;
+        replay(&wb, &usec);
+        counting = false;
+
+        printf("pass %d: %zu allocations, text cache %" PRIu64 " hits, %" PRIu64 " misses\n", pass,
+               allocations, wb.text.hits, wb.text.misses);
+        if (pass > 0 && allocations != 0) {
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,299 @@
+/*
+ * wayboard: A keyboard input display for Wayland.
+ * Licensed under GPL v3.0 only.
+ *
+ * Overlapping key test. This presses and releases keys which overlap each other through
+ * wayboard_process_code and render_frame, and after every event and frame compares the window's
+ * buffer with a full redraw of the same key state, and checks that every pixel which changed is
+ * within the damage recorded for it. It then checks that damage to the same or adjoining areas is
+ * merged, and that no more than DAMAGE_MAX_BOXES boxes are recorded however many keys are drawn.
+ *
+ * Windows are set up the same way as for offline rendering, except for a placeholder surface so
+ * that damage is recorded. Nothing is committed, so no compositor is needed. The test is skipped
+ * when the font in the config cannot be loaded.
+ */
+
+// wayboard.c is built into the test so that its static functions can be called directly.
+#define main wayboard_main
+#include "../wayboard.c"
+#undef main
+
+#define EVENTS 500
+#define FRAME_USEC 16667
+
+static const uint16_t overlapping[] = {KEY_A, KEY_S, KEY_D};
+static const uint16_t apart[] = {
+    KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_0,
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P,
+};
+
+static pixman_image_t *reference;
+static uint32_t *committed;
+
+static void
+redraw(struct wb_window *win) {
+    struct wayboard *wb = win->wb;
+    pixman_image_t *image = win->state.pixman_image;
+
+    // The layout at rest, with every key then drawn from the background up in z-order as it
+    // currently looks. Keys draw into the window's image, so it is swapped out meanwhile.
+    render_layout(wb, win->layout, reference);
+
+    win->state.pixman_image = reference;
+    for (size_t i = 0; i < MAX_KEYS; i++) {
+        struct cfg_key *key = &win->cfg->keys[i];
+        if (KEY_DEFINED(win, i)) {
+            pixman_image_fill_rectangles(PIXMAN_OP_SRC, reference, &wb->cfg.background, 1,
+                                         &(pixman_rectangle16_t){key->x, key->y, key->w, key->h});
+        }
+    }
+    for (size_t i = 0; i < MAX_KEYS; i++) {
+        if (KEY_DEFINED(win, i)) {
+            render_key_draw(win, i);
+        }
+    }
+    win->state.pixman_image = image;
+}
+
+static bool
+damaged(struct wb_window *win, int32_t x, int32_t y) {
+    for (size_t i = 0; i < win->state.num_damage; i++) {
+        pixman_box32_t *box = &win->state.damage[i];
+        if (x >= box->x1 && x < box->x2 && y >= box->y1 && y < box->y2) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int
+check(struct wb_window *win, uint64_t usec) {
+    int32_t width = win->cfg->width, height = win->cfg->height;
+    uint32_t *data = (uint32_t *)win->state.shm_data;
+    uint32_t *expected = pixman_image_get_data(reference);
+
+    redraw(win);
+
+    if (win->state.num_damage > DAMAGE_MAX_BOXES) {
+        fprintf(stderr, "%" PRIu64 ": %zu damage boxes, at most %d are allowed\n", usec,
+                win->state.num_damage, DAMAGE_MAX_BOXES);
+        return 1;
+    }
+    for (int32_t y = 0; y < height; y++) {
+        for (int32_t x = 0; x < width; x++) {
+            size_t i = (size_t)y * width + x;
+
+            if (data[i] != expected[i]) {
+                fprintf(stderr, "%" PRIu64 ": pixel (%d, %d) is %08" PRIx32 ", not %08" PRIx32 "\n",
+                        usec, x, y, data[i], expected[i]);
+                return 1;
+            }
+            if (data[i] != committed[i] && !damaged(win, x, y)) {
+                fprintf(stderr, "%" PRIu64 ": pixel (%d, %d) changed outside of the damage\n",
+                        usec, x, y);
+                return 1;
+            }
+        }
+    }
+
+    // Stands in for wayboard_commit_frame.
+    memcpy(committed, data, (size_t)width * height * 4);
+    win->state.num_damage = 0;
+    return 0;
+}
+
+static int
+event(struct wayboard *wb, uint16_t code, bool pressed, uint64_t usec) {
+    wb->state.offline_usec = usec;
+    wayboard_process_code(wb, code, pressed, usec);
+    return check(&wb->windows[0], usec);
+}
+
+static int
+frames(struct wayboard *wb, uint64_t *usec, uint64_t until) {
+    struct wb_window *win = &wb->windows[0];
+
+    while (*usec < until) {
+        *usec += FRAME_USEC;
+        wb->state.offline_usec = *usec;
+        render_frame(win);
+        if (check(win, *usec) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+test_scripted(struct wayboard *wb, uint64_t *usec) {
+    // A key pressed below one which is held, the upper one released in threshold and hidden
+    // again, and the lower one fading out from under a third.
+    static const struct {
+        uint16_t code;
+        bool pressed;
+        uint64_t after_usec;
+    } script[] = {
+        {KEY_S, true, 50000},   {KEY_A, true, 50000},   {KEY_S, false, 400000},
+        {KEY_D, true, 100000},  {KEY_A, false, 50000},  {KEY_D, false, 1000000},
+        {KEY_D, true, 50000},   {KEY_S, true, 50000},   {KEY_A, true, 50000},
+        {KEY_S, false, 100000}, {KEY_D, false, 100000}, {KEY_A, false, 1000000},
+    };
+
+    for (size_t i = 0; i < ARRAY_LEN(script); i++) {
+        if (event(wb, script[i].code, script[i].pressed, *usec) != 0 ||
+            frames(wb, usec, *usec + script[i].after_usec) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+test_random(struct wayboard *wb, uint64_t *usec) {
+    // Up to all three keys are held at once, and are released at any point of their animations.
+    bool held[ARRAY_LEN(overlapping)] = {0};
+
+    srand(1);
+    for (size_t i = 0; i < EVENTS; i++) {
+        size_t key = rand() % ARRAY_LEN(overlapping);
+
+        held[key] = !held[key];
+        if (event(wb, overlapping[key], held[key], *usec) != 0 ||
+            frames(wb, usec, *usec + rand() % 400000) != 0) {
+            return 1;
+        }
+    }
+    for (size_t key = 0; key < ARRAY_LEN(overlapping); key++) {
+        if (held[key] && event(wb, overlapping[key], false, *usec) != 0) {
+            return 1;
+        }
+    }
+    return frames(wb, usec, *usec + 1000000);
+}
+
+static int
+test_merge(struct wayboard *wb, uint64_t *usec) {
+    struct wb_window *win = &wb->windows[0];
+    struct cfg_key *a = &win->cfg->keys[KEY_A];
+    struct cfg_key *f = &win->cfg->keys[KEY_F], *g = &win->cfg->keys[KEY_G];
+
+    // The same key twice, and then two keys which share an edge.
+    wb->state.offline_usec = *usec;
+    render_key(win, KEY_A);
+    render_key(win, KEY_A);
+    render_key(win, KEY_F);
+    render_key(win, KEY_G);
+
+    pixman_box32_t want[] = {
+        {a->x, a->y, a->x + a->w, a->y + a->h},
+        {f->x, f->y, g->x + g->w, g->y + g->h},
+    };
+    bool ok = win->state.num_damage == ARRAY_LEN(want);
+    for (size_t i = 0; ok && i < ARRAY_LEN(want); i++) {
+        pixman_box32_t *box = &win->state.damage[i];
+        ok = box->x1 == want[i].x1 && box->y1 == want[i].y1 && box->x2 == want[i].x2 &&
+             box->y2 == want[i].y2;
+    }
+    if (!ok) {
+        fprintf(stderr, "merge: %zu damage boxes, wanted the key and the two adjoining keys\n",
+                win->state.num_damage);
+        for (size_t i = 0; i < win->state.num_damage; i++) {
+            pixman_box32_t *box = &win->state.damage[i];
+            fprintf(stderr, "  %d,%d %dx%d\n", box->x1, box->y1, box->x2 - box->x1,
+                    box->y2 - box->y1);
+        }
+        return 1;
+    }
+    return check(win, *usec);
+}
+
+static int
+test_cap(struct wayboard *wb, uint64_t *usec) {
+    struct wb_window *win = &wb->windows[0];
+
+    // Every key apart from the others is pressed before the damage is committed, so there are
+    // more damaged areas than boxes.
+    wb->state.offline_usec = *usec;
+    for (size_t i = 0; i < ARRAY_LEN(apart); i++) {
+        wayboard_process_code(wb, apart[i], true, *usec);
+    }
+    if (win->state.num_damage != DAMAGE_MAX_BOXES) {
+        fprintf(stderr, "cap: %zu damage boxes after drawing %zu keys, wanted %d\n",
+                win->state.num_damage, ARRAY_LEN(apart), DAMAGE_MAX_BOXES);
+        return 1;
+    }
+    if (check(win, *usec) != 0) {
+        return 1;
+    }
+
+    *usec += 500000;
+    wb->state.offline_usec = *usec;
+    for (size_t i = 0; i < ARRAY_LEN(apart); i++) {
+        wayboard_process_code(wb, apart[i], false, *usec);
+    }
+    if (check(win, *usec) != 0) {
+        return 1;
+    }
+    return frames(wb, usec, *usec + 1000000);
+}
+
+int
+main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <config>\n", argv[0]);
+        return 1;
+    }
+
+    static struct wayboard wb;
+    if (init_read_config(&wb, argv[1], NULL) != 0) {
+        return 1;
+    }
+
+    wb.render_threads = 1;
+    wb.windows = calloc(1, sizeof(*wb.windows));
+    assert(wb.windows);
+    wb.num_windows = 1;
+
+    struct wb_window *win = &wb.windows[0];
+    win->wb = &wb;
+    win->cfg = &wb.cfg.windows[0];
+    win->layouts = calloc(1, sizeof(*win->layouts));
+    assert(win->layouts);
+    win->layouts[0].cfg = win->cfg;
+    win->layout = &win->layouts[0];
+    win->state.shm_data = calloc((size_t)win->cfg->width * win->cfg->height, 4);
+    assert(win->state.shm_data);
+    win->state.buf_released = true;
+
+    // Meson treats exit code 77 as a skipped test.
+    if (init_fcft(&wb) != 0) {
+        return 77;
+    }
+    if (init_shapes(&wb) != 0 || init_icons(&wb) != 0) {
+        return 1;
+    }
+    init_overlaps(&wb);
+    if (init_render(&wb) != 0) {
+        return 1;
+    }
+
+    // render_damage only records damage for windows with a surface. It is never dereferenced,
+    // since nothing is committed.
+    static char surface;
+    win->wl.surface = (struct wl_surface *)&surface;
+
+    reference =
+        pixman_image_create_bits(PIXMAN_a8r8g8b8, win->cfg->width, win->cfg->height, NULL, 0);
+    committed = calloc((size_t)win->cfg->width * win->cfg->height, 4);
+    assert(reference && committed);
+    memcpy(committed, win->state.shm_data, (size_t)win->cfg->width * win->cfg->height * 4);
+
+    uint64_t usec = 1000000;
+    if (test_scripted(&wb, &usec) != 0 || test_random(&wb, &usec) != 0 ||
+        test_merge(&wb, &usec) != 0 || test_cap(&wb, &usec) != 0) {
+        return 1;
+    }
+
+    printf("%d events redrawn as a full redraw would, damage merged and capped\n", EVENTS);
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * wayboard: A keyboard input display for Wayland.
+ * Licensed under GPL v3.0 only.
+ *
+ * Format of the session logs which wayboard writes when `record` is set in its configuration. A
+ * log file consists of a header, the layout of every window, and then fixed-size records of every
+ * key press and release. All values are stored in native byte order.
+ *
+ * Files are grown in chunks, so a file which was not closed cleanly (e.g. after a crash) may end
+ * in zeroed records; readers should stop at the first record with a `usec` of 0. Cleanly closed
+ * files are truncated to their contents and have `num_records` set in the header.
+ */
+
+#ifndef WAYBOARD_LOG_H
+#define WAYBOARD_LOG_H
+
+#include <stdint.h>
+
+#define WB_LOG_MAGIC 0x474c4257 // "WBLG"
+#define WB_LOG_VERSION 1
+
+struct wb_log_header {
+    uint32_t magic, version;
+    uint32_t header_size; // offset of the first record, in bytes
+    uint32_t record_size; // size of each record, in bytes
+
+    // Record timestamps use CLOCK_MONOTONIC. These two values were sampled at the same time when
+    // the file was created, so wall clock time can be recovered from them.
+    uint64_t clock_monotonic_usec;
+    uint64_t clock_realtime_usec;
+
+    uint32_t sequence;    // index of this file within the session, starting from 0
+    uint32_t num_windows; // number of `wb_log_window` entries following the header
+    uint32_t num_keys;    // number of `wb_log_key` entries following the windows
+    uint32_t reserved;
+
+    uint64_t num_records; // 0 if the file was not closed cleanly
+};
+
+struct wb_log_window {
+    uint16_t width, height;
+};
+
+struct wb_log_key {
+    uint16_t window, code;
+    int16_t x, y;
+    uint16_t w, h;
+};
+
+struct wb_log_record {
+    uint64_t usec;
+    uint16_t code;
+    uint8_t pressed;
+    uint8_t reserved[5];
+};
+
+#endif
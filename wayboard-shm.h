@@ -0,0 +1,178 @@
+/*
+ * wayboard: A keyboard input display for Wayland.
+ * Licensed under GPL v3.0 only.
+ *
+ * Layout of the shared memory segment which wayboard publishes key events to when `shm_name` is
+ * set in its configuration. The segment contains a snapshot of the state of every key, protected
+ * by a seqlock, and a ring of the most recent events. There is a single writer (wayboard) and any
+ * number of readers, none of which need to make any syscalls after mapping the segment.
+ */
+
+#ifndef WAYBOARD_SHM_H
+#define WAYBOARD_SHM_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WB_SHM_MAGIC 0x53424b57 // "WKBS"
+#define WB_SHM_VERSION 1
+
+#define WB_SHM_MAX_KEYS 768
+#define WB_SHM_RING_LEN 4096 // must be a power of two
+
+struct wb_shm_event {
+    uint64_t usec;
+    uint16_t code;
+    bool pressed;
+};
+
+struct wb_shm {
+    uint32_t magic, version;
+    uint32_t max_keys, ring_len;
+
+    // Key state snapshot. `seq` is odd while the writer is updating the snapshot.
+    alignas(64) _Atomic uint32_t seq;
+    _Atomic uint64_t pressed[WB_SHM_MAX_KEYS / 64];
+    _Atomic uint64_t last_press_usec[WB_SHM_MAX_KEYS];
+    _Atomic uint64_t last_release_usec[WB_SHM_MAX_KEYS];
+
+    // Event ring. `head` is the total number of events ever written; the event with index `n` is
+    // stored in `ring[n % WB_SHM_RING_LEN]`. Each slot packs the code and state into one word so
+    // that it can be read with two loads.
+    alignas(64) _Atomic uint64_t head;
+    alignas(64) struct {
+        _Atomic uint64_t usec;
+        _Atomic uint64_t code_state; // code | (pressed << 16)
+    } ring[WB_SHM_RING_LEN];
+};
+
+struct wb_shm_state {
+    uint64_t pressed[WB_SHM_MAX_KEYS / 64];
+    uint64_t last_press_usec[WB_SHM_MAX_KEYS];
+    uint64_t last_release_usec[WB_SHM_MAX_KEYS];
+};
+
+// Initializes a freshly mapped (zeroed) segment.
+static inline void
+wb_shm_init(struct wb_shm *shm) {
+    shm->magic = WB_SHM_MAGIC;
+    shm->version = WB_SHM_VERSION;
+    shm->max_keys = WB_SHM_MAX_KEYS;
+    shm->ring_len = WB_SHM_RING_LEN;
+}
+
+// Returns true if the segment was written by a compatible version of wayboard.
+static inline bool
+wb_shm_valid(const struct wb_shm *shm) {
+    return shm->magic == WB_SHM_MAGIC && shm->version == WB_SHM_VERSION &&
+           shm->max_keys == WB_SHM_MAX_KEYS && shm->ring_len == WB_SHM_RING_LEN;
+}
+
+// Publishes a single key event. Must only be called by the writer, so read-modify-write updates
+// are done with plain loads and stores rather than locked instructions.
+static inline void
+wb_shm_publish(struct wb_shm *shm, uint16_t code, bool pressed, uint64_t usec) {
+    uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+    atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    uint64_t bit = (uint64_t)1 << (code % 64);
+    uint64_t word = atomic_load_explicit(&shm->pressed[code / 64], memory_order_relaxed);
+    if (pressed) {
+        atomic_store_explicit(&shm->pressed[code / 64], word | bit, memory_order_relaxed);
+        atomic_store_explicit(&shm->last_press_usec[code], usec, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(&shm->pressed[code / 64], word & ~bit, memory_order_relaxed);
+        atomic_store_explicit(&shm->last_release_usec[code], usec, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+
+    uint64_t head = atomic_load_explicit(&shm->head, memory_order_relaxed);
+    size_t slot = head & (WB_SHM_RING_LEN - 1);
+    atomic_store_explicit(&shm->ring[slot].usec, usec, memory_order_relaxed);
+    atomic_store_explicit(&shm->ring[slot].code_state, code | ((uint64_t)pressed << 16),
+                          memory_order_relaxed);
+    atomic_store_explicit(&shm->head, head + 1, memory_order_release);
+}
+
+// Copies a consistent snapshot of the key state into `out`. Spins while the writer is in the
+// middle of an update, which only ever takes a handful of stores.
+static inline void
+wb_shm_read_state(const struct wb_shm *shm, struct wb_shm_state *out) {
+    for (;;) {
+        uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+
+        for (size_t i = 0; i < WB_SHM_MAX_KEYS / 64; i++) {
+            out->pressed[i] = atomic_load_explicit(&shm->pressed[i], memory_order_relaxed);
+        }
+        for (size_t i = 0; i < WB_SHM_MAX_KEYS; i++) {
+            out->last_press_usec[i] =
+                atomic_load_explicit(&shm->last_press_usec[i], memory_order_relaxed);
+            out->last_release_usec[i] =
+                atomic_load_explicit(&shm->last_release_usec[i], memory_order_relaxed);
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&shm->seq, memory_order_relaxed) == seq) {
+            return;
+        }
+    }
+}
+
+// Reads up to `max` events which were published after `*cursor` into `out` and advances the
+// cursor. A reader which falls too far behind skips ahead; the number of events which were lost
+// this way is added to `*lost`. Start with `*cursor` set to the current `head` to only see new
+// events.
+static inline size_t
+wb_shm_read_events(const struct wb_shm *shm, uint64_t *cursor, struct wb_shm_event *out,
+                   size_t max, uint64_t *lost) {
+    // The writer may be in the middle of filling the slot for `head`, which shares its slot with
+    // `head - WB_SHM_RING_LEN`, so only the newest `WB_SHM_RING_LEN - 1` events are readable.
+    const uint64_t capacity = WB_SHM_RING_LEN - 1;
+
+    uint64_t head = atomic_load_explicit(&shm->head, memory_order_acquire);
+    if (head - *cursor > capacity) {
+        *lost += head - *cursor - capacity;
+        *cursor = head - capacity;
+    }
+
+    size_t n = 0;
+    uint64_t pos = *cursor;
+    for (; pos != head && n < max; pos++, n++) {
+        size_t slot = pos & (WB_SHM_RING_LEN - 1);
+        uint64_t code_state =
+            atomic_load_explicit(&shm->ring[slot].code_state, memory_order_relaxed);
+
+        out[n].usec = atomic_load_explicit(&shm->ring[slot].usec, memory_order_relaxed);
+        out[n].code = code_state & 0xFFFF;
+        out[n].pressed = (code_state >> 16) & 1;
+    }
+
+    // Any events which the writer may have overwritten while they were being copied are dropped.
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t new_head = atomic_load_explicit(&shm->head, memory_order_relaxed);
+    if (new_head - *cursor > capacity) {
+        uint64_t overwritten = new_head - *cursor - capacity;
+        if (overwritten > n) {
+            overwritten = n;
+        }
+
+        for (size_t i = 0; i + overwritten < n; i++) {
+            out[i] = out[i + overwritten];
+        }
+        n -= overwritten;
+        *lost += overwritten;
+    }
+
+    *cursor = pos;
+    return n;
+}
+
+#endif
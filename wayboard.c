@@ -35,18 +35,33 @@
 // Used for memfd_create
 #define _GNU_SOURCE
 
+#include "wayboard-log.h"
+#include "wayboard-shm.h"
 #include "xdg-shell.h"
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcft/fcft.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <libconfig.h>
 #include <libinput.h>
 #include <libudev.h>
+#include <limits.h>
+#include <linux/input.h>
+#include <math.h>
+#ifdef WAYBOARD_PNG
+#include <png.h>
+#endif
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
-#include <sys/poll.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/timerfd.h>
 #include <time.h>
 #include <uchar.h>
@@ -55,31 +70,292 @@
 #include <wayland-client-protocol.h>
 
 #define ARRAY_LEN(x) ((sizeof((x)) / sizeof(*(x))))
-#define KEY_DEFINED(wb, code) ((wb)->cfg.keys[(code)].w != 0)
+#define KEY_DEFINED(win, code) ((win)->cfg->keys[(code)].w != 0)
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 // Support both keyboard scancodes (XKB codes up to ~255 + offset) and
 // Linux input button/key codes (e.g., BTN_LEFT=272). KEY_MAX is 0x2ff.
 // Reserve up to 0x300 (768) slots to cover the full range.
 #define MAX_KEYS 768
 
+static_assert(MAX_KEYS == WB_SHM_MAX_KEYS, "shared memory layout must cover every key");
+
+// The evdev backend opens every input device with keys, so this needs to be enough for a machine
+// with several keyboards, mice and other peripherals attached.
+#define MAX_EVDEV_DEVICES 64
+
+// Session logs are grown by this many bytes at a time, and synced to disk at most this often.
+#define RECORD_CHUNK_SIZE (1 << 20)
+#define RECORD_SYNC_USEC 1000000
+
+// Binary layout snapshots are only loaded if they were written by the same version of the format.
+#define SNAPSHOT_MAGIC 0x50534257 // "WBSP"
+#define SNAPSHOT_VERSION 8
+
+// Pointer motion is shown as the average speed over the last frame, or over this long if the
+// previous frame was further in the past. Scroll ticks are added up until the wheel has been left
+// alone for SCROLL_BURST_USEC.
+#define MOTION_MAX_INTERVAL_USEC 50000
+#define MOTION_DEFAULT_SPEED 5000
+#define SCROLL_BURST_USEC 500000
+
+// The report interval analyzer keeps a histogram of the intervals between the reports of each
+// input device, with RATE_BUCKETS buckets spaced four to an octave (so each covers about 19%).
+// Intervals of RATE_IDLE_USEC or more are the device being left alone rather than its polling
+// interval, and are only counted. A rate is estimated once RATE_MIN_REPORTS reports fell around the
+// most common interval.
+#define RATE_BUCKETS 64
+#define RATE_IDLE_USEC 50000
+#define RATE_MIN_REPORTS 32
+
+// Gamepad sticks and triggers are fixed-size tables in each window, so that they can be stored
+// inline in snapshots.
+#define MAX_STICKS 4
+#define MAX_TRIGGERS 4
+
+// Released keys fade from `fg_active` to `fg_inactive` through this many precomputed colours.
+#define FADE_STEPS 32
+
+// Each window has its own surface and SHM buffer, so there is no reason to allow an unbounded
+// number of them.
+#define MAX_WINDOWS 16
+
+// Profiles are alternative key tables which can be switched between at runtime, each triggered by
+// holding down a chord of up to MAX_CHORD keys.
+#define MAX_PROFILES 16
+#define MAX_CHORD 8
+
+// Icons are decoded into memory in full before being scaled, so overly large (or corrupt) images
+// are rejected.
+#define ICON_MAX_SIZE 4096
+
+// Rasterized text runs are cached by string, so that labels are only rasterized once. The cache is
+// sized at startup to hold every label in the configuration, along with TEXT_CACHE_CHARS single
+// characters which labels built at runtime (such as the press durations shown in threshold) are
+// drawn from, so that once every label has been drawn the cache never misses.
+#define TEXT_CACHE_CHARS 32
+
+// Offline renders of session logs split the timeline into chunks of about this many bytes of
+// output, each of which is rendered by one worker thread. Chunks are written out in order, and each
+// worker can only get OFFLINE_CHUNKS_AHEAD chunks ahead of the output, which bounds memory use.
+#define OFFLINE_CHUNK_SIZE (8 << 20)
+#define OFFLINE_CHUNKS_AHEAD 2
+#define OFFLINE_MAX_THREADS 64
+
+// Full redraws of a window, at startup and on profile switches, are split into tiles of this many
+// rows which are drawn by the calling thread along with a pool of up to RENDER_MAX_THREADS - 1
+// helpers, which are started once. Windows with fewer pixels than RENDER_TILED_MIN_PIXELS are drawn
+// on the calling thread alone, since waking the helpers would take longer than drawing them.
+#define RENDER_TILE_ROWS 64
+#define RENDER_MAX_TILES (4096 / RENDER_TILE_ROWS)
+#define RENDER_MAX_THREADS 8
+#define RENDER_TILED_MIN_PIXELS (1 << 20)
+
+// Damage is merged into at most this many boxes between commits, so that a burst of input events
+// is sent to the compositor as a handful of rectangles rather than one for each key drawn.
+#define DAMAGE_MAX_BOXES 16
+
+// Tracing is compiled in with `-Dtrace=true` and enabled at runtime with `--trace`. Each thread
+// records completed spans into its own ring buffer, and the buffers are written out as Chrome trace
+// JSON (which Perfetto can also open) on SIGUSR1 and on exit. When compiled out, spans are free.
+#ifdef WAYBOARD_TRACE
+#define TRACE_EVENTS (1 << 16)
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Records a span from here to the end of the enclosing scope.
+#define TRACE_SPAN(name)                                                                           \
+    struct trace_span TRACE_CONCAT(trace_span_, __LINE__) __attribute__((cleanup(trace_end))) = { \
+        (name),                                                                                    \
+        trace_path ? trace_now() : 0,                                                              \
+    }
+#else
+#define TRACE_SPAN(name) ((void)0)
+#endif
+
 struct cfg {
     // Appearance
-    int width, height;
     pixman_color_t background;
     pixman_color_t fg_active, fg_inactive;
     pixman_color_t txt_active, txt_inactive;
+    pixman_color_t border_color;
+    int radius, border; // default corner radius and border width of keys, in pixels
     char *font;
 
     // Function
     int time_threshold; // maximum duration to show keypress length
     int threshold_life; // number of ms to show keypress length for
+    int fade_time;      // number of ms for released keys to fade out over
+    char *shm_name;     // name of the shared memory segment to publish key events to
+
+    // Recording
+    char *record_path;   // path of the session log to write, if any
+    int record_max_size; // maximum size of each session log file in MiB
 
     // Layout
-    struct cfg_key {
-        int x, y, w, h;
-        char *text_active, *text_inactive;
-    } keys[MAX_KEYS];
+    struct cfg_window {
+        char *name;
+        int width, height;
+
+        // Pointer elements, which are only shown if they have a width.
+        struct cfg_motion {
+            int x, y, w, h;
+            int speed; // speed, in counts per second, which reaches the edge of the element
+        } motion;
+        struct cfg_scroll {
+            int x, y, w, h;
+        } scroll;
+
+        // Report rate element, which shows the polling rate of the input device which reported
+        // most recently and is only shown if it has a width.
+        struct cfg_rate {
+            int x, y, w, h;
+        } rate;
+
+        // Gamepad elements, which show the latest value of evdev absolute axes (ABS_* codes).
+        struct cfg_stick {
+            int x, y, w, h;
+            int axis_x, axis_y;
+        } sticks[MAX_STICKS];
+        size_t num_sticks;
+        struct cfg_trigger {
+            int x, y, w, h;
+            int axis;
+        } triggers[MAX_TRIGGERS];
+        size_t num_triggers;
+
+        struct cfg_key {
+            int x, y, w, h;
+            char *text_active, *text_inactive;
+            char *icon_active, *icon_inactive; // images which are shown instead of the text
+
+            // Style. Properties which are not set on the key are taken from the top level.
+            int radius, border;
+            pixman_color_t fg_active, fg_inactive, border_color;
+        } keys[MAX_KEYS];
+    } *windows; // `num_windows` windows for each profile, one profile after another
+    size_t num_windows;
+
+    // Profiles. Profile 0 is the layout given by `keys` or `windows`, and every other profile only
+    // replaces the key tables of those windows.
+    struct cfg_profile {
+        char *name;
+        uint16_t chord[MAX_CHORD];
+        size_t chord_len;
+    } *profiles;
+    size_t num_profiles;
+
+    // If the configuration was loaded from a binary snapshot, all strings point into this mapping
+    // rather than being owned by the configuration.
+    void *snapshot;
+    size_t snapshot_size;
+};
+
+// Binary layout snapshot, as written by `wayboard --compile`. All offsets are relative to the start
+// of the file, and strings are stored once each in a trailing string table. A string offset of 0
+// refers to the empty string at the start of the table and means that the string is not set.
+struct snapshot_header {
+    uint32_t magic, version;
+    uint64_t size;        // size of the whole file
+    uint64_t checksum;    // hash of everything following the header
+    uint64_t source_hash; // hash of the text configuration this snapshot was compiled from
+
+    uint32_t windows_offset, num_windows; // `num_windows` windows for each profile
+    uint32_t keys_offset, num_keys;
+    uint32_t profiles_offset, num_profiles;
+    uint32_t strings_offset, strings_size;
+
+    pixman_color_t background;
+    pixman_color_t fg_active, fg_inactive;
+    pixman_color_t txt_active, txt_inactive;
+    pixman_color_t border_color;
+    int32_t radius, border;
+    uint32_t font;
+    int32_t time_threshold, threshold_life;
+    int32_t fade_time;
+    uint32_t shm_name;
+    uint32_t record_path;
+    int32_t record_max_size;
+};
+
+struct snapshot_window {
+    uint32_t name;
+    int32_t width, height;
+    int32_t motion_x, motion_y, motion_w, motion_h, motion_speed;
+    int32_t scroll_x, scroll_y, scroll_w, scroll_h;
+    int32_t rate_x, rate_y, rate_w, rate_h;
+    uint32_t num_sticks, num_triggers;
+    struct {
+        int32_t x, y, w, h;
+        uint32_t axis_x, axis_y;
+    } sticks[MAX_STICKS];
+    struct {
+        int32_t x, y, w, h;
+        uint32_t axis;
+    } triggers[MAX_TRIGGERS];
+    uint32_t first_key, num_keys;
+};
+
+struct snapshot_key {
+    uint32_t code;
+    int32_t x, y, w, h;
+    uint32_t text_active, text_inactive;
+    uint32_t icon_active, icon_inactive;
+    int32_t radius, border;
+    pixman_color_t fg_active, fg_inactive, border_color;
+};
+
+struct snapshot_profile {
+    uint32_t name;
+    uint32_t chord_len;
+    uint16_t chord[MAX_CHORD];
+};
+
+// String table which is built up while compiling a snapshot.
+struct snapshot_strings {
+    char *data;
+    size_t size, cap;
+};
+
+#ifdef WAYBOARD_TRACE
+struct trace_span {
+    const char *name;
+    uint64_t start_nsec; // 0 if tracing is disabled
+};
+
+// Spans recorded by one thread. Only the owning thread writes to the buffer. `head` is the number
+// of spans ever recorded, so that a dump knows which slots hold the newest ones. Buffers are never
+// freed, since a dump may be reading them, but once their thread exits they are handed to the next
+// thread which needs one, so short-lived render threads do not each leave one behind.
+struct trace_buffer {
+    struct trace_buffer *next;
+    pid_t tid;
+    _Atomic bool in_use;
+
+    _Atomic uint64_t head;
+    struct trace_event {
+        const char *name;
+        uint64_t start_nsec, end_nsec;
+    } events[TRACE_EVENTS];
+};
+
+static _Atomic(struct trace_buffer *) trace_buffers;
+static _Thread_local struct trace_buffer *trace_local;
+static pthread_key_t trace_key; // releases the buffer of each thread as it exits
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static const char *trace_path;
+#endif
+
+// Event sources of the main loop, as stored in each epoll event. Every evdev device is a source of
+// its own, numbered from SOURCE_EVDEV upwards.
+enum wb_source {
+    SOURCE_WAYLAND,
+    SOURCE_SIGNAL,
+    SOURCE_TIMER,
+    SOURCE_LIBINPUT,
+    SOURCE_EVDEV,
 };
 
 struct wayboard {
@@ -87,10 +363,161 @@ struct wayboard {
     struct cfg cfg;
     struct fcft_font *font;
 
+    // Text colours for each step of the release fade, computed once from the configuration. The
+    // foreground colour of each step is blended per key, since keys can override it.
+    struct {
+        pixman_color_t txt[FADE_STEPS];
+    } fade;
+
+    // Cache of rasterized text runs, looked up through a hash table and evicted in least recently
+    // used order once full.
+    struct {
+        struct wb_text {
+            struct wb_text *bucket_next;
+            struct wb_text *lru_prev, *lru_next;
+
+            uint64_t hash;
+            struct fcft_font *font;
+            enum fcft_subpixel subpixel;
+            char *str;
+
+            struct fcft_text_run *run;
+            int width, height;
+        } *entries, **buckets;
+        size_t num_entries, max_entries;
+        size_t num_buckets; // power of two
+        struct wb_text *lru_head, *lru_tail; // most and least recently used entries
+
+        // Scratch space for converting labels to UTF-32, as long as the longest label.
+        char32_t *utf32;
+        size_t utf32_len;
+
+        uint64_t hits, misses, evictions;
+    } text;
+
+    // Number of threads, including the calling one, which full redraws of large windows are split
+    // across.
+    size_t render_threads;
+
+    // Helpers for full redraws, started by init_render. Each redraw is handed out by bumping
+    // `generation`, and the calling thread then waits until no helper is `busy` with it any more.
+    struct {
+        struct render_helper {
+            pthread_t thread;
+            struct wayboard *wb;
+            size_t index; // index of the view of the target image which the helper draws through
+        } helpers[RENDER_MAX_THREADS - 1];
+        size_t num_helpers;
+
+        pthread_mutex_t lock;
+        pthread_cond_t wake, idle;
+        struct render_tiles *tiles;
+        uint64_t generation;
+        size_t busy;
+        bool stop;
+    } pool;
+
+    // Solid colours are drawn through a 1x1 repeating image whose pixel is rewritten before each
+    // use, and the line of the motion element is rasterized into a mask which is the size of the
+    // largest motion element, so that drawing either does not allocate.
+    pixman_image_t *solid;
+    pixman_image_t *motion_mask;
+
+    // Colour of labels in full redraws, which every thread draws through at once.
+    pixman_image_t *label_color;
+
+    // Coverage masks for rounded and bordered keys, shared between all keys with the same shape.
+    struct wb_shape {
+        struct wb_shape *next;
+
+        int w, h, radius, border;
+        pixman_image_t *outer; // coverage of the whole key
+        pixman_image_t *inner; // coverage of the key inside its border, or NULL without a border
+    } *shapes;
+
+    // Key icons, scaled to fit their key once at startup and shared between all keys which show
+    // the same image at the same size, so that drawing one is a single composite.
+    struct wb_icon {
+        struct wb_icon *next;
+
+        const char *path;
+        int box_w, box_h; // area which the image was scaled to fit within
+        pixman_image_t *image;
+    } *icons;
+
+    // Input backend. Only the state for the selected backend is initialized.
+    enum wb_backend {
+        BACKEND_LIBINPUT,
+        BACKEND_EVDEV,
+    } backend;
+
     // libinput state
     struct libinput *libinput;
     struct udev *udev;
 
+    // evdev state
+    struct wb_evdev {
+        int fd;
+        bool dropped; // events are being discarded until the next SYN_REPORT
+
+        // Absolute axes are only read from gamepads and joysticks, since touchpads and tablets
+        // report positions on the same axes.
+        bool gamepad;
+        uint64_t abs_bits; // axes which the device has
+        struct {
+            int32_t min, max;
+        } abs[ABS_CNT];
+        int hat[2]; // last value of ABS_HAT0X and ABS_HAT0Y, which are also shown as d-pad buttons
+
+        struct wb_rate *rate; // report intervals of the device, once it has reported
+    } evdev[MAX_EVDEV_DEVICES];
+    size_t num_evdev;
+
+    // Input path statistics, if enabled with `--stats`.
+    struct {
+        bool enabled;
+
+        uint64_t events, batches;
+        uint64_t cpu_nsec;
+        uint64_t latency_sum_usec, latency_max_usec;
+    } stats;
+
+    // Report interval analyzer, if enabled with `--analyze` or by a `rate` element. Every input
+    // device which reports gets a histogram of the intervals between its reports, up to as many
+    // devices as the evdev backend can open, so that the analyzer runs in constant memory however
+    // long the session is. Events which share a timestamp came from the same report.
+    struct {
+        bool enabled;
+
+        struct wb_rate {
+            char name[64];
+            uint64_t last_usec;
+            uint64_t reports, idle; // idle is the number of intervals of RATE_IDLE_USEC or more
+            struct {
+                uint64_t count, sum, sum_sq; // number of intervals, their sum and sum of squares
+            } buckets[RATE_BUCKETS];
+        } *devices;
+        size_t num_devices;
+
+        struct wb_rate *last; // device which reported most recently, which is shown on the overlay
+        uint64_t reports;     // number of reports from every device so far
+    } rate;
+
+    // Shared memory segment for other local processes, if enabled.
+    struct wb_shm *shm;
+
+    // Session recorder, if enabled. The log file is mapped up to its maximum size once and the
+    // file itself is grown in chunks, so recording an event is a single store in the common case.
+    struct {
+        int fd;
+        uint32_t sequence;
+        size_t map_size, file_size;
+
+        struct wb_log_header *header;
+        struct wb_log_record *pos, *end, *limit;
+        struct wb_log_record *synced; // end of the records which have been synced
+    } rec;
+
     // Wayland state
     struct {
         struct wl_display *display;
@@ -99,32 +526,199 @@ struct wayboard {
         struct wl_compositor *compositor;
         struct wl_shm *shm;
         struct xdg_wm_base *xdg_wm_base;
-
-        struct wl_buffer *buffer;
-        struct wl_surface *surface;
-        struct xdg_surface *xdg_surface;
-        struct xdg_toplevel *xdg_toplevel;
-
-        struct wl_callback *frame_cb;
     } wl;
 
-    // General state
+    // Windows, one per layout in the configuration. All windows are driven by the same input
+    // events and share the font.
+    struct wb_window {
+        struct wayboard *wb;
+        struct cfg_window *cfg; // layout of the current profile
+
+        // Layout of each profile. With more than one profile, every layout is drawn with no keys
+        // pressed up front, so that switching to it is a single copy into the buffer.
+        struct wb_layout {
+            struct cfg_window *cfg;
+            pixman_image_t *idle; // NULL with a single profile
+            struct wb_shape *shapes[MAX_KEYS]; // shape of each key, or NULL for plain rectangles
+            struct wb_icon *icons[MAX_KEYS][2]; // inactive and active icon of each key, if any
+
+            // Keys are drawn in order of their codes, so a key with a higher code is on top of any
+            // key with a lower one which it overlaps. Each key which overlaps others has a list of
+            // those keys and itself, in drawing order; keys which overlap nothing have none. The
+            // lists all point into `overlap_keys`.
+            uint16_t *overlaps[MAX_KEYS];
+            uint16_t num_overlaps[MAX_KEYS];
+            uint16_t *overlap_keys;
+        } *layouts, *layout;
+
+        struct {
+            struct wl_buffer *buffer;
+            struct wl_surface *surface;
+            struct xdg_surface *xdg_surface;
+            struct xdg_toplevel *xdg_toplevel;
+
+            struct wl_callback *frame_cb;
+        } wl;
+
+        struct {
+            pixman_image_t *pixman_image;
+            pixman_image_t *tile_views[RENDER_MAX_THREADS]; // one per thread of full redraws
+            int shm_fd;
+            void *shm_data;
+            bool buf_released;
+            bool dirty; // the buffer has been damaged since the last commit
+
+            // Damage which is sent along with the next commit.
+            pixman_box32_t damage[DAMAGE_MAX_BOXES];
+            size_t num_damage;
+
+            // How each key was last drawn, so that keys which overlap one that changes can be drawn
+            // again just as they were.
+            enum wb_look {
+                LOOK_IDLE,      // as in the idle layout, with no fill
+                LOOK_HIDDEN,    // not at all, once the press duration shown in threshold expired
+                LOOK_INACTIVE,  // filled, after fading out
+                LOOK_FADING,    // at `fade_step`
+                LOOK_PRESSED,   // filled with the active colours
+                LOOK_THRESHOLD, // showing the press duration
+            } look[MAX_KEYS];
+
+            uint32_t last_render;
+
+            // Keys which need work on every frame, either because they are fading out or because
+            // they are showing their press duration. Frame callbacks are only requested while this
+            // set is non-empty or there is damage left to commit.
+            uint16_t active[MAX_KEYS];
+            size_t num_active;
+            bool is_active[MAX_KEYS];
+            uint8_t fade_step[MAX_KEYS]; // fade step which was last drawn for each active key
+
+            // Keys which changed while the compositor was still reading from the buffer. They are
+            // drawn as soon as the buffer is released, along with the whole layout if the profile
+            // was switched in the meantime.
+            uint16_t pending[MAX_KEYS];
+            size_t num_pending;
+            bool is_pending[MAX_KEYS];
+            bool pending_layout;
+
+            // Pointer totals as of the last time the pointer elements were drawn. The elements keep
+            // being drawn every frame until they have come to rest.
+            struct {
+                uint64_t events, usec;
+                double dx, dy;
+                bool active;
+            } pointer;
+
+            // Number of gamepad axis events as of the last time the gamepad elements were drawn.
+            struct {
+                uint64_t events;
+            } gamepad;
+
+            // Number of reports as of the last time the report rate element was looked at, and the
+            // rate which it shows, so that it is only drawn when the shown rate changes.
+            struct {
+                uint64_t reports;
+                int hz;
+            } rate;
+
+            // Whether a key is shown in threshold depends on when this window last rendered it,
+            // so this cannot live in the shared key state.
+            uint64_t unrender_at_usec[MAX_KEYS];
+        } state;
+    } *windows;
+    size_t num_windows;
+
+    // Pointer motion and scrolling, kept as running totals so that the elements showing them are
+    // drawn at most once per frame, however often the device reports.
     struct {
-        pixman_image_t *pixman_image;
-        int shm_fd;
-        void *shm_data;
-        bool buf_released;
+        uint64_t events;        // number of motion and scroll events so far
+        double dx, dy;          // total unaccelerated motion
+        uint64_t scroll_usec;   // time of the last scroll event
+        int scroll_x, scroll_y; // scrolling in the current burst, in 1/120ths of a wheel tick
+    } pointer;
+
+    // Latest value of every gamepad axis, scaled from the range of the device which last reported
+    // it to [-1, 1]. Like the pointer totals, axes are only stored here as they change and are
+    // drawn at most once per frame. Axes which have never been reported are shown at rest.
+    struct {
+        uint64_t events;
+        uint64_t reported;
+        double axes[ABS_CNT];
+    } gamepad;
 
+    // General state
+    struct {
         bool should_close;
-        uint32_t last_render;
+        size_t profile;
+        uint64_t offline_usec; // time to render at instead of the current time, when offline
 
         struct wb_key_state {
             uint64_t last_press_usec, last_release_usec;
-            uint64_t unrender_at_usec;
         } keys[MAX_KEYS];
     } state;
 };
 
+// Offline render of a session log, as started with `--render`. Every worker renders whole chunks
+// of frames with its own copy of the render state, starting from the key state at the start of its
+// chunk, while the main thread writes finished chunks out in order.
+struct offline {
+    // Options
+    const char *log_path, *out_path;
+    enum offline_format {
+        OFFLINE_RGBA,
+        OFFLINE_Y4M,
+    } format;
+    int fps;
+    size_t window, num_threads;
+
+    struct wayboard *wb; // configuration, font, shapes and icons, which every worker shares
+    FILE *out;
+
+    struct wb_log_record *records;
+    size_t num_records;
+    uint64_t start_usec; // time of the first frame
+    size_t num_frames, frame_size, chunk_frames, num_chunks;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct offline_chunk {
+        uint8_t *frames; // allocated once the chunk has been claimed by a worker
+        bool done;
+    } *chunks;
+    size_t next_chunk, written;
+    bool failed;
+
+    // Key state as of the start of `next_chunk`, which is brought forward as chunks are claimed.
+    struct wb_key_state keys[MAX_KEYS];
+    size_t next_record;
+};
+
+// Full redraw of an image, either of a layout with no keys pressed or as a copy of another image.
+// The image is split into tiles which each span its whole width, and which are claimed in turn by
+// the calling thread and its helpers. Every thread draws into the shared pixels through an image of
+// its own, which is clipped to the tile being drawn.
+struct render_tiles {
+    struct wayboard *wb;
+    struct wb_layout *layout;
+    pixman_image_t *image;
+    pixman_image_t *src; // image to copy from, or NULL to draw the layout
+    int width, height;
+
+    // Label of every key which shows one and the rows which its label or icon covers, found up
+    // front since the text cache can only be used from one thread.
+    struct wb_text *texts[MAX_KEYS];
+    struct {
+        int top, bottom;
+    } rows[MAX_KEYS];
+
+    // Views of `image` which each thread clips to the tile it is drawing, by thread index.
+    pixman_image_t **views;
+
+    size_t num_tiles;
+    _Atomic size_t next_tile;
+    bool damaged[RENDER_MAX_TILES]; // tiles whose pixels were changed
+};
+
 static const struct wl_buffer_listener buffer_listener;
 static const struct wl_callback_listener callback_frame_listener;
 static const struct wl_registry_listener registry_listener;
@@ -135,34 +729,168 @@ static const struct xdg_toplevel_listener xdg_toplevel_listener;
 static void cfg_destroy(struct cfg *cfg);
 static int cfg_read(struct cfg *cfg, config_t *conf);
 static int cfg_read_color(const char *color_str, pixman_color_t *out);
+static int cfg_read_chord(struct cfg_profile *profile, config_setting_t *setting);
 static int cfg_read_colors(struct cfg *cfg, config_t *conf);
-static int cfg_read_keys(struct cfg *cfg, config_t *conf);
+static int cfg_read_gamepad(struct cfg_window *win, config_setting_t *setting);
+static int cfg_read_key_style(struct cfg *cfg, struct cfg_key *key, config_setting_t *setting,
+                              size_t index);
+static int cfg_read_keys(struct cfg *cfg, struct cfg_window *win, config_setting_t *setting);
+static int cfg_read_pointer(struct cfg_window *win, config_setting_t *setting);
+static int cfg_read_profiles(struct cfg *cfg, config_t *conf);
+static int cfg_read_record(struct cfg *cfg, config_t *conf);
 static int cfg_read_toplevel(struct cfg *cfg, config_t *conf);
+static int cfg_read_window(struct cfg *cfg, struct cfg_window *win, config_setting_t *setting);
+static int cfg_read_windows(struct cfg *cfg, config_t *conf);
+static void evdev_axis(struct wayboard *wb, struct wb_evdev *dev, uint16_t axis, int32_t value,
+                       uint64_t usec);
+static inline uint32_t evdev_code(uint16_t code);
+static void evdev_probe_axes(struct wayboard *wb, struct wb_evdev *dev);
+static void evdev_resync(struct wayboard *wb, struct wb_evdev *dev);
+static uint64_t hash_bytes(const void *data, size_t len);
+static pixman_image_t *icon_decode_farbfeld(FILE *file, const char *path);
+#ifdef WAYBOARD_PNG
+static pixman_image_t *icon_decode_png(FILE *file, const char *path);
+#endif
+static pixman_image_t *icon_load(const char *path);
+static inline uint32_t icon_pixel(uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+static pixman_image_t *icon_scale(pixman_image_t *src, int box_w, int box_h);
+static int init_evdev(struct wayboard *wb);
+static void init_fade(struct wayboard *wb);
 static int init_fcft(struct wayboard *wb);
+static int init_icons(struct wayboard *wb);
 static int init_libinput(struct wayboard *wb);
-static int init_read_config(struct wayboard *wb, const char *path);
+static void init_overlaps(struct wayboard *wb);
+static void init_rate(struct wayboard *wb);
+static int init_read_config(struct wayboard *wb, const char *path, const char *snapshot_path);
+static int init_recorder(struct wayboard *wb);
 static int init_render(struct wayboard *wb);
+static void init_render_pool(struct wayboard *wb);
+static int init_shapes(struct wayboard *wb);
+static int init_shm(struct wayboard *wb);
+static void init_text(struct wayboard *wb);
 static int init_wayland(struct wayboard *wb);
-static void render_frame(struct wayboard *wb);
-static void render_key(struct wayboard *wb, uint32_t keycode);
-static void render_key_text(struct wayboard *wb, struct cfg_key *key, const pixman_color_t *text,
-                            const char *text_str);
+static int init_window(struct wayboard *wb, struct wb_window *win);
+static void offline_convert(struct offline *off, pixman_image_t *image, uint8_t *out);
+static inline uint64_t offline_frame_usec(struct offline *off, size_t frame);
+static int offline_read_file(struct offline *off, uint32_t sequence, uint64_t *start_usec,
+                             bool *end);
+static int offline_read_log(struct offline *off);
+static void offline_render_chunk(struct offline *off, struct wb_window *win, size_t chunk,
+                                 size_t record);
+static int offline_run(struct wayboard *wb, struct offline *off, const char *config_path,
+                       const char *snapshot_path);
+static void *offline_worker(void *data);
+static struct wb_rate *rate_add(struct wayboard *wb, const char *name);
+static inline size_t rate_bucket(uint64_t interval);
+static uint64_t rate_bucket_usec(size_t bucket);
+static bool rate_estimate(const struct wb_rate *rate, double *interval, double *jitter);
+static struct wb_rate *rate_evdev(struct wayboard *wb, struct wb_evdev *dev);
+static struct wb_rate *rate_libinput(struct wayboard *wb, struct libinput_event *event);
+static void rate_print(struct wayboard *wb);
+static inline void rate_record(struct wayboard *wb, struct wb_rate *rate, uint64_t usec);
+static void recorder_close(struct wayboard *wb);
+static void recorder_flush(struct wayboard *wb);
+static int recorder_grow(struct wayboard *wb);
+static int recorder_open(struct wayboard *wb);
+static void recorder_sync(struct wayboard *wb);
+static inline void recorder_write(struct wayboard *wb, uint32_t code, bool pressed, uint64_t usec);
+static void render_activate(struct wb_window *win, uint32_t keycode);
+static void render_analyzer(struct wb_window *win);
+static pixman_image_t *render_coverage_mask(int w, int h, int inset, int radius);
+static void render_damage(struct wb_window *win, int32_t x, int32_t y, int32_t w, int32_t h);
+static void render_defer(struct wb_window *win, uint32_t keycode);
+static pixman_color_t render_blend_color(const pixman_color_t *from, const pixman_color_t *to,
+                                         size_t num, size_t den);
+static inline size_t render_fade_step(struct wayboard *wb, struct wb_key_state *ks, uint64_t now);
+static void render_frame(struct wb_window *win);
+static void render_gamepad(struct wb_window *win);
+static void render_key(struct wb_window *win, uint32_t keycode);
+static void render_key_draw(struct wb_window *win, uint32_t keycode);
+static void render_key_fill(struct wb_window *win, struct cfg_key *key, struct wb_shape *shape,
+                            const pixman_color_t *fill);
+static void render_key_icon(pixman_image_t *image, struct cfg_key *key, struct wb_icon *icon);
+static void render_key_chars(struct wayboard *wb, pixman_image_t *image, struct cfg_key *key,
+                             const pixman_color_t *text, const char *str);
+static void render_key_redraw(struct wb_window *win, uint32_t keycode);
+static void render_key_text(struct wayboard *wb, pixman_image_t *image, struct cfg_key *key,
+                            const pixman_color_t *text, const char *text_str);
+static inline bool render_keys_overlap(const struct cfg_key *a, const struct cfg_key *b);
+static void render_layout(struct wayboard *wb, struct wb_layout *layout, pixman_image_t *image);
+static void render_layout_inputs(struct wayboard *wb, struct cfg_window *cfg,
+                                 pixman_image_t *image);
+static inline uint64_t render_now(struct wayboard *wb);
+static void render_motion(struct wayboard *wb, pixman_image_t *image, struct cfg_motion *motion,
+                          double vx, double vy);
+static void render_pending(struct wb_window *win);
+static void render_pointer(struct wb_window *win);
+static void *render_pool_worker(void *data);
+static void render_profile(struct wb_window *win);
+static void render_rate(struct wayboard *wb, pixman_image_t *image, struct cfg_rate *rate, int hz);
+static pixman_image_t *render_solid(struct wayboard *wb, const pixman_color_t *color);
+static void render_scroll(struct wayboard *wb, pixman_image_t *image, struct cfg_scroll *scroll,
+                          int x, int y);
+static void render_stick(struct wayboard *wb, pixman_image_t *image, struct cfg_stick *stick,
+                         double x, double y);
+static void render_text_draw(struct wayboard *wb, pixman_image_t *image, pixman_image_t *color,
+                             struct wb_text *entry, int x, int y);
+static void render_text_evict(struct wayboard *wb);
+static struct wb_text *render_text_lookup(struct wayboard *wb, const char *str);
+static struct fcft_text_run *render_text_rasterize(struct wayboard *wb, const char *str,
+                                                   enum fcft_subpixel subpixel);
+static void render_text_touch(struct wayboard *wb, struct wb_text *entry);
+static void render_tiled(struct wb_window *win, struct wb_layout *layout, pixman_image_t *image,
+                         pixman_image_t *src);
+static void render_tiles_draw(struct render_tiles *tiles, size_t index);
+static void render_trapezoids(const pixman_triangle_t *tri, pixman_trapezoid_t *traps);
+static void render_trigger(struct wayboard *wb, pixman_image_t *image, struct cfg_trigger *trigger,
+                           double value);
+static void render_validate(pixman_image_t *image);
+static bool snapshot_check_window(const struct cfg_window *win);
+static int snapshot_compile(const char *config_path, const char *out_path);
+static int snapshot_hash_file(const char *path, uint64_t *out);
+static uint32_t snapshot_intern(struct snapshot_strings *strings, const char *str);
+static int snapshot_load(struct cfg *cfg, const char *snapshot_path, const char *config_path);
+#ifdef WAYBOARD_TRACE
+static void trace_dump();
+static void trace_end(struct trace_span *span);
+static void trace_init_key();
+static inline uint64_t trace_now();
+static void trace_release(void *data);
+#endif
+static inline uint64_t nsec_cpu_now();
 static inline uint64_t usec_now();
-static void wayboard_commit_frame(struct wayboard *wb, uint32_t time);
+static bool wayboard_check_chords(struct wayboard *wb, uint32_t code);
+static void wayboard_commit_frame(struct wb_window *win, uint32_t time);
+static int wayboard_epoll_add(int epoll_fd, int fd, uint64_t source);
+static void wayboard_fini_icons(struct wayboard *wb);
+static void wayboard_fini_input(struct wayboard *wb);
+static void wayboard_fini_overlaps(struct wayboard *wb);
+static void wayboard_fini_render(struct wayboard *wb);
+static void wayboard_fini_shapes(struct wayboard *wb);
+static void wayboard_fini_shm(struct wayboard *wb);
+static void wayboard_fini_text(struct wayboard *wb);
 static void wayboard_fini_wl(struct wayboard *wb);
+static void wayboard_fini_window(struct wb_window *win);
+static void wayboard_flush_frames(struct wayboard *wb);
 static void wayboard_process_key(struct wayboard *wb, uint32_t keycode,
                                  enum libinput_key_state state, uint64_t usec);
 static void wayboard_process_code(struct wayboard *wb, uint32_t code, bool pressed,
                                   uint64_t usec);
+static int wayboard_process_evdev(struct wayboard *wb, struct wb_evdev *dev);
 static int wayboard_process_libinput(struct wayboard *wb);
+static inline void wayboard_process_motion(struct wayboard *wb, double dx, double dy);
+static inline void wayboard_process_scroll(struct wayboard *wb, int x, int y, uint64_t usec);
+static void wayboard_process_signals(struct wayboard *wb, int fd);
+static void wayboard_print_stats(struct wayboard *wb);
 static int wayboard_run(struct wayboard *wb);
-static void wayboard_spin_buffer_release(struct wayboard *wb);
+static void wayboard_switch_profile(struct wayboard *wb, size_t index);
 
 static void
 on_buffer_release(void *data, struct wl_buffer *buffer) {
-    struct wayboard *wb = data;
+    struct wb_window *win = data;
 
-    wb->state.buf_released = true;
+    win->state.buf_released = true;
+    render_pending(win);
 }
 
 static const struct wl_buffer_listener buffer_listener = {
@@ -171,12 +899,24 @@ static const struct wl_buffer_listener buffer_listener = {
 
 static void
 on_callback_frame_done(void *data, struct wl_callback *callback, uint32_t time) {
-    struct wayboard *wb = data;
+    TRACE_SPAN("frame_callback");
 
-    render_frame(wb);
+    struct wb_window *win = data;
 
-    wayboard_commit_frame(wb, time);
     wl_callback_destroy(callback);
+    win->wl.frame_cb = NULL;
+
+    // The frame is drawn once the buffer has been released if the compositor still holds it.
+    if (!win->state.buf_released) {
+        return;
+    }
+
+    render_frame(win);
+
+    // Only keep the frame loop going while something is animating or there is damage to show.
+    if (win->state.dirty || win->state.num_active > 0 || win->state.pointer.active) {
+        wayboard_commit_frame(win, time);
+    }
 }
 
 static const struct wl_callback_listener callback_frame_listener = {
@@ -247,10 +987,10 @@ static const struct xdg_wm_base_listener xdg_wm_base_listener = {
 
 static void
 on_xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial) {
-    struct wayboard *wb = data;
+    struct wb_window *win = data;
 
     xdg_surface_ack_configure(xdg_surface, serial);
-    wl_surface_commit(wb->wl.surface);
+    wl_surface_commit(win->wl.surface);
 }
 
 static const struct xdg_surface_listener xdg_surface_listener = {
@@ -259,9 +999,9 @@ static const struct xdg_surface_listener xdg_surface_listener = {
 
 static void
 on_xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel) {
-    struct wayboard *wb = data;
+    struct wb_window *win = data;
 
-    wb->state.should_close = true;
+    win->wb->state.should_close = true;
 }
 
 static void
@@ -300,16 +1040,39 @@ static const struct libinput_interface libinput_iface = {
 
 static void
 cfg_destroy(struct cfg *cfg) {
+    if (cfg->snapshot) {
+        free(cfg->windows);
+        free(cfg->profiles);
+        munmap(cfg->snapshot, cfg->snapshot_size);
+        return;
+    }
+
     free(cfg->font);
+    free(cfg->shm_name);
+    free(cfg->record_path);
 
-    for (size_t i = 0; i < ARRAY_LEN(cfg->keys); i++) {
-        if (cfg->keys[i].text_active) {
-            free(cfg->keys[i].text_active);
-        }
-        if (cfg->keys[i].text_inactive) {
-            free(cfg->keys[i].text_inactive);
+    for (size_t i = 0; i < cfg->num_profiles; i++) {
+        free(cfg->profiles[i].name);
+    }
+    free(cfg->profiles);
+
+    // The windows of every profile are freed, even if reading the profiles failed part way.
+    for (size_t i = 0; i < cfg->num_windows * MAX(cfg->num_profiles, 1); i++) {
+        struct cfg_window *win = &cfg->windows[i];
+
+        free(win->name);
+        for (size_t j = 0; j < ARRAY_LEN(win->keys); j++) {
+            if (win->keys[j].text_active) {
+                free(win->keys[j].text_active);
+            }
+            if (win->keys[j].text_inactive) {
+                free(win->keys[j].text_inactive);
+            }
+            free(win->keys[j].icon_active);
+            free(win->keys[j].icon_inactive);
         }
     }
+    free(cfg->windows);
 }
 
 static int
@@ -322,11 +1085,48 @@ cfg_read(struct cfg *cfg, struct config_t *conf) {
         return 1;
     }
 
-    if (cfg_read_keys(cfg, conf) != 0) {
-        free(cfg->font);
+    if (cfg_read_record(cfg, conf) != 0) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+
+    if (cfg_read_windows(cfg, conf) != 0) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+
+    if (cfg_read_profiles(cfg, conf) != 0) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+cfg_read_chord(struct cfg_profile *profile, config_setting_t *setting) {
+    if (!setting) {
+        return 0;
+    }
+
+    size_t len = config_setting_length(setting);
+    if (!config_setting_is_array(setting) || len == 0 || len > MAX_CHORD) {
+        fprintf(stderr, "invalid chord for profile '%s' set in config\n", profile->name);
         return 1;
     }
 
+    for (size_t i = 0; i < len; i++) {
+        int code = config_setting_get_int_elem(setting, i);
+        if (code <= 0 || code >= MAX_KEYS) {
+            fprintf(stderr, "invalid scancode %d in chord for profile '%s'\n", code,
+                    profile->name);
+            return 1;
+        }
+
+        profile->chord[i] = code;
+    }
+    profile->chord_len = len;
+
     return 0;
 }
 
@@ -376,6 +1176,7 @@ cfg_read_colors(struct cfg *cfg, config_t *conf) {
         {"foreground_inactive", &cfg->fg_inactive, false},
         {"text_active", &cfg->txt_active, true},
         {"text_inactive", &cfg->txt_inactive, true},
+        {"border_color", &cfg->border_color, true},
     };
     for (size_t i = 0; i < ARRAY_LEN(colors); i++) {
         const struct config_color *color = &colors[i];
@@ -395,81 +1196,338 @@ cfg_read_colors(struct cfg *cfg, config_t *conf) {
         }
     }
 
+    // Borders default to the active foreground colour so that setting `border` is enough.
+    if (!config_lookup_string(conf, "border_color", &color_str)) {
+        cfg->border_color = cfg->fg_active;
+    }
+
+    return 0;
+}
+
+static int
+cfg_read_gamepad(struct cfg_window *win, config_setting_t *setting) {
+    config_setting_t *sticks = config_setting_get_member(setting, "sticks");
+    config_setting_t *triggers = config_setting_get_member(setting, "triggers");
+    size_t num_sticks = sticks ? config_setting_length(sticks) : 0;
+    size_t num_triggers = triggers ? config_setting_length(triggers) : 0;
+    if (num_sticks > MAX_STICKS) {
+        fprintf(stderr, "invalid number of sticks (%zu) set in config\n", num_sticks);
+        return 1;
+    }
+    if (num_triggers > MAX_TRIGGERS) {
+        fprintf(stderr, "invalid number of triggers (%zu) set in config\n", num_triggers);
+        return 1;
+    }
+
+    for (size_t i = 0; i < num_sticks; i++) {
+        config_setting_t *elem = config_setting_get_elem(sticks, i);
+        config_setting_t *axes = elem ? config_setting_get_member(elem, "axes") : NULL;
+        struct cfg_stick *stick = &win->sticks[i];
+
+        if (!elem || !config_setting_lookup_int(elem, "x", &stick->x) ||
+            !config_setting_lookup_int(elem, "y", &stick->y) ||
+            !config_setting_lookup_int(elem, "w", &stick->w) ||
+            !config_setting_lookup_int(elem, "h", &stick->h) || stick->w <= 0 || stick->h <= 0 ||
+            !axes || config_setting_length(axes) != 2) {
+            fprintf(stderr, "invalid stick %zu set in config\n", i);
+            return 1;
+        }
+
+        stick->axis_x = config_setting_get_int_elem(axes, 0);
+        stick->axis_y = config_setting_get_int_elem(axes, 1);
+        if (stick->axis_x < 0 || stick->axis_x >= ABS_CNT || stick->axis_y < 0 ||
+            stick->axis_y >= ABS_CNT) {
+            fprintf(stderr, "invalid axes set on stick %zu in config\n", i);
+            return 1;
+        }
+    }
+    win->num_sticks = num_sticks;
+
+    for (size_t i = 0; i < num_triggers; i++) {
+        config_setting_t *elem = config_setting_get_elem(triggers, i);
+        struct cfg_trigger *trigger = &win->triggers[i];
+
+        if (!elem || !config_setting_lookup_int(elem, "x", &trigger->x) ||
+            !config_setting_lookup_int(elem, "y", &trigger->y) ||
+            !config_setting_lookup_int(elem, "w", &trigger->w) ||
+            !config_setting_lookup_int(elem, "h", &trigger->h) || trigger->w <= 0 ||
+            trigger->h <= 0 || !config_setting_lookup_int(elem, "axis", &trigger->axis)) {
+            fprintf(stderr, "invalid trigger %zu set in config\n", i);
+            return 1;
+        }
+        if (trigger->axis < 0 || trigger->axis >= ABS_CNT) {
+            fprintf(stderr, "invalid axis (%d) set on trigger %zu in config\n", trigger->axis, i);
+            return 1;
+        }
+    }
+    win->num_triggers = num_triggers;
+
+    return 0;
+}
+
+static int
+cfg_read_key_style(struct cfg *cfg, struct cfg_key *key, config_setting_t *setting, size_t index) {
+    key->radius = cfg->radius;
+    key->border = cfg->border;
+    key->fg_active = cfg->fg_active;
+    key->fg_inactive = cfg->fg_inactive;
+    key->border_color = cfg->border_color;
+
+    config_setting_lookup_int(setting, "radius", &key->radius);
+    config_setting_lookup_int(setting, "border", &key->border);
+    if (key->radius < 0 || key->border < 0) {
+        fprintf(stderr, "invalid 'radius' or 'border' property set on key %zu in config\n", index);
+        return 1;
+    }
+
+    const struct config_color {
+        const char *name;
+        pixman_color_t *out;
+    } colors[] = {
+        {"foreground_active", &key->fg_active},
+        {"foreground_inactive", &key->fg_inactive},
+        {"border_color", &key->border_color},
+    };
+    for (size_t i = 0; i < ARRAY_LEN(colors); i++) {
+        const char *color_str;
+        if (!config_setting_lookup_string(setting, colors[i].name, &color_str)) {
+            continue;
+        }
+
+        if (cfg_read_color(color_str, colors[i].out) != 0) {
+            fprintf(stderr, "invalid color '%s' for property '%s' on key %zu\n", color_str,
+                    colors[i].name, index);
+            return 1;
+        }
+    }
+
     return 0;
 }
 
 static int
-cfg_read_keys(struct cfg *cfg, config_t *conf) {
-    config_setting_t *keys = config_lookup(conf, "keys");
+cfg_read_keys(struct cfg *cfg, struct cfg_window *win, config_setting_t *setting) {
+    config_setting_t *keys = config_setting_get_member(setting, "keys");
     if (!keys) {
         fprintf(stderr, "no 'keys' table set in config\n");
         return 1;
     }
 
+    // Any strings which were duplicated before a failure are freed by `cfg_destroy`.
     size_t num_keys = config_setting_length(keys);
     bool keys_set[MAX_KEYS] = {0};
-    size_t i = 0;
-    for (i = 0; i < num_keys; i++) {
+    for (size_t i = 0; i < num_keys; i++) {
         config_setting_t *key = config_setting_get_elem(keys, i);
         assert(key);
 
         int code;
         if (!config_setting_lookup_int(key, "scancode", &code)) {
             fprintf(stderr, "no 'scancode' property set on key %zu in config\n", i);
-            goto fail_key;
+            return 1;
         }
         if (code < 0 || code >= MAX_KEYS) {
             fprintf(stderr, "invalid 'scancode' property %d set on key %zu in config\n", code, i);
-            goto fail_key;
+            return 1;
         }
 
         if (keys_set[code]) {
             fprintf(stderr, "more than one key uses scancode %d\n", code);
-            goto fail_key;
+            return 1;
         }
         keys_set[code] = true;
 
-        if (!config_setting_lookup_int(key, "x", &cfg->keys[code].x)) {
+        if (!config_setting_lookup_int(key, "x", &win->keys[code].x)) {
             fprintf(stderr, "no 'x' property set on key %zu in config\n", i);
-            goto fail_key;
+            return 1;
         }
-        if (!config_setting_lookup_int(key, "y", &cfg->keys[code].y)) {
+        if (!config_setting_lookup_int(key, "y", &win->keys[code].y)) {
             fprintf(stderr, "no 'y' property set on key %zu in config\n", i);
-            goto fail_key;
+            return 1;
         }
-        if (!config_setting_lookup_int(key, "w", &cfg->keys[code].w)) {
+        if (!config_setting_lookup_int(key, "w", &win->keys[code].w)) {
             fprintf(stderr, "no 'w' property set on key %zu in config\n", i);
-            goto fail_key;
+            return 1;
         }
-        if (!config_setting_lookup_int(key, "h", &cfg->keys[code].h)) {
+        if (!config_setting_lookup_int(key, "h", &win->keys[code].h)) {
             fprintf(stderr, "no 'h' property set on key %zu in config\n", i);
-            goto fail_key;
+            return 1;
         }
 
         const char *text_str;
         if (config_setting_lookup_string(key, "text_active", &text_str)) {
-            cfg->keys[code].text_active = strdup(text_str);
-            assert(cfg->keys[code].text_active);
+            win->keys[code].text_active = strdup(text_str);
+            assert(win->keys[code].text_active);
         }
         if (config_setting_lookup_string(key, "text_inactive", &text_str)) {
-            cfg->keys[code].text_inactive = strdup(text_str);
-            assert(cfg->keys[code].text_inactive);
+            win->keys[code].text_inactive = strdup(text_str);
+            assert(win->keys[code].text_inactive);
+        }
+
+        const char *icon_str;
+        if (config_setting_lookup_string(key, "icon_active", &icon_str)) {
+            win->keys[code].icon_active = strdup(icon_str);
+            assert(win->keys[code].icon_active);
+        }
+        if (config_setting_lookup_string(key, "icon_inactive", &icon_str)) {
+            win->keys[code].icon_inactive = strdup(icon_str);
+            assert(win->keys[code].icon_inactive);
+        }
+
+        if (cfg_read_key_style(cfg, &win->keys[code], key, i) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+cfg_read_pointer(struct cfg_window *win, config_setting_t *setting) {
+    struct {
+        const char *name;
+        int *x, *y, *w, *h;
+    } elements[] = {
+        {"motion", &win->motion.x, &win->motion.y, &win->motion.w, &win->motion.h},
+        {"scroll", &win->scroll.x, &win->scroll.y, &win->scroll.w, &win->scroll.h},
+        // The report rate element is a plain rectangle like the pointer elements, so it is read
+        // along with them.
+        {"rate", &win->rate.x, &win->rate.y, &win->rate.w, &win->rate.h},
+    };
+
+    for (size_t i = 0; i < ARRAY_LEN(elements); i++) {
+        config_setting_t *element = config_setting_get_member(setting, elements[i].name);
+        if (!element) {
+            continue;
+        }
+
+        if (!config_setting_lookup_int(element, "x", elements[i].x) ||
+            !config_setting_lookup_int(element, "y", elements[i].y) ||
+            !config_setting_lookup_int(element, "w", elements[i].w) ||
+            !config_setting_lookup_int(element, "h", elements[i].h) || *elements[i].w <= 0 ||
+            *elements[i].h <= 0) {
+            fprintf(stderr, "invalid '%s' element set in config\n", elements[i].name);
+            return 1;
         }
     }
 
+    win->motion.speed = MOTION_DEFAULT_SPEED;
+    config_setting_t *motion = config_setting_get_member(setting, "motion");
+    if (motion && config_setting_lookup_int(motion, "speed", &win->motion.speed) &&
+        win->motion.speed <= 0) {
+        fprintf(stderr, "invalid motion speed (%d) set in config\n", win->motion.speed);
+        return 1;
+    }
+
     return 0;
+}
+
+static int
+cfg_read_profiles(struct cfg *cfg, config_t *conf) {
+    config_setting_t *profiles = config_lookup(conf, "profiles");
+    size_t num_profiles = 1 + (profiles ? config_setting_length(profiles) : 0);
+    if (num_profiles > MAX_PROFILES) {
+        fprintf(stderr, "invalid number of profiles (%zu) set in config\n", num_profiles);
+        return 1;
+    }
+
+    cfg->profiles = calloc(num_profiles, sizeof(*cfg->profiles));
+    assert(cfg->profiles);
+    cfg->num_profiles = 1;
+    cfg->profiles[0].name = strdup("default");
+    assert(cfg->profiles[0].name);
+    if (cfg_read_chord(&cfg->profiles[0], config_lookup(conf, "default_chord")) != 0) {
+        return 1;
+    }
+    if (!profiles) {
+        return 0;
+    }
+
+    // Every profile gets a copy of the windows of the default profile, with its own key table.
+    struct cfg_window *windows =
+        realloc(cfg->windows, num_profiles * cfg->num_windows * sizeof(*windows));
+    assert(windows);
+    memset(windows + cfg->num_windows, 0,
+           (num_profiles - 1) * cfg->num_windows * sizeof(*windows));
+    cfg->windows = windows;
+    cfg->num_profiles = num_profiles;
+
+    bool multi_window = config_lookup(conf, "windows") != NULL;
+    for (size_t i = 1; i < num_profiles; i++) {
+        config_setting_t *profile = config_setting_get_elem(profiles, i - 1);
+        assert(profile);
+
+        const char *name_str;
+        if (!config_setting_lookup_string(profile, "name", &name_str) || !*name_str) {
+            fprintf(stderr, "no 'name' property set on profile %zu in config\n", i);
+            return 1;
+        }
+        cfg->profiles[i].name = strdup(name_str);
+        assert(cfg->profiles[i].name);
+
+        if (cfg_read_chord(&cfg->profiles[i], config_setting_get_member(profile, "chord")) != 0) {
+            return 1;
+        }
 
-fail_key:
-    for (size_t j = 0; j < i; j++) {
-        if (cfg->keys[j].text_active) {
-            free(cfg->keys[j].text_active);
+        // Profiles of a configuration with a `windows` list have a matching `windows` list of their
+        // own, and otherwise have their keys directly.
+        config_setting_t *profile_windows = profile;
+        if (multi_window) {
+            profile_windows = config_setting_get_member(profile, "windows");
+            if (!profile_windows ||
+                (size_t)config_setting_length(profile_windows) != cfg->num_windows) {
+                fprintf(stderr, "profile '%s' must have a key table for each of the %zu windows\n",
+                        cfg->profiles[i].name, cfg->num_windows);
+                return 1;
+            }
         }
-        if (cfg->keys[j].text_inactive) {
-            free(cfg->keys[j].text_inactive);
+
+        for (size_t j = 0; j < cfg->num_windows; j++) {
+            struct cfg_window *win = &cfg->windows[i * cfg->num_windows + j];
+            win->width = cfg->windows[j].width;
+            win->height = cfg->windows[j].height;
+            win->motion = cfg->windows[j].motion;
+            win->scroll = cfg->windows[j].scroll;
+            win->rate = cfg->windows[j].rate;
+            memcpy(win->sticks, cfg->windows[j].sticks, sizeof(win->sticks));
+            win->num_sticks = cfg->windows[j].num_sticks;
+            memcpy(win->triggers, cfg->windows[j].triggers, sizeof(win->triggers));
+            win->num_triggers = cfg->windows[j].num_triggers;
+
+            config_setting_t *setting =
+                multi_window ? config_setting_get_elem(profile_windows, j) : profile_windows;
+            if (cfg_read_keys(cfg, win, setting) != 0) {
+                fprintf(stderr, "failed to read profile '%s' in config\n", cfg->profiles[i].name);
+                return 1;
+            }
         }
     }
 
-    return 1;
+    return 0;
+}
+
+static int
+cfg_read_record(struct cfg *cfg, config_t *conf) {
+    const char *path_str;
+    if (!config_lookup_string(conf, "record.path", &path_str)) {
+        if (config_lookup(conf, "record")) {
+            fprintf(stderr, "no 'record.path' property set in config\n");
+            return 1;
+        }
+
+        return 0;
+    }
+    cfg->record_path = strdup(path_str);
+    assert(cfg->record_path);
+
+    cfg->record_max_size = 256;
+    if (config_lookup_int(conf, "record.max_size", &cfg->record_max_size)) {
+        if (cfg->record_max_size < 2 || cfg->record_max_size > 1 << 20) {
+            fprintf(stderr, "invalid 'record.max_size' property %d set in config\n",
+                    cfg->record_max_size);
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
 static int
@@ -482,17 +1540,11 @@ cfg_read_toplevel(struct cfg *cfg, config_t *conf) {
     cfg->font = strdup(font_str);
     assert(cfg->font);
 
-    if (!config_lookup_int(conf, "width", &cfg->width)) {
-        fprintf(stderr, "no 'width' property set in config\n");
-        goto fail_width;
-    }
-    if (!config_lookup_int(conf, "height", &cfg->height)) {
-        fprintf(stderr, "no 'height' property set in config\n");
-        goto fail_height;
-    }
-    if (cfg->width < 0 || cfg->height < 0 || cfg->width > 4096 || cfg->height > 4096) {
-        fprintf(stderr, "invalid window size (%dx%d) set in config\n", cfg->width, cfg->height);
-        goto fail_size;
+    config_lookup_int(conf, "radius", &cfg->radius);
+    config_lookup_int(conf, "border", &cfg->border);
+    if (cfg->radius < 0 || cfg->border < 0) {
+        fprintf(stderr, "invalid 'radius' or 'border' property set in config\n");
+        goto fail_style;
     }
 
     bool has_time_threshold = config_lookup_int(conf, "time_threshold", &cfg->time_threshold);
@@ -502,445 +1554,3942 @@ cfg_read_toplevel(struct cfg *cfg, config_t *conf) {
         goto fail_threshold;
     }
 
+    if (config_lookup_int(conf, "fade_time", &cfg->fade_time) && cfg->fade_time < 0) {
+        fprintf(stderr, "invalid 'fade_time' property %d set in config\n", cfg->fade_time);
+        goto fail_fade_time;
+    }
+
+    const char *shm_str;
+    if (config_lookup_string(conf, "shm_name", &shm_str)) {
+        if (shm_str[0] == '\0' || strchr(shm_str, '/')) {
+            fprintf(stderr, "invalid 'shm_name' property '%s' set in config\n", shm_str);
+            goto fail_shm_name;
+        }
+
+        cfg->shm_name = strdup(shm_str);
+        assert(cfg->shm_name);
+    }
+
     return 0;
 
+fail_shm_name:
+fail_fade_time:
 fail_threshold:
-fail_size:
-fail_height:
-fail_width:
+fail_style:
     free(cfg->font);
     return 1;
 }
 
 static int
-init_fcft(struct wayboard *wb) {
-    if (!fcft_init(FCFT_LOG_COLORIZE_AUTO, false, FCFT_LOG_CLASS_WARNING)) {
-        fprintf(stderr, "failed to initialize fcft\n");
+cfg_read_window(struct cfg *cfg, struct cfg_window *win, config_setting_t *setting) {
+    const char *name_str;
+    if (config_setting_lookup_string(setting, "name", &name_str)) {
+        win->name = strdup(name_str);
+        assert(win->name);
+    }
+
+    if (!config_setting_lookup_int(setting, "width", &win->width)) {
+        fprintf(stderr, "no 'width' property set in config\n");
+        return 1;
+    }
+    if (!config_setting_lookup_int(setting, "height", &win->height)) {
+        fprintf(stderr, "no 'height' property set in config\n");
+        return 1;
+    }
+    if (win->width < 0 || win->height < 0 || win->width > 4096 || win->height > 4096) {
+        fprintf(stderr, "invalid window size (%dx%d) set in config\n", win->width, win->height);
         return 1;
     }
 
-    // SAFETY: init_read_config ensures that `cfg->font` is non-NULL.
-    const char *names[] = {wb->cfg.font};
-    wb->font = fcft_from_name(1, names, NULL);
-    if (!wb->font) {
-        fprintf(stderr, "failed to load font '%s'\n", wb->cfg.font);
-        fcft_fini();
+    if (cfg_read_pointer(win, setting) != 0 || cfg_read_gamepad(win, setting) != 0) {
         return 1;
     }
 
-    return 0;
+    return cfg_read_keys(cfg, win, setting);
 }
 
 static int
-init_libinput(struct wayboard *wb) {
-    wb->udev = udev_new();
-    if (!wb->udev) {
-        fprintf(stderr, "failed to initialize udev\n");
-        return 1;
+cfg_read_windows(struct cfg *cfg, config_t *conf) {
+    // A configuration without a `windows` list describes a single window at the top level.
+    config_setting_t *windows = config_lookup(conf, "windows");
+    if (!windows) {
+        cfg->windows = calloc(1, sizeof(*cfg->windows));
+        assert(cfg->windows);
+        cfg->num_windows = 1;
+
+        return cfg_read_window(cfg, &cfg->windows[0], config_root_setting(conf));
     }
 
-    wb->libinput = libinput_udev_create_context(&libinput_iface, &wb, wb->udev);
-    if (!wb->libinput) {
-        fprintf(stderr, "failed to initialize libinput\n");
-        goto fail_context;
+    size_t num_windows = config_setting_length(windows);
+    if (num_windows == 0 || num_windows > MAX_WINDOWS) {
+        fprintf(stderr, "invalid number of windows (%zu) set in config\n", num_windows);
+        return 1;
     }
 
-    const char *seat = getenv("XDG_SEAT");
-    if (!seat) {
-        seat = "seat0";
-    }
-    if (libinput_udev_assign_seat(wb->libinput, seat) != 0) {
-        fprintf(stderr, "failed to assign seat to libinput context\n");
-        goto fail_seat;
-    }
-    int err = libinput_dispatch(wb->libinput);
-    if (err != 0) {
-        fprintf(stderr, "failed to dispatch libinput: %s\n", strerror(-err));
-        goto fail_dispatch;
-    }
+    cfg->windows = calloc(num_windows, sizeof(*cfg->windows));
+    assert(cfg->windows);
+    cfg->num_windows = num_windows;
 
-    return 0;
+    for (size_t i = 0; i < num_windows; i++) {
+        config_setting_t *window = config_setting_get_elem(windows, i);
+        assert(window);
 
-fail_dispatch:
+        if (cfg_read_window(cfg, &cfg->windows[i], window) != 0) {
+            fprintf(stderr, "failed to read window %zu in config\n", i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+evdev_axis(struct wayboard *wb, struct wb_evdev *dev, uint16_t axis, int32_t value,
+           uint64_t usec) {
+    if (axis >= ABS_CNT || !(dev->abs_bits & (UINT64_C(1) << axis))) {
+        return;
+    }
+
+    // Most gamepads report their d-pad as a hat rather than as buttons, so hat directions are also
+    // shown as the d-pad buttons, which keys can be bound to like any other button.
+    if (axis == ABS_HAT0X || axis == ABS_HAT0Y) {
+        int *hat = &dev->hat[axis - ABS_HAT0X];
+        uint16_t neg = axis == ABS_HAT0X ? BTN_DPAD_LEFT : BTN_DPAD_UP;
+        uint16_t pos = axis == ABS_HAT0X ? BTN_DPAD_RIGHT : BTN_DPAD_DOWN;
+        int dir = (value > 0) - (value < 0);
+
+        if (dir != *hat) {
+            if (*hat != 0) {
+                wayboard_process_code(wb, evdev_code(*hat < 0 ? neg : pos), false, usec);
+            }
+            if (dir != 0) {
+                wayboard_process_code(wb, evdev_code(dir < 0 ? neg : pos), true, usec);
+            }
+            *hat = dir;
+        }
+    }
+
+    int32_t min = dev->abs[axis].min, max = dev->abs[axis].max;
+    if (max <= min) {
+        return;
+    }
+
+    value = MIN(MAX(value, min), max);
+    wb->gamepad.axes[axis] = 2.0 * ((double)value - min) / ((double)max - min) - 1.0;
+    wb->gamepad.reported |= UINT64_C(1) << axis;
+    wb->gamepad.events++;
+}
+
+static inline uint32_t
+evdev_code(uint16_t code) {
+    // libinput reports mouse (and other) buttons as pointer buttons with their evdev code, and
+    // everything else as keyboard keys, which are shown as XKB keycodes (8 greater than the evdev
+    // code). Follow the same convention so that configurations work with either backend.
+    if (code >= BTN_MISC && code <= BTN_GEAR_UP) {
+        return code;
+    }
+
+    return code + 8;
+}
+
+static void
+evdev_probe_axes(struct wayboard *wb, struct wb_evdev *dev) {
+    // Gamepads and joysticks are told apart from touchpads and tablets, which also have absolute
+    // axes, by having joystick or gamepad buttons, as udev does.
+    unsigned long keys[KEY_CNT / (8 * sizeof(unsigned long)) + 1] = {0};
+    unsigned long axes[ABS_CNT / (8 * sizeof(unsigned long)) + 1] = {0};
+    if (ioctl(dev->fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0 ||
+        ioctl(dev->fd, EVIOCGBIT(EV_ABS, sizeof(axes)), axes) < 0) {
+        return;
+    }
+
+    for (uint32_t i = BTN_JOYSTICK; i < BTN_DIGI; i++) {
+        if (keys[i / (8 * sizeof(unsigned long))] & (1UL << (i % (8 * sizeof(unsigned long))))) {
+            dev->gamepad = true;
+            break;
+        }
+    }
+    if (!dev->gamepad) {
+        return;
+    }
+
+    // The current position of every axis is read up front, so that sticks which are not centred
+    // are shown correctly before they move. Hats which are already held are not shown as pressed,
+    // just like keys which are held at startup.
+    for (uint32_t i = 0; i < ABS_CNT; i++) {
+        struct input_absinfo info;
+        if (!(axes[i / (8 * sizeof(unsigned long))] & (1UL << (i % (8 * sizeof(unsigned long))))) ||
+            ioctl(dev->fd, EVIOCGABS(i), &info) < 0) {
+            continue;
+        }
+
+        dev->abs_bits |= UINT64_C(1) << i;
+        dev->abs[i].min = info.minimum;
+        dev->abs[i].max = info.maximum;
+        if (i == ABS_HAT0X || i == ABS_HAT0Y) {
+            dev->hat[i - ABS_HAT0X] = (info.value > 0) - (info.value < 0);
+        }
+        evdev_axis(wb, dev, i, info.value, 0);
+    }
+}
+
+static void
+evdev_resync(struct wayboard *wb, struct wb_evdev *dev) {
+    // Events were dropped by the kernel, so some presses or releases may have been missed. Query
+    // the current state of every key and synthesize events for any which changed. Keys which the
+    // device does not have are left alone, since they may be held on another device.
+    unsigned long keys[KEY_CNT / (8 * sizeof(unsigned long)) + 1] = {0};
+    unsigned long has_keys[KEY_CNT / (8 * sizeof(unsigned long)) + 1] = {0};
+    if (ioctl(dev->fd, EVIOCGKEY(sizeof(keys)), keys) < 0 ||
+        ioctl(dev->fd, EVIOCGBIT(EV_KEY, sizeof(has_keys)), has_keys) < 0) {
+        perror("failed to query evdev key state");
+        return;
+    }
+
+    uint64_t now = usec_now();
+    for (uint32_t i = 0; i < KEY_CNT; i++) {
+        uint32_t code = evdev_code(i);
+        unsigned long bit = 1UL << (i % (8 * sizeof(unsigned long)));
+        if (code >= MAX_KEYS || !(has_keys[i / (8 * sizeof(unsigned long))] & bit)) {
+            continue;
+        }
+
+        bool pressed = keys[i / (8 * sizeof(unsigned long))] & bit;
+        struct wb_key_state *ks = &wb->state.keys[code];
+        if (pressed != (ks->last_press_usec > ks->last_release_usec)) {
+            wayboard_process_code(wb, code, pressed, now);
+        }
+    }
+
+    // Axes only need their latest value, which also brings hats back in step.
+    for (uint32_t i = 0; i < ABS_CNT; i++) {
+        struct input_absinfo info;
+        if ((dev->abs_bits & (UINT64_C(1) << i)) && ioctl(dev->fd, EVIOCGABS(i), &info) == 0) {
+            evdev_axis(wb, dev, i, info.value, now);
+        }
+    }
+}
+
+static uint64_t
+hash_bytes(const void *data, size_t len) {
+    // 64-bit FNV-1a.
+    const unsigned char *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+static pixman_image_t *
+icon_decode_farbfeld(FILE *file, const char *path) {
+    // farbfeld is a 16 byte header followed by big endian 16-bit RGBA pixels, row by row.
+    uint8_t header[16];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)) {
+        fprintf(stderr, "icon '%s' is truncated\n", path);
+        return NULL;
+    }
+
+    uint32_t width = (uint32_t)header[8] << 24 | header[9] << 16 | header[10] << 8 | header[11];
+    uint32_t height = (uint32_t)header[12] << 24 | header[13] << 16 | header[14] << 8 | header[15];
+    if (width == 0 || height == 0 || width > ICON_MAX_SIZE || height > ICON_MAX_SIZE) {
+        fprintf(stderr, "icon '%s' has an invalid size (%" PRIu32 "x%" PRIu32 ")\n", path, width,
+                height);
+        return NULL;
+    }
+
+    pixman_image_t *image = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height, NULL, 0);
+    if (!image) {
+        fprintf(stderr, "failed to create pixman image\n");
+        return NULL;
+    }
+
+    uint32_t *data = pixman_image_get_data(image);
+    size_t stride = pixman_image_get_stride(image) / 4;
+    uint8_t *row = calloc(width, 8);
+    assert(row);
+
+    for (size_t y = 0; y < height; y++) {
+        if (fread(row, 8, width, file) != width) {
+            fprintf(stderr, "icon '%s' is truncated\n", path);
+            free(row);
+            pixman_image_unref(image);
+            return NULL;
+        }
+
+        // Only the high byte of each channel is kept.
+        for (size_t x = 0; x < width; x++) {
+            uint8_t *px = &row[x * 8];
+            data[y * stride + x] = icon_pixel(px[0], px[2], px[4], px[6]);
+        }
+    }
+
+    free(row);
+    return image;
+}
+
+#ifdef WAYBOARD_PNG
+static pixman_image_t *
+icon_decode_png(FILE *file, const char *path) {
+    png_image png = {.version = PNG_IMAGE_VERSION};
+    if (!png_image_begin_read_from_stdio(&png, file)) {
+        fprintf(stderr, "failed to read icon '%s': %s\n", path, png.message);
+        return NULL;
+    }
+    if (png.width > ICON_MAX_SIZE || png.height > ICON_MAX_SIZE) {
+        fprintf(stderr, "icon '%s' has an invalid size (%" PRIu32 "x%" PRIu32 ")\n", path,
+                png.width, png.height);
+        png_image_free(&png);
+        return NULL;
+    }
+
+    pixman_image_t *image =
+        pixman_image_create_bits(PIXMAN_a8r8g8b8, png.width, png.height, NULL, 0);
+    if (!image) {
+        fprintf(stderr, "failed to create pixman image\n");
+        png_image_free(&png);
+        return NULL;
+    }
+
+    // libpng decodes straight into the image as RGBA bytes, which are then converted in place.
+    uint32_t *data = pixman_image_get_data(image);
+    int stride = pixman_image_get_stride(image);
+    png.format = PNG_FORMAT_RGBA;
+    if (!png_image_finish_read(&png, NULL, data, stride, NULL)) {
+        fprintf(stderr, "failed to read icon '%s': %s\n", path, png.message);
+        pixman_image_unref(image);
+        return NULL;
+    }
+
+    for (size_t y = 0; y < png.height; y++) {
+        for (size_t x = 0; x < png.width; x++) {
+            uint32_t *pixel = &data[y * (stride / 4) + x];
+            uint8_t *px = (uint8_t *)pixel;
+            *pixel = icon_pixel(px[0], px[1], px[2], px[3]);
+        }
+    }
+
+    return image;
+}
+#endif
+
+static pixman_image_t *
+icon_load(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "failed to open icon '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    uint8_t magic[8] = {0};
+    size_t magic_len = fread(magic, 1, sizeof(magic), file);
+    rewind(file);
+
+    pixman_image_t *image = NULL;
+    if (magic_len == sizeof(magic) && memcmp(magic, "farbfeld", sizeof(magic)) == 0) {
+        image = icon_decode_farbfeld(file, path);
+    } else if (magic_len == sizeof(magic) && memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0) {
+#ifdef WAYBOARD_PNG
+        image = icon_decode_png(file, path);
+#else
+        fprintf(stderr, "icon '%s' is a PNG, but wayboard was built without PNG support\n", path);
+#endif
+    } else {
+        fprintf(stderr, "icon '%s' is not a farbfeld or PNG image\n", path);
+    }
+
+    fclose(file);
+    return image;
+}
+
+static inline uint32_t
+icon_pixel(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    // pixman expects premultiplied alpha.
+    return (uint32_t)a << 24 | (uint32_t)((r * a + 127) / 255) << 16 |
+           (uint32_t)((g * a + 127) / 255) << 8 | (uint32_t)((b * a + 127) / 255);
+}
+
+static pixman_image_t *
+icon_scale(pixman_image_t *src, int box_w, int box_h) {
+    int src_w = pixman_image_get_width(src);
+    int src_h = pixman_image_get_height(src);
+
+    // Icons keep their aspect ratio and are scaled to the largest size which fits in the box.
+    double scale = MIN((double)box_w / src_w, (double)box_h / src_h);
+    int w = MAX(MIN((int)lround(src_w * scale), box_w), 1);
+    int h = MAX(MIN((int)lround(src_h * scale), box_h), 1);
+
+    pixman_image_t *dst = pixman_image_create_bits(PIXMAN_a8r8g8b8, w, h, NULL, 0);
+    if (!dst) {
+        return NULL;
+    }
+
+    pixman_fixed_t scale_x = pixman_double_to_fixed((double)src_w / w);
+    pixman_fixed_t scale_y = pixman_double_to_fixed((double)src_h / h);
+
+    struct pixman_transform transform;
+    pixman_transform_init_scale(&transform, scale_x, scale_y);
+    pixman_image_set_transform(src, &transform);
+    pixman_image_set_repeat(src, PIXMAN_REPEAT_PAD);
+
+    // Bilinear filtering skips over source pixels when shrinking by more than half, so images
+    // which are scaled down are box filtered instead.
+    if (scale < 1) {
+        int num_params;
+        pixman_fixed_t *params = pixman_filter_create_separable_convolution(
+            &num_params, scale_x, scale_y, PIXMAN_KERNEL_BOX, PIXMAN_KERNEL_BOX, PIXMAN_KERNEL_BOX,
+            PIXMAN_KERNEL_BOX, 4, 4);
+        pixman_image_set_filter(src, PIXMAN_FILTER_SEPARABLE_CONVOLUTION, params, num_params);
+        free(params);
+    } else {
+        pixman_image_set_filter(src, PIXMAN_FILTER_BILINEAR, NULL, 0);
+    }
+
+    pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst, 0, 0, 0, 0, 0, 0, w, h);
+    pixman_image_set_transform(src, NULL);
+
+    return dst;
+}
+
+static int
+init_evdev(struct wayboard *wb) {
+    DIR *dir = opendir("/dev/input");
+    if (!dir) {
+        perror("failed to open /dev/input");
+        return 1;
+    }
+
+    struct dirent *dirent;
+    while ((dirent = readdir(dir))) {
+        if (strncmp(dirent->d_name, "event", strlen("event")) != 0) {
+            continue;
+        }
+        if (wb->num_evdev == MAX_EVDEV_DEVICES) {
+            fprintf(stderr, "warn: too many input devices, ignoring '%s'\n", dirent->d_name);
+            continue;
+        }
+
+        int fd = openat(dirfd(dir), dirent->d_name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "warn: failed to open '/dev/input/%s': %s\n", dirent->d_name,
+                    strerror(errno));
+            continue;
+        }
+
+        // Only devices which can report key or button events are of any use.
+        unsigned long types = 0;
+        if (ioctl(fd, EVIOCGBIT(0, sizeof(types)), &types) < 0 || !(types & (1UL << EV_KEY))) {
+            close(fd);
+            continue;
+        }
+
+        // Use the same clock as libinput so that event timestamps can be compared to
+        // `usec_now`.
+        int clock = CLOCK_MONOTONIC;
+        if (ioctl(fd, EVIOCSCLOCKID, &clock) < 0) {
+            fprintf(stderr, "warn: failed to set clock for '/dev/input/%s': %s\n", dirent->d_name,
+                    strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        struct wb_evdev *dev = &wb->evdev[wb->num_evdev++];
+        *dev = (struct wb_evdev){.fd = fd};
+        if (types & (1UL << EV_ABS)) {
+            evdev_probe_axes(wb, dev);
+        }
+    }
+    closedir(dir);
+
+    if (wb->num_evdev == 0) {
+        fprintf(stderr, "no usable input devices found in /dev/input\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void
+init_fade(struct wayboard *wb) {
+    // Fading keys are drawn with one colour per step, so nothing needs to be blended per pixel.
+    for (size_t i = 0; i < FADE_STEPS; i++) {
+        wb->fade.txt[i] =
+            render_blend_color(&wb->cfg.txt_active, &wb->cfg.txt_inactive, i, FADE_STEPS);
+    }
+}
+
+static int
+init_fcft(struct wayboard *wb) {
+    if (!fcft_init(FCFT_LOG_COLORIZE_AUTO, false, FCFT_LOG_CLASS_WARNING)) {
+        fprintf(stderr, "failed to initialize fcft\n");
+        return 1;
+    }
+
+    // SAFETY: init_read_config ensures that `cfg->font` is non-NULL.
+    const char *names[] = {wb->cfg.font};
+    wb->font = fcft_from_name(1, names, NULL);
+    if (!wb->font) {
+        fprintf(stderr, "failed to load font '%s'\n", wb->cfg.font);
+        fcft_fini();
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+init_icons(struct wayboard *wb) {
+    // Images are decoded once each, however many keys and sizes they are used for, and only kept
+    // in their original size until every key has its scaled copy.
+    struct icon_source {
+        struct icon_source *next;
+        const char *path;
+        pixman_image_t *image;
+    } *sources = NULL;
+
+    int ret = 1;
+    for (size_t i = 0; i < wb->num_windows * wb->cfg.num_profiles; i++) {
+        struct wb_layout *layout =
+            &wb->windows[i % wb->num_windows].layouts[i / wb->num_windows];
+
+        for (size_t j = 0; j < MAX_KEYS; j++) {
+            struct cfg_key *key = &layout->cfg->keys[j];
+            const char *paths[2] = {key->icon_inactive, key->icon_active};
+
+            // Icons are drawn inside the border of the key, if it has one.
+            int inset = layout->shapes[j] ? layout->shapes[j]->border : 0;
+            int box_w = key->w - inset * 2;
+            int box_h = key->h - inset * 2;
+            if (box_w <= 0 || box_h <= 0) {
+                continue;
+            }
+
+            for (size_t k = 0; k < ARRAY_LEN(paths); k++) {
+                if (!paths[k]) {
+                    continue;
+                }
+
+                struct wb_icon *icon = wb->icons;
+                while (icon && (icon->box_w != box_w || icon->box_h != box_h ||
+                                strcmp(icon->path, paths[k]) != 0)) {
+                    icon = icon->next;
+                }
+
+                if (!icon) {
+                    struct icon_source *source = sources;
+                    while (source && strcmp(source->path, paths[k]) != 0) {
+                        source = source->next;
+                    }
+
+                    if (!source) {
+                        pixman_image_t *image = icon_load(paths[k]);
+                        if (!image) {
+                            goto fail;
+                        }
+
+                        source = calloc(1, sizeof(*source));
+                        assert(source);
+                        *source = (struct icon_source){
+                            .next = sources,
+                            .path = paths[k],
+                            .image = image,
+                        };
+                        sources = source;
+                    }
+
+                    pixman_image_t *image = icon_scale(source->image, box_w, box_h);
+                    if (!image) {
+                        fprintf(stderr, "failed to scale icon '%s'\n", paths[k]);
+                        goto fail;
+                    }
+
+                    icon = calloc(1, sizeof(*icon));
+                    assert(icon);
+                    *icon = (struct wb_icon){
+                        .next = wb->icons,
+                        .path = paths[k],
+                        .box_w = box_w,
+                        .box_h = box_h,
+                        .image = image,
+                    };
+                    wb->icons = icon;
+                }
+
+                layout->icons[j][k] = icon;
+            }
+        }
+    }
+    ret = 0;
+
+fail:
+    while (sources) {
+        struct icon_source *source = sources;
+        sources = source->next;
+
+        pixman_image_unref(source->image);
+        free(source);
+    }
+    return ret;
+}
+
+static int
+init_libinput(struct wayboard *wb) {
+    wb->udev = udev_new();
+    if (!wb->udev) {
+        fprintf(stderr, "failed to initialize udev\n");
+        return 1;
+    }
+
+    wb->libinput = libinput_udev_create_context(&libinput_iface, &wb, wb->udev);
+    if (!wb->libinput) {
+        fprintf(stderr, "failed to initialize libinput\n");
+        goto fail_context;
+    }
+
+    const char *seat = getenv("XDG_SEAT");
+    if (!seat) {
+        seat = "seat0";
+    }
+    if (libinput_udev_assign_seat(wb->libinput, seat) != 0) {
+        fprintf(stderr, "failed to assign seat to libinput context\n");
+        goto fail_seat;
+    }
+    int err = libinput_dispatch(wb->libinput);
+    if (err != 0) {
+        fprintf(stderr, "failed to dispatch libinput: %s\n", strerror(-err));
+        goto fail_dispatch;
+    }
+
+    return 0;
+
+fail_dispatch:
 fail_seat:
     libinput_unref(wb->libinput);
 
-fail_context:
-    udev_unref(wb->udev);
-    return 1;
+fail_context:
+    udev_unref(wb->udev);
+    return 1;
+}
+
+static void
+init_overlaps(struct wayboard *wb) {
+    for (size_t i = 0; i < wb->num_windows * wb->cfg.num_profiles; i++) {
+        struct wb_layout *layout =
+            &wb->windows[i % wb->num_windows].layouts[i / wb->num_windows];
+        struct cfg_key *keys = layout->cfg->keys;
+
+        uint16_t defined[MAX_KEYS];
+        size_t num_defined = 0;
+        for (size_t j = 0; j < MAX_KEYS; j++) {
+            if (keys[j].w > 0 && keys[j].h > 0) {
+                defined[num_defined++] = j;
+            }
+        }
+
+        // The lists are counted up first, so that they can all be stored in one allocation.
+        size_t total = 0;
+        for (size_t j = 0; j < num_defined; j++) {
+            struct cfg_key *a = &keys[defined[j]];
+
+            size_t count = 0;
+            for (size_t k = 0; k < num_defined; k++) {
+                if (k != j && render_keys_overlap(a, &keys[defined[k]])) {
+                    count++;
+                }
+            }
+            if (count > 0) {
+                layout->num_overlaps[defined[j]] = count + 1;
+                total += count + 1;
+            }
+        }
+        if (total == 0) {
+            continue;
+        }
+
+        layout->overlap_keys = calloc(total, sizeof(*layout->overlap_keys));
+        assert(layout->overlap_keys);
+
+        uint16_t *next = layout->overlap_keys;
+        for (size_t j = 0; j < num_defined; j++) {
+            struct cfg_key *a = &keys[defined[j]];
+            if (layout->num_overlaps[defined[j]] == 0) {
+                continue;
+            }
+
+            layout->overlaps[defined[j]] = next;
+            for (size_t k = 0; k < num_defined; k++) {
+                if (k == j || render_keys_overlap(a, &keys[defined[k]])) {
+                    *next++ = defined[k];
+                }
+            }
+        }
+    }
+}
+
+static void
+init_rate(struct wayboard *wb) {
+    // Showing a rate on the overlay needs the analyzer too. Profiles share the elements of the
+    // first profile, so only its windows are looked at.
+    for (size_t i = 0; i < wb->cfg.num_windows; i++) {
+        if (wb->cfg.windows[i].rate.w > 0) {
+            wb->rate.enabled = true;
+        }
+    }
+    if (!wb->rate.enabled) {
+        return;
+    }
+
+    assert(rate_bucket(RATE_IDLE_USEC - 1) < RATE_BUCKETS);
+    wb->rate.devices = calloc(MAX_EVDEV_DEVICES, sizeof(*wb->rate.devices));
+    assert(wb->rate.devices);
+}
+
+static int
+init_read_config(struct wayboard *wb, const char *path, const char *snapshot_path) {
+    // A stale or otherwise unusable snapshot is not fatal, since the text configuration it was
+    // compiled from can always be read instead.
+    if (snapshot_path) {
+        if (snapshot_load(&wb->cfg, snapshot_path, path) == 0) {
+            return 0;
+        }
+        fprintf(stderr, "falling back to text config '%s'\n", path);
+    }
+
+    config_t conf;
+    config_init(&conf);
+    if (config_read_file(&conf, path) != CONFIG_TRUE) {
+        fprintf(stderr, "failed to read config file\n");
+        config_destroy(&conf);
+        return 1;
+    }
+
+    int ret = cfg_read(&wb->cfg, &conf);
+
+    config_destroy(&conf);
+    return ret;
+}
+
+static int
+init_recorder(struct wayboard *wb) {
+    if (!wb->cfg.record_path) {
+        return 0;
+    }
+
+    wb->rec.map_size = (size_t)wb->cfg.record_max_size << 20;
+    return recorder_open(wb);
+}
+
+static int
+init_render(struct wayboard *wb) {
+    init_fade(wb);
+    init_text(wb);
+
+    // Everything which drawing a key or the pointer needs is allocated up front, so that input
+    // events can be drawn without allocating.
+    int motion_w = 0, motion_h = 0;
+    for (size_t i = 0; i < wb->num_windows; i++) {
+        motion_w = MAX(motion_w, wb->windows[i].cfg->motion.w);
+        motion_h = MAX(motion_h, wb->windows[i].cfg->motion.h);
+    }
+    if (motion_w > 0) {
+        wb->motion_mask = pixman_image_create_bits(PIXMAN_a8, motion_w, motion_h, NULL, 0);
+    }
+    wb->solid = pixman_image_create_bits(PIXMAN_a8r8g8b8, 1, 1, NULL, 0);
+    if (!wb->solid || (motion_w > 0 && !wb->motion_mask)) {
+        fprintf(stderr, "failed to create pixman image\n");
+        return 1;
+    }
+    pixman_image_set_repeat(wb->solid, PIXMAN_REPEAT_NORMAL);
+
+    wb->label_color = pixman_image_create_solid_fill(&wb->cfg.txt_inactive);
+    if (!wb->label_color) {
+        fprintf(stderr, "failed to create pixman image\n");
+        return 1;
+    }
+    render_validate(wb->label_color);
+    init_render_pool(wb);
+
+    for (size_t i = 0; i < wb->num_windows; i++) {
+        struct wb_window *win = &wb->windows[i];
+
+        size_t shm_stride = win->cfg->width * 4;
+        win->state.pixman_image = pixman_image_create_bits(
+            PIXMAN_a8r8g8b8, win->cfg->width, win->cfg->height, win->state.shm_data, shm_stride);
+        if (!win->state.pixman_image) {
+            fprintf(stderr, "failed to create pixman image\n");
+            return 1;
+        }
+
+        render_tiled(win, win->layout, win->state.pixman_image, NULL);
+
+        // A single profile is never switched away from, so it does not need a copy of its layout.
+        for (size_t j = 0; j < wb->cfg.num_profiles && wb->cfg.num_profiles > 1; j++) {
+            struct wb_layout *layout = &win->layouts[j];
+
+            layout->idle = pixman_image_create_bits(PIXMAN_a8r8g8b8, layout->cfg->width,
+                                                    layout->cfg->height, NULL, 0);
+            if (!layout->idle) {
+                fprintf(stderr, "failed to create pixman image\n");
+                return 1;
+            }
+            render_tiled(win, layout, layout->idle, NULL);
+
+            // Profile switches copy from the idle layouts on every thread at once.
+            render_validate(layout->idle);
+        }
+
+        // Windows which are drawn without a compositor, as in tests/, have no surface to commit.
+        if (win->wl.surface) {
+            wayboard_commit_frame(win, 0);
+        }
+    }
+
+    return 0;
+}
+
+static void
+init_render_pool(struct wayboard *wb) {
+    // Helpers are only started if some window is large enough for its redraws to be shared.
+    bool tiled = false;
+    for (size_t i = 0; i < wb->num_windows; i++) {
+        struct cfg_window *cfg = wb->windows[i].cfg;
+        tiled |= (size_t)cfg->width * cfg->height >= RENDER_TILED_MIN_PIXELS;
+    }
+    if (!tiled || wb->render_threads < 2) {
+        return;
+    }
+
+    pthread_mutex_init(&wb->pool.lock, NULL);
+    pthread_cond_init(&wb->pool.wake, NULL);
+    pthread_cond_init(&wb->pool.idle, NULL);
+
+    // Tiles are claimed as they are drawn, so redraws are shared between however many helpers
+    // could be started.
+    size_t num_helpers = MIN(wb->render_threads, RENDER_MAX_THREADS) - 1;
+    for (size_t i = 0; i < num_helpers; i++) {
+        struct render_helper *helper = &wb->pool.helpers[wb->pool.num_helpers];
+        helper->wb = wb;
+        helper->index = wb->pool.num_helpers + 1;
+        if (pthread_create(&helper->thread, NULL, render_pool_worker, helper) != 0) {
+            break;
+        }
+        wb->pool.num_helpers++;
+    }
+
+    if (wb->pool.num_helpers == 0) {
+        pthread_cond_destroy(&wb->pool.idle);
+        pthread_cond_destroy(&wb->pool.wake);
+        pthread_mutex_destroy(&wb->pool.lock);
+    }
+}
+
+static int
+init_shapes(struct wayboard *wb) {
+    for (size_t i = 0; i < wb->num_windows * wb->cfg.num_profiles; i++) {
+        struct wb_layout *layout =
+            &wb->windows[i % wb->num_windows].layouts[i / wb->num_windows];
+
+        for (size_t j = 0; j < MAX_KEYS; j++) {
+            struct cfg_key *key = &layout->cfg->keys[j];
+            if (key->w <= 0 || key->h <= 0) {
+                continue;
+            }
+
+            // Radii and borders which do not fit within the key are clamped rather than rejected,
+            // so that a layout can be scaled down without editing every key.
+            int max = MIN(key->w, key->h) / 2;
+            int radius = MAX(MIN(key->radius, max), 0);
+            int border = MAX(MIN(key->border, max), 0);
+            if (radius == 0 && border == 0) {
+                continue;
+            }
+
+            struct wb_shape *shape = wb->shapes;
+            while (shape && (shape->w != key->w || shape->h != key->h ||
+                             shape->radius != radius || shape->border != border)) {
+                shape = shape->next;
+            }
+
+            if (!shape) {
+                shape = calloc(1, sizeof(*shape));
+                assert(shape);
+                *shape = (struct wb_shape){
+                    .next = wb->shapes,
+                    .w = key->w,
+                    .h = key->h,
+                    .radius = radius,
+                    .border = border,
+                };
+                wb->shapes = shape;
+
+                shape->outer = render_coverage_mask(key->w, key->h, 0, radius);
+                if (border > 0) {
+                    shape->inner =
+                        render_coverage_mask(key->w, key->h, border, MAX(radius - border, 0));
+                }
+                if (!shape->outer || (border > 0 && !shape->inner)) {
+                    fprintf(stderr, "failed to create coverage mask for key %zu\n", j);
+                    return 1;
+                }
+            }
+
+            layout->shapes[j] = shape;
+        }
+    }
+
+    return 0;
+}
+
+static int
+init_shm(struct wayboard *wb) {
+    if (!wb->cfg.shm_name) {
+        return 0;
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "/%s", wb->cfg.shm_name);
+
+    // Other users may read the segment but never write to it.
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("failed to open shared memory segment");
+        return 1;
+    }
+    if (ftruncate(fd, sizeof(struct wb_shm)) != 0) {
+        perror("failed to expand shared memory segment");
+        goto fail_truncate;
+    }
+    wb->shm = mmap(NULL, sizeof(struct wb_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (wb->shm == MAP_FAILED) {
+        perror("failed to mmap shared memory segment");
+        goto fail_mmap;
+    }
+    close(fd);
+
+    wb_shm_init(wb->shm);
+    return 0;
+
+fail_mmap:
+fail_truncate:
+    close(fd);
+    shm_unlink(path);
+    wb->shm = NULL;
+    return 1;
+}
+
+static void
+init_text(struct wayboard *wb) {
+    size_t num_labels = 0, max_len = 1;
+    for (size_t i = 0; i < wb->cfg.num_windows * wb->cfg.num_profiles; i++) {
+        for (size_t j = 0; j < MAX_KEYS; j++) {
+            struct cfg_key *key = &wb->cfg.windows[i].keys[j];
+            const char *labels[] = {key->text_active, key->text_inactive};
+
+            for (size_t k = 0; k < ARRAY_LEN(labels); k++) {
+                if (labels[k]) {
+                    num_labels++;
+                    max_len = MAX(max_len, strlen(labels[k]));
+                }
+            }
+        }
+    }
+
+    wb->text.max_entries = num_labels + TEXT_CACHE_CHARS;
+    wb->text.num_buckets = 1;
+    while (wb->text.num_buckets < wb->text.max_entries * 2) {
+        wb->text.num_buckets *= 2;
+    }
+    wb->text.entries = calloc(wb->text.max_entries, sizeof(*wb->text.entries));
+    wb->text.buckets = calloc(wb->text.num_buckets, sizeof(*wb->text.buckets));
+    assert(wb->text.entries && wb->text.buckets);
+
+    // A label never has more characters than bytes.
+    wb->text.utf32_len = max_len + 1;
+    wb->text.utf32 = calloc(wb->text.utf32_len, sizeof(*wb->text.utf32));
+    assert(wb->text.utf32);
+}
+
+static int
+init_wayland(struct wayboard *wb) {
+    wb->wl.display = wl_display_connect(NULL);
+    if (!wb->wl.display) {
+        perror("failed to connect to a wayland display");
+        return 1;
+    }
+
+    wb->wl.registry = wl_display_get_registry(wb->wl.display);
+    assert(wb->wl.registry);
+    wl_registry_add_listener(wb->wl.registry, &registry_listener, wb);
+    if (wl_display_roundtrip(wb->wl.display) == -1) {
+        perror("failed to roundtrip wayland display during init");
+        goto fail_roundtrip_globals;
+    }
+
+    if (!wb->wl.compositor || !wb->wl.shm || !wb->wl.xdg_wm_base) {
+        fprintf(stderr, "missing wayland globals\n");
+        goto fail_globals;
+    }
+
+    wb->windows = calloc(wb->cfg.num_windows, sizeof(*wb->windows));
+    assert(wb->windows);
+
+    for (size_t i = 0; i < wb->cfg.num_windows; i++) {
+        struct wb_window *win = &wb->windows[i];
+        win->wb = wb;
+        win->cfg = &wb->cfg.windows[i];
+
+        if (init_window(wb, win) != 0) {
+            goto fail_window;
+        }
+        wb->num_windows++;
+
+        win->layouts = calloc(wb->cfg.num_profiles, sizeof(*win->layouts));
+        assert(win->layouts);
+        for (size_t j = 0; j < wb->cfg.num_profiles; j++) {
+            win->layouts[j].cfg = &wb->cfg.windows[j * wb->cfg.num_windows + i];
+        }
+        win->layout = &win->layouts[0];
+    }
+
+    if (wl_display_roundtrip(wb->wl.display) == -1) {
+        perror("failed to roundtrip wayland display during xdg_toplevel init");
+        goto fail_roundtrip_toplevel;
+    }
+
+    return 0;
+
+fail_roundtrip_toplevel:
+fail_window:
+    for (size_t i = 0; i < wb->num_windows; i++) {
+        wayboard_fini_window(&wb->windows[i]);
+    }
+    free(wb->windows);
+
+fail_globals:
+    if (wb->wl.compositor) {
+        wl_compositor_destroy(wb->wl.compositor);
+    }
+    if (wb->wl.shm) {
+        wl_shm_destroy(wb->wl.shm);
+    }
+    if (wb->wl.xdg_wm_base) {
+        xdg_wm_base_destroy(wb->wl.xdg_wm_base);
+    }
+
+fail_roundtrip_globals:
+    wl_registry_destroy(wb->wl.registry);
+    wl_display_disconnect(wb->wl.display);
+    return 1;
+}
+
+static int
+init_window(struct wayboard *wb, struct wb_window *win) {
+    size_t shm_stride = win->cfg->width * 4;
+    size_t shm_size = win->cfg->height * shm_stride;
+    win->state.shm_fd = memfd_create("wayboard-shm", MFD_CLOEXEC);
+    if (win->state.shm_fd < 0) {
+        perror("failed to create memfd");
+        return 1;
+    }
+    if (ftruncate(win->state.shm_fd, shm_size) != 0) {
+        perror("failed to expand memfd");
+        goto fail_memfd_truncate;
+    }
+    win->state.shm_data =
+        mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, win->state.shm_fd, 0);
+    if (win->state.shm_data == MAP_FAILED) {
+        perror("failed to mmap memfd");
+        goto fail_memfd_mmap;
+    }
+
+    struct wl_shm_pool *shm_pool = wl_shm_create_pool(wb->wl.shm, win->state.shm_fd, shm_size);
+    assert(shm_pool);
+    win->wl.buffer = wl_shm_pool_create_buffer(shm_pool, 0, win->cfg->width, win->cfg->height,
+                                               shm_stride, WL_SHM_FORMAT_ARGB8888);
+    assert(win->wl.buffer);
+    wl_buffer_add_listener(win->wl.buffer, &buffer_listener, win);
+    wl_shm_pool_destroy(shm_pool);
+
+    win->wl.surface = wl_compositor_create_surface(wb->wl.compositor);
+    assert(win->wl.surface);
+    win->wl.xdg_surface = xdg_wm_base_get_xdg_surface(wb->wl.xdg_wm_base, win->wl.surface);
+    assert(win->wl.xdg_surface);
+    win->wl.xdg_toplevel = xdg_surface_get_toplevel(win->wl.xdg_surface);
+    assert(win->wl.xdg_toplevel);
+
+    xdg_surface_add_listener(win->wl.xdg_surface, &xdg_surface_listener, win);
+    xdg_toplevel_add_listener(win->wl.xdg_toplevel, &xdg_toplevel_listener, win);
+
+    // Named windows get their name as a title so that they can be told apart when capturing.
+    xdg_toplevel_set_app_id(win->wl.xdg_toplevel, "wayboard");
+    xdg_toplevel_set_title(win->wl.xdg_toplevel, win->cfg->name ? win->cfg->name : "wayboard");
+    xdg_toplevel_set_min_size(win->wl.xdg_toplevel, win->cfg->width, win->cfg->height);
+    xdg_toplevel_set_max_size(win->wl.xdg_toplevel, win->cfg->width, win->cfg->height);
+    wl_surface_commit(win->wl.surface);
+
+    return 0;
+
+fail_memfd_mmap:
+fail_memfd_truncate:
+    close(win->state.shm_fd);
+    return 1;
+}
+
+static void
+offline_convert(struct offline *off, pixman_image_t *image, uint8_t *out) {
+    int width = pixman_image_get_width(image), height = pixman_image_get_height(image);
+    const uint32_t *pixels = pixman_image_get_data(image);
+    size_t num_pixels = (size_t)width * height;
+
+    // Raw frames are straight (not premultiplied) RGBA, as expected by `-pix_fmt rgba`.
+    if (off->format == OFFLINE_RGBA) {
+        for (size_t i = 0; i < num_pixels; i++) {
+            uint32_t a = pixels[i] >> 24;
+            uint32_t r = (pixels[i] >> 16) & 0xFF;
+            uint32_t g = (pixels[i] >> 8) & 0xFF;
+            uint32_t b = pixels[i] & 0xFF;
+            if (a != 0 && a != 0xFF) {
+                r = (r * 0xFF + a / 2) / a;
+                g = (g * 0xFF + a / 2) / a;
+                b = (b * 0xFF + a / 2) / a;
+            }
+
+            out[i * 4 + 0] = r;
+            out[i * 4 + 1] = g;
+            out[i * 4 + 2] = b;
+            out[i * 4 + 3] = a;
+        }
+        return;
+    }
+
+    // Y4M frames are planar 4:4:4 with BT.601 limited range, and have no alpha channel, so
+    // translucent pixels come out as if drawn over black.
+    memcpy(out, "FRAME\n", strlen("FRAME\n"));
+    uint8_t *y = out + strlen("FRAME\n"), *u = y + num_pixels, *v = u + num_pixels;
+    for (size_t i = 0; i < num_pixels; i++) {
+        int r = (pixels[i] >> 16) & 0xFF, g = (pixels[i] >> 8) & 0xFF, b = pixels[i] & 0xFF;
+
+        y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        u[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        v[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+}
+
+static inline uint64_t
+offline_frame_usec(struct offline *off, size_t frame) {
+    return off->start_usec + (uint64_t)frame * 1000000 / off->fps;
+}
+
+static int
+offline_read_file(struct offline *off, uint32_t sequence, uint64_t *start_usec, bool *end) {
+    char path[PATH_MAX];
+    if (sequence == 0) {
+        snprintf(path, sizeof(path), "%s", off->log_path);
+    } else {
+        snprintf(path, sizeof(path), "%s.%" PRIu32, off->log_path, sequence);
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        if (sequence > 0 && errno == ENOENT) {
+            *end = true;
+            return 0;
+        }
+        fprintf(stderr, "failed to open session log '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    int ret = 1;
+    struct wb_log_header header;
+    struct stat st;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != WB_LOG_MAGIC ||
+        header.version != WB_LOG_VERSION || header.record_size != sizeof(struct wb_log_record) ||
+        fstat(fileno(file), &st) != 0 || (uint64_t)st.st_size < header.header_size) {
+        fprintf(stderr, "'%s' is not a wayboard session log\n", path);
+        goto fail;
+    }
+    if (sequence == 0 && header.sequence != 0) {
+        fprintf(stderr, "'%s' is file %" PRIu32 " of a split session log, render the first one\n",
+                path, header.sequence);
+        goto fail;
+    }
+
+    // A file left over from an earlier, longer session was started before the file ahead of it.
+    if (header.sequence != sequence ||
+        (sequence > 0 && header.clock_monotonic_usec < *start_usec)) {
+        *end = true;
+        ret = 0;
+        goto fail;
+    }
+    *start_usec = header.clock_monotonic_usec;
+
+    // Files which were not closed cleanly end in zeroed records, which are dropped.
+    size_t max_records = (st.st_size - header.header_size) / sizeof(struct wb_log_record);
+    struct wb_log_record *records =
+        realloc(off->records, MAX(off->num_records + max_records, 1) * sizeof(*records));
+    assert(records);
+    off->records = records;
+    records += off->num_records;
+    if (fseek(file, header.header_size, SEEK_SET) != 0 ||
+        fread(records, sizeof(*records), max_records, file) != max_records) {
+        fprintf(stderr, "failed to read session log '%s'\n", path);
+        goto fail;
+    }
+    for (size_t i = 0; i < max_records && records[i].usec != 0; i++) {
+        off->num_records++;
+    }
+    ret = 0;
+
+fail:
+    fclose(file);
+    return ret;
+}
+
+static int
+offline_read_log(struct offline *off) {
+    // A log which was split at `max_size` continues in `<path>.1`, `<path>.2` and so on, which are
+    // read in order until one is missing or belongs to another session.
+    uint64_t log_start_usec = 0, file_start_usec = 0;
+    bool end = false;
+    for (uint32_t sequence = 0; !end; sequence++) {
+        if (offline_read_file(off, sequence, &file_start_usec, &end) != 0) {
+            goto fail;
+        }
+        if (sequence == 0) {
+            log_start_usec = file_start_usec;
+        }
+    }
+    if (off->num_records == 0) {
+        fprintf(stderr, "session log '%s' has no events\n", off->log_path);
+        goto fail;
+    }
+
+    // The first frame is at the time the log was started, so that the render lines up with a
+    // screen recording which was started alongside it. Records are in the order they were
+    // processed, which need not be the order of their timestamps across devices.
+    uint64_t first = UINT64_MAX, last = 0;
+    for (size_t i = 0; i < off->num_records; i++) {
+        first = MIN(first, off->records[i].usec);
+        last = MAX(last, off->records[i].usec);
+    }
+    off->start_usec = MIN(log_start_usec, first);
+
+    // Keep going until the last key has finished fading out or showing its press duration.
+    struct cfg *cfg = &off->wb->cfg;
+    uint64_t tail_usec = (uint64_t)MAX(MAX(cfg->fade_time, cfg->threshold_life), 0) * 1000;
+    off->num_frames = (last + tail_usec - off->start_usec) * off->fps / 1000000 + 1;
+    return 0;
+
+fail:
+    free(off->records);
+    off->records = NULL;
+    off->num_records = 0;
+    return 1;
+}
+
+static void
+offline_render_chunk(struct offline *off, struct wb_window *win, size_t chunk, size_t record) {
+    TRACE_SPAN("offline_chunk");
+
+    struct wayboard *wb = win->wb;
+    pixman_image_t *image = win->state.pixman_image;
+
+    memset(&win->state, 0, sizeof(win->state));
+    win->state.pixman_image = image;
+    win->state.buf_released = true;
+
+    // Every key is drawn as it was last drawn before the chunk started, which only depends on its
+    // own state. Keys which have finished animating since are brought up to date by the first
+    // frame, just as they would have been in a render of the whole log.
+    render_layout(wb, win->layout, image);
+    for (size_t i = 0; i < MAX_KEYS; i++) {
+        struct wb_key_state *ks = &wb->state.keys[i];
+        if (ks->last_press_usec != 0 || ks->last_release_usec != 0) {
+            wb->state.offline_usec = MAX(ks->last_press_usec, ks->last_release_usec);
+            render_key(win, i);
+        }
+    }
+
+    size_t first = chunk * off->chunk_frames;
+    size_t num_frames = MIN(off->chunk_frames, off->num_frames - first);
+    for (size_t i = 0; i < num_frames; i++) {
+        uint64_t frame_usec = offline_frame_usec(off, first + i);
+
+        // Events are drawn at the time they happened, like wayboard does when they arrive, and
+        // everything which animates is then drawn at the time of the frame.
+        for (; record < off->num_records && off->records[record].usec <= frame_usec; record++) {
+            struct wb_log_record *rec = &off->records[record];
+            if (rec->code >= MAX_KEYS) {
+                continue;
+            }
+
+            struct wb_key_state *ks = &wb->state.keys[rec->code];
+            if (rec->pressed) {
+                ks->last_press_usec = rec->usec;
+            } else {
+                ks->last_release_usec = rec->usec;
+            }
+
+            wb->state.offline_usec = rec->usec;
+            render_key(win, rec->code);
+        }
+
+        wb->state.offline_usec = frame_usec;
+        render_frame(win);
+        offline_convert(off, image, off->chunks[chunk].frames + i * off->frame_size);
+    }
+}
+
+static int
+offline_run(struct wayboard *wb, struct offline *off, const char *config_path,
+            const char *snapshot_path) {
+    off->wb = wb;
+
+    int ret = 1;
+    if (init_read_config(wb, config_path, snapshot_path) != 0) {
+        return 1;
+    }
+    if (off->window >= wb->cfg.num_windows) {
+        fprintf(stderr, "window %zu is not in the config, which has %zu\n", off->window,
+                wb->cfg.num_windows);
+        goto fail_log;
+    }
+    if (offline_read_log(off) != 0) {
+        goto fail_log;
+    }
+
+    // Only the layouts are needed, not any surfaces. Profiles are not switched between offline,
+    // so keys are always shown in the layout of the default profile.
+    wb->windows = calloc(wb->cfg.num_windows, sizeof(*wb->windows));
+    assert(wb->windows);
+    wb->num_windows = wb->cfg.num_windows;
+    for (size_t i = 0; i < wb->num_windows; i++) {
+        struct wb_window *win = &wb->windows[i];
+        win->wb = wb;
+        win->cfg = &wb->cfg.windows[i];
+
+        win->layouts = calloc(wb->cfg.num_profiles, sizeof(*win->layouts));
+        assert(win->layouts);
+        for (size_t j = 0; j < wb->cfg.num_profiles; j++) {
+            win->layouts[j].cfg = &wb->cfg.windows[j * wb->cfg.num_windows + i];
+        }
+        win->layout = &win->layouts[0];
+    }
+
+    if (init_fcft(wb) != 0) {
+        goto fail_fcft;
+    }
+    if (init_shapes(wb) != 0 || init_icons(wb) != 0) {
+        goto fail_render;
+    }
+    init_overlaps(wb);
+    init_fade(wb);
+
+    // Every image which the workers share is validated before they start.
+    for (struct wb_shape *shape = wb->shapes; shape; shape = shape->next) {
+        render_validate(shape->outer);
+        if (shape->inner) {
+            render_validate(shape->inner);
+        }
+    }
+    for (struct wb_icon *icon = wb->icons; icon; icon = icon->next) {
+        render_validate(icon->image);
+    }
+
+    struct cfg_window *cfg = &wb->cfg.windows[off->window];
+    off->frame_size = (size_t)cfg->width * cfg->height * 4;
+    if (off->format == OFFLINE_Y4M) {
+        off->frame_size = strlen("FRAME\n") + (size_t)cfg->width * cfg->height * 3;
+    }
+    off->chunk_frames = MAX(OFFLINE_CHUNK_SIZE / off->frame_size, 1);
+    off->num_chunks = (off->num_frames + off->chunk_frames - 1) / off->chunk_frames;
+    off->chunks = calloc(off->num_chunks, sizeof(*off->chunks));
+    assert(off->chunks);
+
+    off->out = off->out_path ? fopen(off->out_path, "wb") : stdout;
+    if (!off->out) {
+        fprintf(stderr, "failed to open '%s': %s\n", off->out_path, strerror(errno));
+        goto fail_out;
+    }
+    if (off->format == OFFLINE_Y4M) {
+        fprintf(off->out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", cfg->width, cfg->height,
+                off->fps);
+    }
+
+    pthread_mutex_init(&off->lock, NULL);
+    pthread_cond_init(&off->cond, NULL);
+
+    uint64_t start = usec_now();
+    pthread_t threads[OFFLINE_MAX_THREADS];
+    size_t num_threads = 0;
+    for (; num_threads < off->num_threads; num_threads++) {
+        if (pthread_create(&threads[num_threads], NULL, offline_worker, off) != 0) {
+            fprintf(stderr, "failed to create render thread\n");
+            break;
+        }
+    }
+
+    // Chunks are written out as soon as they and every chunk before them are done.
+    pthread_mutex_lock(&off->lock);
+    off->failed = num_threads == 0;
+    for (size_t i = 0; i < off->num_chunks && !off->failed; i++) {
+        while (!off->chunks[i].done) {
+            pthread_cond_wait(&off->cond, &off->lock);
+        }
+        pthread_mutex_unlock(&off->lock);
+
+        size_t num_frames = MIN(off->chunk_frames, off->num_frames - i * off->chunk_frames);
+        bool ok = fwrite(off->chunks[i].frames, off->frame_size, num_frames, off->out) ==
+                  num_frames;
+        if (!ok) {
+            perror("failed to write frames");
+        }
+        free(off->chunks[i].frames);
+        off->chunks[i].frames = NULL;
+
+        pthread_mutex_lock(&off->lock);
+        off->failed = !ok;
+        off->written++;
+        pthread_cond_broadcast(&off->cond);
+    }
+    pthread_cond_broadcast(&off->cond);
+    pthread_mutex_unlock(&off->lock);
+
+    for (size_t i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t i = 0; i < off->num_chunks; i++) {
+        free(off->chunks[i].frames);
+    }
+    pthread_cond_destroy(&off->cond);
+    pthread_mutex_destroy(&off->lock);
+
+    if (fflush(off->out) != 0) {
+        perror("failed to write frames");
+        off->failed = true;
+    }
+    if (off->out != stdout) {
+        fclose(off->out);
+    }
+
+    if (!off->failed) {
+        double secs = (usec_now() - start) / 1e6;
+        fprintf(stderr, "rendered %zu frames (%.1f s at %d fps) in %.1f s on %zu threads\n",
+                off->num_frames, (double)off->num_frames / off->fps, off->fps, secs, num_threads);
+        ret = 0;
+    }
+
+fail_out:
+    free(off->chunks);
+
+fail_render:
+    wayboard_fini_icons(wb);
+    wayboard_fini_overlaps(wb);
+    wayboard_fini_shapes(wb);
+    fcft_destroy(wb->font);
+    fcft_fini();
+
+fail_fcft:
+    for (size_t i = 0; i < wb->num_windows; i++) {
+        free(wb->windows[i].layouts);
+    }
+    free(wb->windows);
+    free(off->records);
+
+fail_log:
+    cfg_destroy(&wb->cfg);
+    return ret;
+}
+
+static void *
+offline_worker(void *data) {
+    struct offline *off = data;
+
+    // Each worker has a render state of its own, including its text cache, and shares everything
+    // which is only read while rendering.
+    struct wayboard *wb = calloc(1, sizeof(*wb));
+    struct wb_window *win = calloc(1, sizeof(*win));
+    assert(wb && win);
+    wb->cfg = off->wb->cfg;
+    wb->font = off->wb->font;
+    wb->fade = off->wb->fade;
+    wb->windows = win;
+    wb->num_windows = 1;
+    init_text(wb);
+
+    wb->solid = pixman_image_create_bits(PIXMAN_a8r8g8b8, 1, 1, NULL, 0);
+    assert(wb->solid);
+    pixman_image_set_repeat(wb->solid, PIXMAN_REPEAT_NORMAL);
+
+    struct wb_window *base = &off->wb->windows[off->window];
+    win->wb = wb;
+    win->cfg = base->cfg;
+    win->layouts = base->layouts;
+    win->layout = base->layout;
+    win->state.pixman_image =
+        pixman_image_create_bits(PIXMAN_a8r8g8b8, win->cfg->width, win->cfg->height, NULL, 0);
+    assert(win->state.pixman_image);
+
+    pthread_mutex_lock(&off->lock);
+    for (;;) {
+        size_t ahead = off->num_threads * OFFLINE_CHUNKS_AHEAD;
+        while (!off->failed && off->next_chunk < off->num_chunks &&
+               off->next_chunk >= off->written + ahead) {
+            pthread_cond_wait(&off->cond, &off->lock);
+        }
+        if (off->failed || off->next_chunk == off->num_chunks) {
+            break;
+        }
+
+        // Chunks are claimed in order, so the key state at the start of each one is found by
+        // carrying on from the start of the previous one.
+        size_t chunk = off->next_chunk++;
+        size_t first = chunk * off->chunk_frames;
+        while (first > 0 && off->next_record < off->num_records &&
+               off->records[off->next_record].usec <= offline_frame_usec(off, first - 1)) {
+            struct wb_log_record *rec = &off->records[off->next_record++];
+            if (rec->code < MAX_KEYS) {
+                if (rec->pressed) {
+                    off->keys[rec->code].last_press_usec = rec->usec;
+                } else {
+                    off->keys[rec->code].last_release_usec = rec->usec;
+                }
+            }
+        }
+        memcpy(wb->state.keys, off->keys, sizeof(off->keys));
+        size_t record = off->next_record;
+
+        off->chunks[chunk].frames = malloc(off->chunk_frames * off->frame_size);
+        assert(off->chunks[chunk].frames);
+        pthread_mutex_unlock(&off->lock);
+
+        offline_render_chunk(off, win, chunk, record);
+
+        pthread_mutex_lock(&off->lock);
+        off->chunks[chunk].done = true;
+        pthread_cond_broadcast(&off->cond);
+    }
+    pthread_mutex_unlock(&off->lock);
+
+    wayboard_fini_text(wb);
+    wayboard_fini_render(wb);
+    pixman_image_unref(win->state.pixman_image);
+    free(win);
+    free(wb);
+    return NULL;
+}
+
+static struct wb_rate *
+rate_add(struct wayboard *wb, const char *name) {
+    // Devices which turn up once the table is full are not analyzed.
+    if (wb->rate.num_devices == MAX_EVDEV_DEVICES) {
+        return NULL;
+    }
+
+    struct wb_rate *rate = &wb->rate.devices[wb->rate.num_devices++];
+    snprintf(rate->name, sizeof(rate->name), "%s", name);
+    return rate;
+}
+
+static inline size_t
+rate_bucket(uint64_t interval) {
+    // Intervals under 4 us get a bucket each, and every octave above that is split into four by
+    // the two bits below the most significant one.
+    if (interval < 4) {
+        return interval;
+    }
+
+    int msb = 63 - __builtin_clzll(interval);
+    return msb * 4 + ((interval >> (msb - 2)) & 3) - 4;
+}
+
+static uint64_t
+rate_bucket_usec(size_t bucket) {
+    // Inverse of `rate_bucket`, giving the shortest interval which falls into the bucket.
+    if (bucket < 4) {
+        return bucket;
+    }
+
+    return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+static bool
+rate_estimate(const struct wb_rate *rate, double *interval, double *jitter) {
+    if (!rate) {
+        return false;
+    }
+
+    // The polling interval is the most common one, since a device only ever reports on a poll,
+    // but need not report on every poll. The interval can fall on either side of a bucket
+    // boundary, so the buckets next to the most common one are counted along with it.
+    size_t mode = 0;
+    for (size_t i = 1; i < RATE_BUCKETS; i++) {
+        if (rate->buckets[i].count > rate->buckets[mode].count) {
+            mode = i;
+        }
+    }
+
+    uint64_t count = 0, sum = 0, sum_sq = 0;
+    for (size_t i = mode > 0 ? mode - 1 : 0; i <= mode + 1 && i < RATE_BUCKETS; i++) {
+        count += rate->buckets[i].count;
+        sum += rate->buckets[i].sum;
+        sum_sq += rate->buckets[i].sum_sq;
+    }
+    if (count < RATE_MIN_REPORTS) {
+        return false;
+    }
+
+    double mean = (double)sum / count;
+    *interval = mean;
+    *jitter = sqrt(MAX((double)sum_sq / count - mean * mean, 0));
+    return true;
+}
+
+static struct wb_rate *
+rate_evdev(struct wayboard *wb, struct wb_evdev *dev) {
+    if (!dev->rate) {
+        char name[sizeof(dev->rate->name)] = "unknown device";
+        ioctl(dev->fd, EVIOCGNAME(sizeof(name) - 1), name);
+        dev->rate = rate_add(wb, name);
+    }
+
+    return dev->rate;
+}
+
+static struct wb_rate *
+rate_libinput(struct wayboard *wb, struct libinput_event *event) {
+    struct libinput_device *device = libinput_event_get_device(event);
+
+    struct wb_rate *rate = libinput_device_get_user_data(device);
+    if (!rate) {
+        rate = rate_add(wb, libinput_device_get_name(device));
+        libinput_device_set_user_data(device, rate);
+    }
+
+    return rate;
+}
+
+static void
+rate_print(struct wayboard *wb) {
+    static const char bar[] = "########################################";
+
+    if (!wb->rate.enabled) {
+        return;
+    }
+    if (wb->rate.num_devices == 0) {
+        fprintf(stderr, "report intervals: no input device has reported yet\n");
+        return;
+    }
+
+    for (size_t i = 0; i < wb->rate.num_devices; i++) {
+        struct wb_rate *rate = &wb->rate.devices[i];
+
+        fprintf(stderr, "%s:\n", rate->name);
+        fprintf(stderr, "  reports:   %" PRIu64 " (%" PRIu64 " after %d ms or more idle)\n",
+                rate->reports, rate->idle, RATE_IDLE_USEC / 1000);
+
+        double interval, jitter;
+        if (rate_estimate(rate, &interval, &jitter)) {
+            fprintf(stderr, "  rate:      %.0f Hz (%.3f ms interval, %.1f us jitter)\n",
+                    1e6 / interval, interval / 1e3, jitter);
+        } else {
+            fprintf(stderr, "  rate:      unknown (too few reports in quick succession)\n");
+        }
+
+        uint64_t total = 0, max = 0;
+        for (size_t j = 0; j < RATE_BUCKETS; j++) {
+            total += rate->buckets[j].count;
+            max = MAX(max, rate->buckets[j].count);
+        }
+        for (size_t j = 0; j < RATE_BUCKETS; j++) {
+            uint64_t count = rate->buckets[j].count;
+            if (count == 0) {
+                continue;
+            }
+
+            int len = (count * (sizeof(bar) - 1) + max - 1) / max;
+            fprintf(stderr, "  %7.3f - %7.3f ms %10" PRIu64 " %5.1f%% %.*s\n",
+                    rate_bucket_usec(j) / 1e3, rate_bucket_usec(j + 1) / 1e3, count,
+                    100.0 * count / total, len, bar);
+        }
+    }
+}
+
+static inline void
+rate_record(struct wayboard *wb, struct wb_rate *rate, uint64_t usec) {
+    if (!rate || usec == rate->last_usec) {
+        return;
+    }
+
+    // The first report only starts the first interval, as does a report from before the last one.
+    if (rate->last_usec != 0 && usec > rate->last_usec) {
+        uint64_t interval = usec - rate->last_usec;
+        if (interval < RATE_IDLE_USEC) {
+            size_t bucket = rate_bucket(interval);
+            rate->buckets[bucket].count++;
+            rate->buckets[bucket].sum += interval;
+            rate->buckets[bucket].sum_sq += interval * interval;
+        } else {
+            rate->idle++;
+        }
+    }
+
+    rate->last_usec = usec;
+    rate->reports++;
+    wb->rate.last = rate;
+    wb->rate.reports++;
+}
+
+static void
+recorder_close(struct wayboard *wb) {
+    if (!wb->rec.header) {
+        return;
+    }
+
+    // Trim the zeroed tail of the current chunk so that the file ends with its last record.
+    struct wb_log_record *records = (void *)((char *)wb->rec.header + wb->rec.header->header_size);
+    size_t used = (char *)wb->rec.pos - (char *)wb->rec.header;
+
+    wb->rec.header->num_records = wb->rec.pos - records;
+    msync(wb->rec.header, used, MS_ASYNC);
+    munmap(wb->rec.header, wb->rec.map_size);
+
+    if (ftruncate(wb->rec.fd, used) != 0) {
+        perror("failed to truncate session log");
+    }
+    close(wb->rec.fd);
+
+    wb->rec.header = NULL;
+    wb->rec.pos = wb->rec.end = wb->rec.limit = NULL;
+}
+
+static void
+recorder_flush(struct wayboard *wb) {
+    TRACE_SPAN("recorder_flush");
+
+    if (!wb->rec.header) {
+        return;
+    }
+
+    // Keep at least half a chunk of space available so that the file rarely needs to be grown in
+    // the middle of a batch of events.
+    size_t remaining = (char *)wb->rec.end - (char *)wb->rec.pos;
+    if (remaining < RECORD_CHUNK_SIZE / 2 && wb->rec.end != wb->rec.limit) {
+        if (recorder_grow(wb) != 0) {
+            return;
+        }
+    }
+}
+
+static int
+recorder_grow(struct wayboard *wb) {
+    // Start a new file once the current one has reached its maximum size.
+    if (wb->rec.end == wb->rec.limit) {
+        recorder_close(wb);
+        wb->rec.sequence++;
+        return recorder_open(wb);
+    }
+
+    size_t file_size = wb->rec.file_size + RECORD_CHUNK_SIZE;
+    if (file_size > wb->rec.map_size) {
+        file_size = wb->rec.map_size;
+    }
+    if (ftruncate(wb->rec.fd, file_size) != 0) {
+        perror("failed to grow session log, recording stopped");
+        recorder_close(wb);
+        return 1;
+    }
+
+    wb->rec.file_size = file_size;
+    wb->rec.end = (void *)((char *)wb->rec.header + file_size);
+    return 0;
+}
+
+static int
+recorder_open(struct wayboard *wb) {
+    char path[PATH_MAX];
+    if (wb->rec.sequence == 0) {
+        snprintf(path, sizeof(path), "%s", wb->cfg.record_path);
+    } else {
+        snprintf(path, sizeof(path), "%s.%" PRIu32, wb->cfg.record_path, wb->rec.sequence);
+    }
+
+    size_t num_keys = 0;
+    for (size_t i = 0; i < wb->cfg.num_windows; i++) {
+        for (size_t j = 0; j < MAX_KEYS; j++) {
+            if (wb->cfg.windows[i].keys[j].w != 0) {
+                num_keys++;
+            }
+        }
+    }
+
+    size_t header_size = sizeof(struct wb_log_header) +
+                         wb->cfg.num_windows * sizeof(struct wb_log_window) +
+                         num_keys * sizeof(struct wb_log_key);
+    header_size = (header_size + sizeof(struct wb_log_record) - 1) &
+                  ~(sizeof(struct wb_log_record) - 1);
+    if (header_size + RECORD_CHUNK_SIZE > wb->rec.map_size) {
+        fprintf(stderr, "'record.max_size' is too small for the layout\n");
+        return 1;
+    }
+
+    wb->rec.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (wb->rec.fd < 0) {
+        fprintf(stderr, "failed to open session log '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    wb->rec.file_size = header_size + RECORD_CHUNK_SIZE;
+    if (ftruncate(wb->rec.fd, wb->rec.file_size) != 0) {
+        perror("failed to expand session log");
+        goto fail_truncate;
+    }
+    wb->rec.header =
+        mmap(NULL, wb->rec.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, wb->rec.fd, 0);
+    if (wb->rec.header == MAP_FAILED) {
+        perror("failed to mmap session log");
+        goto fail_mmap;
+    }
+
+    struct timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+
+    *wb->rec.header = (struct wb_log_header){
+        .magic = WB_LOG_MAGIC,
+        .version = WB_LOG_VERSION,
+        .header_size = header_size,
+        .record_size = sizeof(struct wb_log_record),
+        .clock_monotonic_usec = (uint64_t)mono.tv_sec * 1000000 + (uint64_t)mono.tv_nsec / 1000,
+        .clock_realtime_usec = (uint64_t)real.tv_sec * 1000000 + (uint64_t)real.tv_nsec / 1000,
+        .sequence = wb->rec.sequence,
+        .num_windows = wb->cfg.num_windows,
+        .num_keys = num_keys,
+    };
+
+    struct wb_log_window *log_windows = (void *)(wb->rec.header + 1);
+    struct wb_log_key *log_keys = (void *)(log_windows + wb->cfg.num_windows);
+    for (size_t i = 0; i < wb->cfg.num_windows; i++) {
+        struct cfg_window *win = &wb->cfg.windows[i];
+
+        log_windows[i] = (struct wb_log_window){win->width, win->height};
+        for (size_t j = 0; j < MAX_KEYS; j++) {
+            struct cfg_key *key = &win->keys[j];
+            if (key->w == 0) {
+                continue;
+            }
+
+            *log_keys++ = (struct wb_log_key){i, j, key->x, key->y, key->w, key->h};
+        }
+    }
+
+    wb->rec.pos = (void *)((char *)wb->rec.header + header_size);
+    wb->rec.end = (void *)((char *)wb->rec.header + wb->rec.file_size);
+    wb->rec.limit = (void *)((char *)wb->rec.header + wb->rec.map_size);
+    wb->rec.synced = wb->rec.pos;
+    return 0;
+
+fail_mmap:
+fail_truncate:
+    close(wb->rec.fd);
+    wb->rec.header = NULL;
+    return 1;
+}
+
+static void
+recorder_sync(struct wayboard *wb) {
+    TRACE_SPAN("recorder_sync");
+
+    // Called from a timer, so that the log reaches the disk even while no events are arriving.
+    if (!wb->rec.header || wb->rec.synced == wb->rec.pos) {
+        return;
+    }
+
+    msync(wb->rec.header, (char *)wb->rec.pos - (char *)wb->rec.header, MS_ASYNC);
+    wb->rec.synced = wb->rec.pos;
+}
+
+static inline void
+recorder_write(struct wayboard *wb, uint32_t code, bool pressed, uint64_t usec) {
+    if (wb->rec.pos == wb->rec.end && recorder_grow(wb) != 0) {
+        return;
+    }
+
+    *wb->rec.pos++ = (struct wb_log_record){.usec = usec, .code = code, .pressed = pressed};
+}
+
+static void
+render_activate(struct wb_window *win, uint32_t keycode) {
+    if (win->state.is_active[keycode]) {
+        return;
+    }
+
+    win->state.is_active[keycode] = true;
+    win->state.active[win->state.num_active++] = keycode;
+}
+
+static void
+render_analyzer(struct wb_window *win) {
+    struct wayboard *wb = win->wb;
+    struct cfg_window *cfg = win->cfg;
+    if (cfg->rate.w == 0 || win->state.rate.reports == wb->rate.reports) {
+        return;
+    }
+
+    // The estimate is made from the histogram at most once per frame, and the element is only
+    // drawn again once the rate which it shows has changed.
+    win->state.rate.reports = wb->rate.reports;
+
+    double interval, jitter;
+    int hz = rate_estimate(wb->rate.last, &interval, &jitter) ? lround(1e6 / interval) : 0;
+    if (hz == win->state.rate.hz) {
+        return;
+    }
+
+    win->state.rate.hz = hz;
+    render_rate(wb, win->state.pixman_image, &cfg->rate, hz);
+    render_damage(win, cfg->rate.x, cfg->rate.y, cfg->rate.w, cfg->rate.h);
+}
+
+static pixman_color_t
+render_blend_color(const pixman_color_t *from, const pixman_color_t *to, size_t num, size_t den) {
+#define BLEND(c) ((uint16_t)(from->c + ((int32_t)to->c - from->c) * (int32_t)num / (int32_t)den))
+    return (pixman_color_t){BLEND(red), BLEND(green), BLEND(blue), BLEND(alpha)};
+#undef BLEND
+}
+
+static pixman_image_t *
+render_coverage_mask(int w, int h, int inset, int radius) {
+    pixman_image_t *mask = pixman_image_create_bits(PIXMAN_a8, w, h, NULL, 0);
+    if (!mask) {
+        return NULL;
+    }
+
+    uint8_t *data = (uint8_t *)pixman_image_get_data(mask);
+    int stride = pixman_image_get_stride(mask);
+
+    // The coverage of each pixel is estimated from the signed distance between its centre and the
+    // edge of the rounded rectangle, which anti-aliases the edge over one pixel.
+    float half_w = w / 2.0f - inset;
+    float half_h = h / 2.0f - inset;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            float qx = fabsf(x + 0.5f - w / 2.0f) - half_w + radius;
+            float qy = fabsf(y + 0.5f - h / 2.0f) - half_h + radius;
+            float dist =
+                hypotf(fmaxf(qx, 0), fmaxf(qy, 0)) + fminf(fmaxf(qx, qy), 0) - radius;
+
+            data[y * stride + x] = fminf(fmaxf(0.5f - dist, 0), 1) * 255 + 0.5f;
+        }
+    }
+
+    return mask;
+}
+
+static void
+render_damage(struct wb_window *win, int32_t x, int32_t y, int32_t w, int32_t h) {
+    win->state.dirty = true;
+
+    // Windows which are rendered offline have no surface to send damage to.
+    if (!win->wl.surface) {
+        return;
+    }
+
+    // Boxes are merged whenever their bounding box covers no more than the two of them do, such
+    // as when the same key is drawn twice or keys next to each other are drawn. Once every box is
+    // in use, the new one is merged with whichever box that grows the damaged area the least.
+    // Either way, the merged box may now merge with another, so it is looked at again.
+    pixman_box32_t box = {x, y, x + w, y + h};
+    for (;;) {
+        size_t best = 0;
+        int64_t best_growth = INT64_MAX;
+        for (size_t i = 0; i < win->state.num_damage; i++) {
+            pixman_box32_t *other = &win->state.damage[i];
+            int64_t iw = MIN(box.x2, other->x2) - MAX(box.x1, other->x1);
+            int64_t ih = MIN(box.y2, other->y2) - MAX(box.y1, other->y1);
+            int64_t covered = (int64_t)(box.x2 - box.x1) * (box.y2 - box.y1) +
+                              (int64_t)(other->x2 - other->x1) * (other->y2 - other->y1) -
+                              (iw > 0 && ih > 0 ? iw * ih : 0);
+            int64_t bounds = (int64_t)(MAX(box.x2, other->x2) - MIN(box.x1, other->x1)) *
+                             (MAX(box.y2, other->y2) - MIN(box.y1, other->y1));
+
+            if (bounds - covered < best_growth) {
+                best = i;
+                best_growth = bounds - covered;
+            }
+        }
+        if (best_growth > 0 && win->state.num_damage < DAMAGE_MAX_BOXES) {
+            break;
+        }
+
+        pixman_box32_t *other = &win->state.damage[best];
+        box = (pixman_box32_t){
+            MIN(box.x1, other->x1),
+            MIN(box.y1, other->y1),
+            MAX(box.x2, other->x2),
+            MAX(box.y2, other->y2),
+        };
+        *other = win->state.damage[--win->state.num_damage];
+    }
+
+    win->state.damage[win->state.num_damage++] = box;
+}
+
+static void
+render_defer(struct wb_window *win, uint32_t keycode) {
+    // Keys are drawn from the current key state once the buffer is released, so a key which
+    // changes several times in the meantime is only drawn once.
+    if (win->state.is_pending[keycode]) {
+        return;
+    }
+
+    win->state.is_pending[keycode] = true;
+    win->state.pending[win->state.num_pending++] = keycode;
+}
+
+// Returns the step of the release fade which the key is at, or FADE_STEPS if it is not fading.
+static inline size_t
+render_fade_step(struct wayboard *wb, struct wb_key_state *ks, uint64_t now) {
+    uint64_t fade_usec = (uint64_t)wb->cfg.fade_time * 1000;
+    uint64_t released_usec = now - ks->last_release_usec;
+
+    bool pressed = ks->last_press_usec > ks->last_release_usec;
+    if (pressed || ks->last_release_usec == 0 || released_usec >= fade_usec) {
+        return FADE_STEPS;
+    }
+
+    return released_usec * FADE_STEPS / fade_usec;
+}
+
+static void
+render_frame(struct wb_window *win) {
+    TRACE_SPAN("render_frame");
+
+    struct wayboard *wb = win->wb;
+
+    render_pointer(win);
+    render_gamepad(win);
+    render_analyzer(win);
+    if (win->state.num_active == 0) {
+        return;
+    }
+
+    // Only keys in the active set can change without an input event, so no others are looked at.
+    // Keys are removed from the set once they have nothing left to animate.
+    uint64_t now = render_now(wb);
+    size_t num_active = 0;
+    for (size_t i = 0; i < win->state.num_active; i++) {
+        uint16_t code = win->state.active[i];
+        struct wb_key_state *ks = &wb->state.keys[code];
+
+        bool pressed = ks->last_press_usec > ks->last_release_usec;
+        uint64_t time_active_usec = ks->last_release_usec - ks->last_press_usec;
+        bool in_threshold = (wb->cfg.time_threshold > 0) && (ks->last_press_usec != 0) &&
+                            (time_active_usec < (uint64_t)wb->cfg.time_threshold * 1000) &&
+                            !pressed;
+
+        // Unrender keys which were previously in threshold.
+        if (in_threshold) {
+            if (now <= win->state.unrender_at_usec[code]) {
+                win->state.active[num_active++] = code;
+                continue;
+            }
+
+            win->state.look[code] = LOOK_HIDDEN;
+            render_key_redraw(win, code);
+
+            win->state.unrender_at_usec[code] = UINT64_MAX;
+            win->state.is_active[code] = false;
+            continue;
+        }
+
+        // Redraw fading keys whenever they reach a new step.
+        size_t step = render_fade_step(wb, ks, now);
+        if (step < FADE_STEPS) {
+            if (step != win->state.fade_step[code]) {
+                render_key(win, code);
+            }
+            win->state.active[num_active++] = code;
+            continue;
+        }
+
+        // The fade has finished, or the key was pressed again in the meantime.
+        win->state.is_active[code] = false;
+        if (!pressed) {
+            render_key(win, code);
+        }
+    }
+    win->state.num_active = num_active;
+}
+
+static void
+render_gamepad(struct wb_window *win) {
+    TRACE_SPAN("render_gamepad");
+
+    struct wayboard *wb = win->wb;
+    struct cfg_window *cfg = win->cfg;
+    if (win->state.gamepad.events == wb->gamepad.events ||
+        (cfg->num_sticks == 0 && cfg->num_triggers == 0)) {
+        return;
+    }
+
+    // Axes which changed between frames only had their latest value stored, so every element is
+    // drawn once from the latest values, however many events there were.
+    win->state.gamepad.events = wb->gamepad.events;
+
+    for (size_t i = 0; i < cfg->num_sticks; i++) {
+        struct cfg_stick *stick = &cfg->sticks[i];
+        uint64_t axes = (UINT64_C(1) << stick->axis_x) | (UINT64_C(1) << stick->axis_y);
+        bool reported = (wb->gamepad.reported & axes) == axes;
+
+        render_stick(wb, win->state.pixman_image, stick,
+                     reported ? wb->gamepad.axes[stick->axis_x] : 0,
+                     reported ? wb->gamepad.axes[stick->axis_y] : 0);
+        render_damage(win, stick->x, stick->y, stick->w, stick->h);
+    }
+    for (size_t i = 0; i < cfg->num_triggers; i++) {
+        struct cfg_trigger *trigger = &cfg->triggers[i];
+        bool reported = (wb->gamepad.reported >> trigger->axis) & 1;
+
+        render_trigger(wb, win->state.pixman_image, trigger,
+                       reported ? (wb->gamepad.axes[trigger->axis] + 1) / 2 : 0);
+        render_damage(win, trigger->x, trigger->y, trigger->w, trigger->h);
+    }
+}
+
+static void
+render_key(struct wb_window *win, uint32_t keycode) {
+    TRACE_SPAN("render_key");
+
+    assert(keycode < MAX_KEYS);
+
+    if (!KEY_DEFINED(win, keycode)) {
+        return;
+    }
+    if (!win->state.buf_released) {
+        render_defer(win, keycode);
+        return;
+    }
+
+    struct wayboard *wb = win->wb;
+    struct wb_key_state *ks = &wb->state.keys[keycode];
+    uint64_t *unrender_at_usec = &win->state.unrender_at_usec[keycode];
+
+    // Determine the current state of the key.
+    //
+    //   - `time_active_usec` will underflow to a large value if the key is currently held. If the
+    //     key is not currently held, it will contain the last press duration.
+    //   - `in_threshold` is true if all of the following are true:
+    //     - the user has set `time_threshold` in their config
+    //     - the last press duration was lower than `time_threshold`
+    //     - the key has been pressed at least once
+    //     - the key is currently not pressed
+    bool pressed = ks->last_press_usec > ks->last_release_usec;
+
+    uint64_t time_active_usec = ks->last_release_usec - ks->last_press_usec;
+    bool in_threshold = (wb->cfg.time_threshold > 0) && (ks->last_press_usec != 0) &&
+                        (time_active_usec < (uint64_t)wb->cfg.time_threshold * 1000) && !pressed;
+
+    // If this is the first frame where the key is within the threshold, then the `unrender_at_usec`
+    // value should be updated.
+    uint64_t expected_unrender_at = ks->last_release_usec + (uint64_t)wb->cfg.threshold_life * 1000;
+    if (in_threshold && *unrender_at_usec != expected_unrender_at) {
+        *unrender_at_usec = expected_unrender_at;
+    }
+
+    uint64_t now = render_now(wb);
+    bool render_threshold = in_threshold && now < *unrender_at_usec;
+
+    // Released keys fade out, unless they are in threshold and show their press duration instead.
+    size_t fade_step = in_threshold ? FADE_STEPS : render_fade_step(wb, ks, now);
+
+    if (pressed) {
+        win->state.look[keycode] = LOOK_PRESSED;
+    } else if (render_threshold) {
+        win->state.look[keycode] = LOOK_THRESHOLD;
+    } else if (fade_step < FADE_STEPS) {
+        win->state.look[keycode] = LOOK_FADING;
+        win->state.fade_step[keycode] = fade_step;
+    } else {
+        win->state.look[keycode] = LOOK_INACTIVE;
+    }
+    render_key_redraw(win, keycode);
+
+    // Keys which will change again without another input event need to be revisited every frame.
+    if (render_threshold || fade_step < FADE_STEPS) {
+        render_activate(win, keycode);
+    }
+}
+
+static void
+render_key_draw(struct wb_window *win, uint32_t keycode) {
+    struct wayboard *wb = win->wb;
+    struct cfg_key *key = &win->cfg->keys[keycode];
+    struct wb_icon **icons = win->layout->icons[keycode];
+    enum wb_look look = win->state.look[keycode];
+
+    // Pressed keys and keys showing their press duration are drawn in the active colours.
+    const pixman_color_t *foreground = &key->fg_active, *text = &wb->cfg.txt_active;
+    pixman_color_t fade_foreground;
+    switch (look) {
+    case LOOK_IDLE:
+        if (icons[0]) {
+            render_key_icon(win->state.pixman_image, key, icons[0]);
+        } else if (key->text_inactive) {
+            render_key_text(wb, win->state.pixman_image, key, &wb->cfg.txt_inactive,
+                            key->text_inactive);
+        }
+        return;
+    case LOOK_HIDDEN:
+        return;
+    case LOOK_INACTIVE:
+        foreground = &key->fg_inactive;
+        text = &wb->cfg.txt_inactive;
+        break;
+    case LOOK_FADING: {
+        size_t step = win->state.fade_step[keycode];
+        fade_foreground = render_blend_color(&key->fg_active, &key->fg_inactive, step, FADE_STEPS);
+        foreground = &fade_foreground;
+        text = &wb->fade.txt[step];
+        break;
+    }
+    case LOOK_PRESSED:
+    case LOOK_THRESHOLD:
+        break;
+    }
+
+    render_key_fill(win, key, win->layout->shapes[keycode], foreground);
+
+    // The press duration shown in threshold always takes the place of the icon.
+    if (look == LOOK_THRESHOLD) {
+        struct wb_key_state *ks = &wb->state.keys[keycode];
+        char threshold_buf[32];
+        snprintf(threshold_buf, sizeof(threshold_buf), "%" PRIu64 " ms",
+                 (ks->last_release_usec - ks->last_press_usec) / 1000);
+        render_key_chars(wb, win->state.pixman_image, key, text, threshold_buf);
+        return;
+    }
+
+    bool pressed = look == LOOK_PRESSED;
+    char *text_str = pressed ? key->text_active : key->text_inactive;
+    if (icons[pressed]) {
+        render_key_icon(win->state.pixman_image, key, icons[pressed]);
+    } else if (text_str != NULL) {
+        render_key_text(wb, win->state.pixman_image, key, text, text_str);
+    }
+}
+
+static void
+render_key_fill(struct wb_window *win, struct cfg_key *key, struct wb_shape *shape,
+                const pixman_color_t *fill) {
+    pixman_rectangle16_t rect = {key->x, key->y, key->w, key->h};
+
+    if (!shape) {
+        pixman_image_fill_rectangles(PIXMAN_OP_SRC, win->state.pixman_image, fill, 1, &rect);
+        return;
+    }
+
+    // Styled keys go through the same solid colour and A8 mask path as text. The corners outside
+    // of the shape show whatever was drawn below the key, and the fill is drawn over the border so
+    // that the inner edge of the border blends into it.
+    if (shape->inner) {
+        pixman_image_composite32(PIXMAN_OP_OVER, render_solid(win->wb, &key->border_color),
+                                 shape->outer, win->state.pixman_image, 0, 0, 0, 0, key->x,
+                                 key->y, key->w, key->h);
+    }
+
+    pixman_image_composite32(PIXMAN_OP_OVER, render_solid(win->wb, fill),
+                             shape->inner ? shape->inner : shape->outer, win->state.pixman_image,
+                             0, 0, 0, 0, key->x, key->y, key->w, key->h);
+}
+
+static void
+render_key_icon(pixman_image_t *image, struct cfg_key *key, struct wb_icon *icon) {
+    int w = pixman_image_get_width(icon->image);
+    int h = pixman_image_get_height(icon->image);
+
+    pixman_image_composite32(PIXMAN_OP_OVER, icon->image, NULL, image, 0, 0, 0, 0,
+                             key->x + (key->w - w) / 2, key->y + (key->h - h) / 2, w, h);
+}
+
+static void
+render_key_chars(struct wayboard *wb, pixman_image_t *image, struct cfg_key *key,
+                 const pixman_color_t *text, const char *str) {
+    TRACE_SPAN("render_key_chars");
+
+    // Labels which are built at runtime are drawn one character at a time, so that they are all
+    // made up of the same few cache entries rather than each needing a text run of its own. The
+    // characters of one label are the most recently used entries, so looking up the last of them
+    // cannot evict the first.
+    struct wb_text *chars[TEXT_CACHE_CHARS - 1];
+    size_t num_chars = 0;
+    int width = 0, height = 0;
+    for (const char *c = str; *c && num_chars < ARRAY_LEN(chars); c++) {
+        struct wb_text *entry = render_text_lookup(wb, (char[]){*c, '\0'});
+        if (!entry) {
+            continue;
+        }
+
+        chars[num_chars++] = entry;
+        width += entry->width;
+        height = MAX(height, entry->height);
+    }
+
+    pixman_image_t *color = render_solid(wb, text);
+    int x = key->x + (key->w - width) / 2;
+    int y = key->y + (key->h - height) / 2;
+    for (size_t i = 0; i < num_chars; i++) {
+        render_text_draw(wb, image, color, chars[i], x, y);
+        x += chars[i]->width;
+    }
+}
+
+static void
+render_key_redraw(struct wb_window *win, uint32_t keycode) {
+    TRACE_SPAN("render_key_redraw");
+
+    struct cfg_key *key = &win->cfg->keys[keycode];
+    struct wb_layout *layout = win->layout;
+    pixman_image_t *image = win->state.pixman_image;
+    pixman_rectangle16_t rect = {key->x, key->y, key->w, key->h};
+
+    // A key which overlaps nothing else is all that is drawn within its rectangle, so only the
+    // parts of it which its own fill does not cover need the background.
+    if (layout->num_overlaps[keycode] == 0) {
+        enum wb_look look = win->state.look[keycode];
+        if (layout->shapes[keycode] || look == LOOK_IDLE || look == LOOK_HIDDEN) {
+            pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, &win->wb->cfg.background, 1, &rect);
+        }
+        render_key_draw(win, keycode);
+        render_damage(win, key->x, key->y, key->w, key->h);
+        return;
+    }
+
+    // Otherwise the rectangle is drawn again from the background up, with every key which
+    // overlaps it drawn as it last was and clipped to it, in order. Keys above this one stay on
+    // top of it, and keys below it show through its rounded corners and wherever it is hidden.
+    pixman_region32_t clip;
+    pixman_region32_init_rect(&clip, key->x, key->y, key->w, key->h);
+    pixman_image_set_clip_region32(image, &clip);
+
+    pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, &win->wb->cfg.background, 1, &rect);
+    for (size_t i = 0; i < layout->num_overlaps[keycode]; i++) {
+        render_key_draw(win, layout->overlaps[keycode][i]);
+    }
+
+    pixman_image_set_clip_region32(image, NULL);
+    pixman_region32_fini(&clip);
+    render_damage(win, key->x, key->y, key->w, key->h);
+}
+
+static void
+render_key_text(struct wayboard *wb, pixman_image_t *image, struct cfg_key *key,
+                const pixman_color_t *text, const char *text_str) {
+    TRACE_SPAN("render_key_text");
+
+    struct wb_text *entry = render_text_lookup(wb, text_str);
+    if (!entry) {
+        return;
+    }
+
+    // It is assumed that the text run will be able to fit within the key rectangle.
+    render_text_draw(wb, image, render_solid(wb, text), entry,
+                     key->x + (key->w - entry->width) / 2, key->y + (key->h - entry->height) / 2);
+}
+
+static inline bool
+render_keys_overlap(const struct cfg_key *a, const struct cfg_key *b) {
+    return a->x < b->x + b->w && b->x < a->x + a->w && a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+static void
+render_layout(struct wayboard *wb, struct wb_layout *layout, pixman_image_t *image) {
+    // Keys are only filled once they have been pressed, so a layout with no keys pressed is just
+    // the background and the inactive icon or text of each key.
+    struct cfg_window *cfg = layout->cfg;
+
+    pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, &wb->cfg.background, 1,
+                                 &(pixman_rectangle16_t){
+                                     0,
+                                     0,
+                                     cfg->width,
+                                     cfg->height,
+                                 });
+
+    for (size_t i = 0; i < MAX_KEYS; i++) {
+        if (layout->icons[i][0]) {
+            render_key_icon(image, &cfg->keys[i], layout->icons[i][0]);
+        } else if (cfg->keys[i].text_inactive) {
+            render_key_text(wb, image, &cfg->keys[i], &wb->cfg.txt_inactive,
+                            cfg->keys[i].text_inactive);
+        }
+    }
+
+    render_layout_inputs(wb, cfg, image);
+}
+
+static void
+render_layout_inputs(struct wayboard *wb, struct cfg_window *cfg, pixman_image_t *image) {
+    // Pointer, gamepad and report rate elements are shown at rest.
+    if (cfg->motion.w > 0) {
+        render_motion(wb, image, &cfg->motion, 0, 0);
+    }
+    if (cfg->scroll.w > 0) {
+        render_scroll(wb, image, &cfg->scroll, 0, 0);
+    }
+    for (size_t i = 0; i < cfg->num_sticks; i++) {
+        render_stick(wb, image, &cfg->sticks[i], 0, 0);
+    }
+    for (size_t i = 0; i < cfg->num_triggers; i++) {
+        render_trigger(wb, image, &cfg->triggers[i], 0);
+    }
+    if (cfg->rate.w > 0) {
+        render_rate(wb, image, &cfg->rate, 0);
+    }
+}
+
+static void
+render_motion(struct wayboard *wb, pixman_image_t *image, struct cfg_motion *motion, double vx,
+              double vy) {
+    pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, &wb->cfg.fg_inactive, 1,
+                                 &(pixman_rectangle16_t){
+                                     motion->x,
+                                     motion->y,
+                                     motion->w,
+                                     motion->h,
+                                 });
+
+    // The motion is drawn as a line from the centre of the element, which reaches its edge at
+    // `speed` counts per second.
+    double radius = MIN(motion->w, motion->h) / 2.0;
+    double speed = sqrt(vx * vx + vy * vy);
+    double cx = motion->x + motion->w / 2.0;
+    double cy = motion->y + motion->h / 2.0;
+
+    double len = MIN(speed / motion->speed, 1.0) * radius;
+    double ux = speed > 0 ? vx / speed : 0;
+    double uy = speed > 0 ? vy / speed : 0;
+    double tx = cx + ux * len;
+    double ty = cy + uy * len;
+
+    // The line is one pixel wide on either side, made up of two triangles. It is rasterized into
+    // the motion mask and drawn through it, as pixman_composite_triangles would do with a mask of
+    // its own. The mask only exists for live windows, whose pointer can move.
+    double nx = -uy, ny = ux;
+#define POINT(px, py) {pixman_double_to_fixed(px), pixman_double_to_fixed(py)}
+    pixman_triangle_t line[2] = {
+        {POINT(cx + nx, cy + ny), POINT(cx - nx, cy - ny), POINT(tx + nx, ty + ny)},
+        {POINT(cx - nx, cy - ny), POINT(tx - nx, ty - ny), POINT(tx + nx, ty + ny)},
+    };
+#undef POINT
+
+    if (len >= 1 && wb->motion_mask) {
+        pixman_trapezoid_t traps[2 * ARRAY_LEN(line)];
+        for (size_t i = 0; i < ARRAY_LEN(line); i++) {
+            render_trapezoids(&line[i], &traps[2 * i]);
+        }
+
+        pixman_image_fill_rectangles(PIXMAN_OP_CLEAR, wb->motion_mask, &(pixman_color_t){0}, 1,
+                                     &(pixman_rectangle16_t){0, 0, motion->w, motion->h});
+        pixman_add_trapezoids(wb->motion_mask, -motion->x, -motion->y, ARRAY_LEN(traps), traps);
+        pixman_image_composite32(PIXMAN_OP_OVER, render_solid(wb, &wb->cfg.fg_active),
+                                 wb->motion_mask, image, 0, 0, 0, 0, motion->x, motion->y,
+                                 motion->w, motion->h);
+    }
+
+    // A small square marks the end of the line, so that the element is never empty. It is kept
+    // inside the element like the dot of a stick, since nothing outside of it is ever cleared.
+    int dot = MIN(MAX((int)(radius / 4), 2), MIN(motion->w, motion->h));
+    int dot_x = MIN(MAX((int)tx - dot / 2, motion->x), motion->x + motion->w - dot);
+    int dot_y = MIN(MAX((int)ty - dot / 2, motion->y), motion->y + motion->h - dot);
+    pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, &wb->cfg.fg_active, 1,
+                                 &(pixman_rectangle16_t){dot_x, dot_y, dot, dot});
+}
+
+static inline uint64_t
+render_now(struct wayboard *wb) {
+    return wb->state.offline_usec ? wb->state.offline_usec : usec_now();
+}
+
+static void
+render_pending(struct wb_window *win) {
+    TRACE_SPAN("render_pending");
+
+    if (win->state.pending_layout) {
+        win->state.pending_layout = false;
+        render_profile(win);
+    }
+
+    for (size_t i = 0; i < win->state.num_pending; i++) {
+        uint16_t code = win->state.pending[i];
+
+        win->state.is_pending[code] = false;
+        render_key(win, code);
+    }
+    win->state.num_pending = 0;
+
+    // A frame callback which arrived while the buffer was held did not draw or commit anything,
+    // so its frame is drawn now. Otherwise, the pending frame callback commits the new damage.
+    if (!win->wl.frame_cb) {
+        render_frame(win);
+        if (win->state.dirty || win->state.num_active > 0 || win->state.pointer.active) {
+            wayboard_commit_frame(win, win->state.last_render);
+        }
+    }
+}
+
+static void
+render_pointer(struct wb_window *win) {
+    TRACE_SPAN("render_pointer");
+
+    struct wayboard *wb = win->wb;
+    struct cfg_window *cfg = win->cfg;
+    if (cfg->motion.w == 0 && cfg->scroll.w == 0) {
+        return;
+    }
+
+    // Events between frames were only added to the totals, so the elements are drawn once for all
+    // of them, however many there were.
+    bool changed = win->state.pointer.events != wb->pointer.events;
+    if (!changed && !win->state.pointer.active) {
+        return;
+    }
+
+    uint64_t now = render_now(wb);
+    uint64_t interval = MIN(now - win->state.pointer.usec, MOTION_MAX_INTERVAL_USEC);
+    double dx = wb->pointer.dx - win->state.pointer.dx;
+    double dy = wb->pointer.dy - win->state.pointer.dy;
+    double vx = interval > 0 ? dx * 1000000 / interval : 0;
+    double vy = interval > 0 ? dy * 1000000 / interval : 0;
+
+    win->state.pointer.events = wb->pointer.events;
+    win->state.pointer.usec = now;
+    win->state.pointer.dx = wb->pointer.dx;
+    win->state.pointer.dy = wb->pointer.dy;
+
+    bool scrolling = now - wb->pointer.scroll_usec < SCROLL_BURST_USEC;
+    win->state.pointer.active = dx != 0 || dy != 0 || scrolling;
+
+    if (cfg->motion.w > 0) {
+        render_motion(wb, win->state.pixman_image, &cfg->motion, vx, vy);
+        render_damage(win, cfg->motion.x, cfg->motion.y, cfg->motion.w, cfg->motion.h);
+    }
+    if (cfg->scroll.w > 0) {
+        render_scroll(wb, win->state.pixman_image, &cfg->scroll,
+                      scrolling ? wb->pointer.scroll_x : 0, scrolling ? wb->pointer.scroll_y : 0);
+        render_damage(win, cfg->scroll.x, cfg->scroll.y, cfg->scroll.w, cfg->scroll.h);
+    }
+}
+
+static void *
+render_pool_worker(void *data) {
+    struct render_helper *helper = data;
+    struct wayboard *wb = helper->wb;
+
+    uint64_t generation = 0;
+    pthread_mutex_lock(&wb->pool.lock);
+    for (;;) {
+        while (!wb->pool.stop && wb->pool.generation == generation) {
+            pthread_cond_wait(&wb->pool.wake, &wb->pool.lock);
+        }
+        if (wb->pool.stop) {
+            break;
+        }
+        generation = wb->pool.generation;
+
+        struct render_tiles *tiles = wb->pool.tiles;
+        pthread_mutex_unlock(&wb->pool.lock);
+        render_tiles_draw(tiles, helper->index);
+        pthread_mutex_lock(&wb->pool.lock);
+
+        if (--wb->pool.busy == 0) {
+            pthread_cond_signal(&wb->pool.idle);
+        }
+    }
+    pthread_mutex_unlock(&wb->pool.lock);
+
+    return NULL;
+}
+
+static void
+render_profile(struct wb_window *win) {
+    TRACE_SPAN("render_profile");
+
+    if (!win->state.buf_released) {
+        win->state.pending_layout = true;
+        return;
+    }
+
+    render_tiled(win, win->layout, win->state.pixman_image, win->layout->idle);
+
+    // The idle layout shows the gamepad and report rate elements at rest, so they are drawn again
+    // on the next frame if any axis has moved or any device has reported.
+    win->state.gamepad.events = 0;
+    win->state.rate.reports = 0;
+    win->state.rate.hz = 0;
+    for (size_t i = 0; i < MAX_KEYS; i++) {
+        win->state.look[i] = LOOK_IDLE;
+    }
+
+    // Keys which are still held, such as the chord which triggered the switch, are shown as
+    // pressed in the new layout straight away.
+    for (size_t i = 0; i < MAX_KEYS; i++) {
+        struct wb_key_state *ks = &win->wb->state.keys[i];
+        if (ks->last_press_usec > ks->last_release_usec) {
+            render_key(win, i);
+        }
+    }
+}
+
+static void
+render_rate(struct wayboard *wb, pixman_image_t *image, struct cfg_rate *rate, int hz) {
+    pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, &wb->cfg.fg_inactive, 1,
+                                 &(pixman_rectangle16_t){
+                                     rate->x,
+                                     rate->y,
+                                     rate->w,
+                                     rate->h,
+                                 });
+
+    // A rate of 0 means that there is no estimate yet.
+    char text[32] = "- Hz";
+    if (hz > 0) {
+        snprintf(text, sizeof(text), "%d Hz", hz);
+    }
+
+    struct cfg_key key = {.x = rate->x, .y = rate->y, .w = rate->w, .h = rate->h};
+    render_key_chars(wb, image, &key, &wb->cfg.txt_inactive, text);
+}
+
+static void
+render_scroll(struct wayboard *wb, pixman_image_t *image, struct cfg_scroll *scroll, int x,
+              int y) {
+    bool active = x != 0 || y != 0;
+    pixman_image_fill_rectangles(PIXMAN_OP_SRC, image,
+                                 active ? &wb->cfg.fg_active : &wb->cfg.fg_inactive, 1,
+                                 &(pixman_rectangle16_t){
+                                     scroll->x,
+                                     scroll->y,
+                                     scroll->w,
+                                     scroll->h,
+                                 });
+    if (!active) {
+        return;
+    }
+
+    // The element shows the direction of the burst and how many ticks it has been scrolled by,
+    // counting partial ticks from high resolution wheels and touchpads as whole ones.
+    const char *arrow;
+    int ticks;
+    if (abs(y) >= abs(x)) {
+        arrow = y > 0 ? "v" : "^";
+        ticks = (abs(y) + 119) / 120;
+    } else {
+        arrow = x > 0 ? ">" : "<";
+        ticks = (abs(x) + 119) / 120;
+    }
+
+    char text[32];
+    snprintf(text, sizeof(text), "%s %d", arrow, ticks);
+
+    struct cfg_key key = {.x = scroll->x, .y = scroll->y, .w = scroll->w, .h = scroll->h};
+    render_key_chars(wb, image, &key, &wb->cfg.txt_active, text);
+}
+
+static pixman_image_t *
+render_solid(struct wayboard *wb, const pixman_color_t *color) {
+    // pixman keeps the top 8 bits of each channel of a solid fill when drawing into 8-bit images,
+    // so this draws exactly as pixman_image_create_solid_fill would.
+    uint32_t *pixel = pixman_image_get_data(wb->solid);
+    *pixel = (uint32_t)(color->alpha >> 8) << 24 | (uint32_t)(color->red >> 8) << 16 |
+             (uint32_t)(color->green >> 8) << 8 | (uint32_t)(color->blue >> 8);
+    return wb->solid;
+}
+
+static void
+render_stick(struct wayboard *wb, pixman_image_t *image, struct cfg_stick *stick, double x,
+             double y) {
+    pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, &wb->cfg.fg_inactive, 1,
+                                 &(pixman_rectangle16_t){
+                                     stick->x,
+                                     stick->y,
+                                     stick->w,
+                                     stick->h,
+                                 });
+
+    // The stick is shown as a square which moves across the element, reaching its edges when the
+    // stick is pushed all the way.
+    int dot = MAX(MIN(stick->w, stick->h) / 4, 2);
+    double cx = stick->x + stick->w / 2.0 + x * (stick->w - dot) / 2.0;
+    double cy = stick->y + stick->h / 2.0 + y * (stick->h - dot) / 2.0;
+    pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, &wb->cfg.fg_active, 1,
+                                 &(pixman_rectangle16_t){
+                                     (int)(cx - dot / 2.0),
+                                     (int)(cy - dot / 2.0),
+                                     dot,
+                                     dot,
+                                 });
+}
+
+static void
+render_text_draw(struct wayboard *wb, pixman_image_t *image, pixman_image_t *color,
+                 struct wb_text *entry, int x, int y) {
+    // Glyphs are drawn with the top left of the run at (x, y). Colour glyphs, such as emoji, are
+    // drawn as they are and the rest through `color`.
+    struct fcft_text_run *run = entry->run;
+    for (size_t i = 0; i < run->count; i++) {
+        const struct fcft_glyph *glyph = run->glyphs[i];
+        if (!glyph) {
+            continue;
+        }
+
+        bool colored = pixman_image_get_format(glyph->pix) == PIXMAN_a8r8g8b8;
+        pixman_image_composite32(PIXMAN_OP_OVER, colored ? glyph->pix : color,
+                                 colored ? NULL : glyph->pix, image, 0, 0, 0, 0, x + glyph->x,
+                                 y + wb->font->ascent - glyph->y, glyph->width, glyph->height);
+        x += glyph->advance.x;
+    }
+}
+
+static void
+render_text_evict(struct wayboard *wb) {
+    struct wb_text *entry = wb->text.lru_tail;
+
+    struct wb_text **link = &wb->text.buckets[entry->hash & (wb->text.num_buckets - 1)];
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+
+    wb->text.lru_tail = entry->lru_prev;
+    if (wb->text.lru_tail) {
+        wb->text.lru_tail->lru_next = NULL;
+    } else {
+        wb->text.lru_head = NULL;
+    }
+
+    fcft_text_run_destroy(entry->run);
+    free(entry->str);
+    wb->text.evictions++;
+}
+
+static struct wb_text *
+render_text_lookup(struct wayboard *wb, const char *str) {
+    // TODO: Use subpixel configuration of output
+    enum fcft_subpixel subpixel = FCFT_SUBPIXEL_DEFAULT;
+
+    uint64_t hash = hash_bytes(str, strlen(str));
+    struct wb_text **bucket = &wb->text.buckets[hash & (wb->text.num_buckets - 1)];
+
+    for (struct wb_text *entry = *bucket; entry; entry = entry->bucket_next) {
+        if (entry->hash == hash && entry->font == wb->font && entry->subpixel == subpixel &&
+            strcmp(entry->str, str) == 0) {
+            wb->text.hits++;
+            render_text_touch(wb, entry);
+            return entry;
+        }
+    }
+    wb->text.misses++;
+
+    struct fcft_text_run *run = render_text_rasterize(wb, str, subpixel);
+    if (!run) {
+        return NULL;
+    }
+
+    // Once the cache is full, the least recently used entry is replaced.
+    struct wb_text *entry;
+    if (wb->text.num_entries < wb->text.max_entries) {
+        entry = &wb->text.entries[wb->text.num_entries++];
+    } else {
+        entry = wb->text.lru_tail;
+        render_text_evict(wb);
+    }
+
+    *entry = (struct wb_text){
+        .bucket_next = *bucket,
+        .hash = hash,
+        .font = wb->font,
+        .subpixel = subpixel,
+        .str = strdup(str),
+        .run = run,
+    };
+    assert(entry->str);
+    *bucket = entry;
+
+    for (size_t i = 0; i < run->count; i++) {
+        if (!run->glyphs[i]) {
+            continue;
+        }
+
+        entry->width += run->glyphs[i]->advance.x;
+        entry->height = MAX(entry->height, run->glyphs[i]->height);
+    }
+
+    render_text_touch(wb, entry);
+    return entry;
+}
+
+static struct fcft_text_run *
+render_text_rasterize(struct wayboard *wb, const char *str, enum fcft_subpixel subpixel) {
+    TRACE_SPAN("render_text_rasterize");
+
+    // Convert the given text to UTF32. Every label which is looked up is either from the
+    // configuration or a single character, so the scratch space is always long enough.
+    size_t len = strlen(str);
+    assert(len < wb->text.utf32_len);
+    char32_t *utf32 = wb->text.utf32;
+
+    mbstate_t mbstate = {0};
+    const char *in = str;
+    const char *const end = str + len + 1;
+    size_t pos = 0;
+    for (;;) {
+        size_t n = mbrtoc32(&utf32[pos], in, end - in, &mbstate);
+
+        switch (n) {
+        case 0: // null byte
+            goto done_utf32;
+        case (size_t)(-1): // error cases
+        case (size_t)(-2):
+        case (size_t)(-3):
+            fprintf(stderr, "failed to convert '%s' to UTF-32\n", str);
+            return NULL;
+        default: // normal character
+            break;
+        }
+
+        pos++;
+        in += n;
+    }
+done_utf32:;
+
+    struct fcft_text_run *run = fcft_rasterize_text_run_utf32(wb->font, pos, utf32, subpixel);
+    if (!run) {
+        fprintf(stderr, "failed to rasterize text run for '%s'\n", str);
+    }
+
+    return run;
+}
+
+static void
+render_text_touch(struct wayboard *wb, struct wb_text *entry) {
+    if (wb->text.lru_head == entry) {
+        return;
+    }
+
+    // Unlink the entry if it is already in the list, then make it the most recently used.
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+        if (entry->lru_next) {
+            entry->lru_next->lru_prev = entry->lru_prev;
+        } else {
+            wb->text.lru_tail = entry->lru_prev;
+        }
+    }
+
+    entry->lru_prev = NULL;
+    entry->lru_next = wb->text.lru_head;
+    if (wb->text.lru_head) {
+        wb->text.lru_head->lru_prev = entry;
+    } else {
+        wb->text.lru_tail = entry;
+    }
+    wb->text.lru_head = entry;
+}
+
+static void
+render_tiled(struct wb_window *win, struct wb_layout *layout, pixman_image_t *image,
+             pixman_image_t *src) {
+    TRACE_SPAN("render_tiled");
+
+    struct wayboard *wb = win->wb;
+    struct render_tiles tiles = {
+        .wb = wb,
+        .layout = layout,
+        .image = image,
+        .src = src,
+        .width = pixman_image_get_width(image),
+        .height = pixman_image_get_height(image),
+    };
+    tiles.num_tiles = (tiles.height + RENDER_TILE_ROWS - 1) / RENDER_TILE_ROWS;
+    assert(tiles.num_tiles <= RENDER_MAX_TILES);
+
+    // The views of the window's own buffer are kept for as long as the window, and those of any
+    // other image only for this redraw.
+    pixman_image_t *views[RENDER_MAX_THREADS] = {0};
+    tiles.views = image == win->state.pixman_image ? win->state.tile_views : views;
+
+    bool shared = wb->pool.num_helpers > 0 && tiles.num_tiles > 1 &&
+                  (size_t)tiles.width * tiles.height >= RENDER_TILED_MIN_PIXELS;
+
+    // Every label is looked up before any helper is woken. A layout with more labels than fit in
+    // the text cache at once is drawn in one go instead, since looking up the last of them evicts
+    // the first. Images to copy from are the idle layouts, which init_render has validated.
+    bool tiled = true;
+    if (!src) {
+        uint64_t evictions = wb->text.evictions;
+        for (size_t i = 0; i < MAX_KEYS; i++) {
+            struct cfg_key *key = &layout->cfg->keys[i];
+            struct wb_icon *icon = layout->icons[i][0];
+
+            if (icon) {
+                if (shared) {
+                    render_validate(icon->image);
+                }
+                tiles.rows[i].top = key->y + (key->h - pixman_image_get_height(icon->image)) / 2;
+                tiles.rows[i].bottom = tiles.rows[i].top + pixman_image_get_height(icon->image);
+            } else if (key->text_inactive) {
+                struct wb_text *entry = render_text_lookup(wb, key->text_inactive);
+                if (!entry) {
+                    continue;
+                }
+
+                // Glyphs are placed as in render_key_text.
+                int baseline = key->y + (key->h - entry->height) / 2 + wb->font->ascent;
+                tiles.texts[i] = entry;
+                tiles.rows[i].top = INT_MAX;
+                tiles.rows[i].bottom = INT_MIN;
+                for (size_t j = 0; j < entry->run->count; j++) {
+                    const struct fcft_glyph *glyph = entry->run->glyphs[j];
+                    if (!glyph) {
+                        continue;
+                    }
+
+                    if (shared) {
+                        render_validate(glyph->pix);
+                    }
+                    tiles.rows[i].top = MIN(tiles.rows[i].top, baseline - glyph->y);
+                    tiles.rows[i].bottom =
+                        MAX(tiles.rows[i].bottom, baseline - glyph->y + glyph->height);
+                }
+            }
+        }
+        tiled = wb->text.evictions == evictions;
+    }
+
+    if (tiled) {
+        if (shared) {
+            pthread_mutex_lock(&wb->pool.lock);
+            wb->pool.tiles = &tiles;
+            wb->pool.generation++;
+            wb->pool.busy = wb->pool.num_helpers;
+            pthread_cond_broadcast(&wb->pool.wake);
+            pthread_mutex_unlock(&wb->pool.lock);
+        }
+
+        render_tiles_draw(&tiles, 0);
+        if (shared) {
+            pthread_mutex_lock(&wb->pool.lock);
+            while (wb->pool.busy > 0) {
+                pthread_cond_wait(&wb->pool.idle, &wb->pool.lock);
+            }
+            pthread_mutex_unlock(&wb->pool.lock);
+        }
+        if (!src) {
+            render_layout_inputs(wb, layout->cfg, image);
+        }
+    } else {
+        render_layout(wb, layout, image);
+        memset(tiles.damaged, true, tiles.num_tiles * sizeof(*tiles.damaged));
+    }
+
+    // Tiles of the window's own buffer are damaged as they were drawn, with runs of neighbouring
+    // tiles merged into one rectangle.
+    if (image == win->state.pixman_image) {
+        for (size_t i = 0; i < tiles.num_tiles;) {
+            if (!tiles.damaged[i]) {
+                i++;
+                continue;
+            }
+
+            size_t end = i + 1;
+            while (end < tiles.num_tiles && tiles.damaged[end]) {
+                end++;
+            }
+
+            int y = i * RENDER_TILE_ROWS;
+            int h = MIN((int)end * RENDER_TILE_ROWS, tiles.height) - y;
+            render_damage(win, 0, y, tiles.width, h);
+            i = end;
+        }
+    }
+
+    for (size_t i = 0; tiles.views == views && i < ARRAY_LEN(views); i++) {
+        if (views[i]) {
+            pixman_image_unref(views[i]);
+        }
+    }
+}
+
+static void
+render_tiles_draw(struct render_tiles *tiles, size_t index) {
+    TRACE_SPAN("render_tiles");
+
+    struct wayboard *wb = tiles->wb;
+    struct wb_layout *layout = tiles->layout;
+
+    // Each thread draws through a view of its own, since the clip is a property of the image.
+    pixman_image_t *image = tiles->views[index];
+    if (!image) {
+        image = pixman_image_create_bits(
+            pixman_image_get_format(tiles->image), tiles->width, tiles->height,
+            pixman_image_get_data(tiles->image), pixman_image_get_stride(tiles->image));
+        assert(image);
+        tiles->views[index] = image;
+    }
+
+    for (;;) {
+        size_t tile = atomic_fetch_add_explicit(&tiles->next_tile, 1, memory_order_relaxed);
+        if (tile >= tiles->num_tiles) {
+            break;
+        }
+
+        int y = tile * RENDER_TILE_ROWS;
+        int h = MIN(RENDER_TILE_ROWS, tiles->height - y);
+
+        pixman_region32_t clip;
+        pixman_region32_init_rect(&clip, 0, y, tiles->width, h);
+        pixman_image_set_clip_region32(image, &clip);
+        pixman_region32_fini(&clip);
+
+        if (tiles->src) {
+            // Tiles which already show the same pixels, such as the parts of two profiles which
+            // only differ in a few keys, are neither copied nor damaged.
+            const uint8_t *from = (const uint8_t *)pixman_image_get_data(tiles->src);
+            const uint8_t *to = (const uint8_t *)pixman_image_get_data(image);
+            size_t from_stride = pixman_image_get_stride(tiles->src);
+            size_t to_stride = pixman_image_get_stride(image);
+
+            bool same = true;
+            for (int row = y; row < y + h && same; row++) {
+                same = memcmp(from + row * from_stride, to + row * to_stride,
+                              (size_t)tiles->width * 4) == 0;
+            }
+            if (same) {
+                continue;
+            }
+
+            pixman_image_composite32(PIXMAN_OP_SRC, tiles->src, NULL, image, 0, y, 0, 0, 0, y,
+                                     tiles->width, h);
+        } else {
+            // Only keys whose label or icon reaches into the tile are drawn into it, in the same
+            // order as render_layout draws them, so overlapping keys come out the same.
+            pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, &wb->cfg.background, 1,
+                                         &(pixman_rectangle16_t){
+                                             0,
+                                             y,
+                                             tiles->width,
+                                             h,
+                                         });
+
+            for (size_t i = 0; i < MAX_KEYS; i++) {
+                if (tiles->rows[i].top >= y + h || tiles->rows[i].bottom <= y) {
+                    continue;
+                }
+
+                struct cfg_key *key = &layout->cfg->keys[i];
+                if (layout->icons[i][0]) {
+                    render_key_icon(image, key, layout->icons[i][0]);
+                } else if (tiles->texts[i]) {
+                    struct wb_text *entry = tiles->texts[i];
+                    render_text_draw(wb, image, wb->label_color, entry,
+                                     key->x + (key->w - entry->width) / 2,
+                                     key->y + (key->h - entry->height) / 2);
+                }
+            }
+        }
+
+        tiles->damaged[tile] = true;
+    }
+}
+
+static void
+render_trapezoids(const pixman_triangle_t *tri, pixman_trapezoid_t *traps) {
+    // Splits a triangle into two trapezoids at the height of its middle vertex, in the same way as
+    // pixman_add_triangles does, but without allocating.
+    const pixman_point_fixed_t *top = &tri->p1, *left = &tri->p2, *right = &tri->p3, *tmp;
+    if (top->y > left->y || (top->y == left->y && top->x > left->x)) {
+        tmp = left, left = top, top = tmp;
+    }
+    if (top->y > right->y || (top->y == right->y && top->x > right->x)) {
+        tmp = right, right = top, top = tmp;
+    }
+
+    // The two remaining vertices are swapped if `right` is in fact to the left of `left`.
+    int64_t cross = (int64_t)(left->y - top->y) * (right->x - top->x) -
+                    (int64_t)(right->y - top->y) * (left->x - top->x);
+    if (cross < 0) {
+        tmp = right, right = left, left = tmp;
+    }
+
+    traps[0] = (pixman_trapezoid_t){
+        .top = top->y,
+        .bottom = MIN(left->y, right->y),
+        .left = {*top, *left},
+        .right = {*top, *right},
+    };
+    traps[1] = traps[0];
+    if (right->y < left->y) {
+        traps[1].top = right->y;
+        traps[1].bottom = left->y;
+        traps[1].right = (pixman_line_fixed_t){*right, *left};
+    } else {
+        traps[1].top = left->y;
+        traps[1].bottom = right->y;
+        traps[1].left = (pixman_line_fixed_t){*left, *right};
+    }
+}
+
+static void
+render_trigger(struct wayboard *wb, pixman_image_t *image, struct cfg_trigger *trigger,
+               double value) {
+    pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, &wb->cfg.fg_inactive, 1,
+                                 &(pixman_rectangle16_t){
+                                     trigger->x,
+                                     trigger->y,
+                                     trigger->w,
+                                     trigger->h,
+                                 });
+
+    // Tall triggers fill up from the bottom and wide ones from the left.
+    pixman_rectangle16_t bar;
+    if (trigger->h >= trigger->w) {
+        int h = (int)(value * trigger->h + 0.5);
+        bar = (pixman_rectangle16_t){trigger->x, trigger->y + trigger->h - h, trigger->w, h};
+    } else {
+        int w = (int)(value * trigger->w + 0.5);
+        bar = (pixman_rectangle16_t){trigger->x, trigger->y, w, trigger->h};
+    }
+
+    if (bar.width > 0 && bar.height > 0) {
+        pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, &wb->cfg.fg_active, 1, &bar);
+    }
+}
+
+static void
+render_validate(pixman_image_t *image) {
+    // pixman validates images lazily the first time they are drawn with, which writes to them, so
+    // images which several threads are about to draw with at once are drawn with once up front.
+    pixman_image_t *scratch = pixman_image_create_bits(PIXMAN_a8r8g8b8, 1, 1, NULL, 0);
+    assert(scratch);
+    pixman_image_composite32(PIXMAN_OP_OVER, image, NULL, scratch, 0, 0, 0, 0, 0, 0, 1, 1);
+    pixman_image_unref(scratch);
+}
+
+static bool
+snapshot_check_window(const struct cfg_window *win) {
+    // Rectangles which are not set are all zero, which is inside any window.
+#define INSIDE(r)                                                                                  \
+    ((r).x >= 0 && (r).y >= 0 && (r).w >= 0 && (r).h >= 0 && (r).x <= win->width - (r).w &&       \
+     (r).y <= win->height - (r).h)
+
+    // The same ranges as the text parser enforces are checked, since a snapshot with a valid
+    // checksum may still have been written by another build. Everything is also kept inside the
+    // window, since nothing outside of it is ever cleared or damaged.
+    if (win->width < 1 || win->height < 1 || win->width > 4096 || win->height > 4096 ||
+        !INSIDE(win->motion) || win->motion.speed <= 0 || !INSIDE(win->scroll) ||
+        !INSIDE(win->rate)) {
+        return false;
+    }
+    for (size_t i = 0; i < win->num_sticks; i++) {
+        if (!INSIDE(win->sticks[i]) || win->sticks[i].w <= 0 || win->sticks[i].h <= 0) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < win->num_triggers; i++) {
+        if (!INSIDE(win->triggers[i]) || win->triggers[i].w <= 0 || win->triggers[i].h <= 0) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < MAX_KEYS; i++) {
+        const struct cfg_key *key = &win->keys[i];
+        if (!INSIDE(*key) || key->radius < 0 || key->border < 0) {
+            return false;
+        }
+    }
+
+#undef INSIDE
+    return true;
 }
 
 static int
-init_read_config(struct wayboard *wb, const char *path) {
+snapshot_compile(const char *config_path, const char *out_path) {
+    struct cfg cfg = {0};
+
     config_t conf;
     config_init(&conf);
-    if (config_read_file(&conf, path) != CONFIG_TRUE) {
-        fprintf(stderr, "failed to read config file\n");
+    if (config_read_file(&conf, config_path) != CONFIG_TRUE) {
+        fprintf(stderr, "failed to read config file: %s:%d: %s\n", config_path,
+                config_error_line(&conf), config_error_text(&conf));
+        config_destroy(&conf);
+        return 1;
+    }
+    int ret = cfg_read(&cfg, &conf);
+    config_destroy(&conf);
+    if (ret != 0) {
         return 1;
     }
 
-    int ret = cfg_read(&wb->cfg, &conf);
+    // A snapshot which wayboard would refuse to load is not written in the first place.
+    for (size_t i = 0; i < cfg.num_windows * cfg.num_profiles; i++) {
+        if (!snapshot_check_window(&cfg.windows[i])) {
+            fprintf(stderr, "window %zu has an empty size or keys outside of it\n",
+                    i % cfg.num_windows);
+            cfg_destroy(&cfg);
+            return 1;
+        }
+    }
 
-    config_destroy(&conf);
+    uint64_t source_hash;
+    if (snapshot_hash_file(config_path, &source_hash) != 0) {
+        goto fail_hash;
+    }
+
+    size_t num_windows = cfg.num_windows * cfg.num_profiles;
+    size_t num_keys = 0;
+    for (size_t i = 0; i < num_windows; i++) {
+        for (size_t j = 0; j < MAX_KEYS; j++) {
+            if (cfg.windows[i].keys[j].w != 0) {
+                num_keys++;
+            }
+        }
+    }
+
+    struct snapshot_strings strings = {0};
+    snapshot_intern(&strings, "");
+
+    struct snapshot_window *windows = calloc(num_windows, sizeof(*windows));
+    assert(windows);
+    struct snapshot_key *keys = calloc(num_keys ? num_keys : 1, sizeof(*keys));
+    assert(keys);
+    struct snapshot_profile *profiles = calloc(cfg.num_profiles, sizeof(*profiles));
+    assert(profiles);
+
+    for (size_t i = 0; i < cfg.num_profiles; i++) {
+        profiles[i] = (struct snapshot_profile){
+            .name = snapshot_intern(&strings, cfg.profiles[i].name),
+            .chord_len = cfg.profiles[i].chord_len,
+        };
+        memcpy(profiles[i].chord, cfg.profiles[i].chord, sizeof(profiles[i].chord));
+    }
+
+    size_t key = 0;
+    for (size_t i = 0; i < num_windows; i++) {
+        struct cfg_window *win = &cfg.windows[i];
+
+        windows[i] = (struct snapshot_window){
+            .name = snapshot_intern(&strings, win->name),
+            .width = win->width,
+            .height = win->height,
+            .motion_x = win->motion.x,
+            .motion_y = win->motion.y,
+            .motion_w = win->motion.w,
+            .motion_h = win->motion.h,
+            .motion_speed = win->motion.speed,
+            .scroll_x = win->scroll.x,
+            .scroll_y = win->scroll.y,
+            .scroll_w = win->scroll.w,
+            .scroll_h = win->scroll.h,
+            .rate_x = win->rate.x,
+            .rate_y = win->rate.y,
+            .rate_w = win->rate.w,
+            .rate_h = win->rate.h,
+            .num_sticks = win->num_sticks,
+            .num_triggers = win->num_triggers,
+            .first_key = key,
+        };
+
+        for (size_t j = 0; j < win->num_sticks; j++) {
+            struct cfg_stick *st = &win->sticks[j];
+            windows[i].sticks[j].x = st->x;
+            windows[i].sticks[j].y = st->y;
+            windows[i].sticks[j].w = st->w;
+            windows[i].sticks[j].h = st->h;
+            windows[i].sticks[j].axis_x = st->axis_x;
+            windows[i].sticks[j].axis_y = st->axis_y;
+        }
+        for (size_t j = 0; j < win->num_triggers; j++) {
+            struct cfg_trigger *tr = &win->triggers[j];
+            windows[i].triggers[j].x = tr->x;
+            windows[i].triggers[j].y = tr->y;
+            windows[i].triggers[j].w = tr->w;
+            windows[i].triggers[j].h = tr->h;
+            windows[i].triggers[j].axis = tr->axis;
+        }
+
+        for (size_t j = 0; j < MAX_KEYS; j++) {
+            struct cfg_key *k = &win->keys[j];
+            if (k->w == 0) {
+                continue;
+            }
+
+            keys[key++] = (struct snapshot_key){
+                .code = j,
+                .x = k->x,
+                .y = k->y,
+                .w = k->w,
+                .h = k->h,
+                .text_active = snapshot_intern(&strings, k->text_active),
+                .text_inactive = snapshot_intern(&strings, k->text_inactive),
+                .icon_active = snapshot_intern(&strings, k->icon_active),
+                .icon_inactive = snapshot_intern(&strings, k->icon_inactive),
+                .radius = k->radius,
+                .border = k->border,
+                .fg_active = k->fg_active,
+                .fg_inactive = k->fg_inactive,
+                .border_color = k->border_color,
+            };
+        }
+        windows[i].num_keys = key - windows[i].first_key;
+    }
+
+    struct snapshot_header header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .source_hash = source_hash,
+
+        .num_windows = cfg.num_windows,
+        .num_keys = num_keys,
+        .num_profiles = cfg.num_profiles,
+
+        .background = cfg.background,
+        .fg_active = cfg.fg_active,
+        .fg_inactive = cfg.fg_inactive,
+        .txt_active = cfg.txt_active,
+        .txt_inactive = cfg.txt_inactive,
+        .border_color = cfg.border_color,
+        .radius = cfg.radius,
+        .border = cfg.border,
+        .font = snapshot_intern(&strings, cfg.font),
+        .time_threshold = cfg.time_threshold,
+        .threshold_life = cfg.threshold_life,
+        .fade_time = cfg.fade_time,
+        .shm_name = snapshot_intern(&strings, cfg.shm_name),
+        .record_path = snapshot_intern(&strings, cfg.record_path),
+        .record_max_size = cfg.record_max_size,
+    };
+    header.windows_offset = sizeof(header);
+    header.keys_offset = header.windows_offset + num_windows * sizeof(*windows);
+    header.profiles_offset = header.keys_offset + num_keys * sizeof(*keys);
+    header.strings_offset = header.profiles_offset + cfg.num_profiles * sizeof(*profiles);
+    header.strings_size = strings.size;
+    header.size = header.strings_offset + strings.size;
+
+    char *data = calloc(1, header.size);
+    assert(data);
+    memcpy(data + header.windows_offset, windows, num_windows * sizeof(*windows));
+    memcpy(data + header.keys_offset, keys, num_keys * sizeof(*keys));
+    memcpy(data + header.profiles_offset, profiles, cfg.num_profiles * sizeof(*profiles));
+    memcpy(data + header.strings_offset, strings.data, strings.size);
+    header.checksum = hash_bytes(data + sizeof(header), header.size - sizeof(header));
+    memcpy(data, &header, sizeof(header));
+
+    // Write to a temporary file first so that a running wayboard never sees a partial snapshot.
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+
+    ret = 1;
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        fprintf(stderr, "failed to open '%s': %s\n", tmp_path, strerror(errno));
+        goto fail_open;
+    }
+    if (fwrite(data, 1, header.size, file) != header.size || fclose(file) != 0) {
+        fprintf(stderr, "failed to write '%s'\n", tmp_path);
+        unlink(tmp_path);
+        goto fail_write;
+    }
+    if (rename(tmp_path, out_path) != 0) {
+        fprintf(stderr, "failed to rename '%s': %s\n", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        goto fail_write;
+    }
+    ret = 0;
+
+fail_write:
+fail_open:
+    free(data);
+    free(profiles);
+    free(keys);
+    free(windows);
+    free(strings.data);
+
+fail_hash:
+    cfg_destroy(&cfg);
     return ret;
 }
 
 static int
-init_render(struct wayboard *wb) {
-    size_t shm_stride = wb->cfg.width * 4;
-    wb->state.pixman_image = pixman_image_create_bits(PIXMAN_a8r8g8b8, wb->cfg.width, wb->cfg.width,
-                                                      wb->state.shm_data, shm_stride);
-    if (!wb->state.pixman_image) {
-        fprintf(stderr, "failed to create pixman image\n");
+snapshot_hash_file(const char *path, uint64_t *out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open '%s': %s\n", path, strerror(errno));
         return 1;
     }
 
-    pixman_image_fill_rectangles(PIXMAN_OP_SRC, wb->state.pixman_image, &wb->cfg.background, 1,
-                                 &(pixman_rectangle16_t){
-                                     0,
-                                     0,
-                                     wb->cfg.width,
-                                     wb->cfg.height,
-                                 });
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "failed to stat '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        *out = hash_bytes(NULL, 0);
+        close(fd);
+        return 0;
+    }
 
-    for (size_t i = 0; i < MAX_KEYS; i++) {
-        if (!wb->cfg.keys[i].text_inactive) {
-            continue;
-        }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "failed to mmap '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    *out = hash_bytes(data, st.st_size);
+    munmap(data, st.st_size);
+    return 0;
+}
+
+static uint32_t
+snapshot_intern(struct snapshot_strings *strings, const char *str) {
+    if (!str) {
+        return 0;
+    }
 
-        render_key_text(wb, &wb->cfg.keys[i], &wb->cfg.txt_inactive, wb->cfg.keys[i].text_inactive);
+    // Labels are frequently repeated (e.g. across windows), so each distinct string is only
+    // stored once.
+    for (size_t off = 0; off < strings->size; off += strlen(strings->data + off) + 1) {
+        if (strcmp(strings->data + off, str) == 0) {
+            return off;
+        }
     }
 
-    wl_surface_damage_buffer(wb->wl.surface, 0, 0, INT32_MAX, INT32_MAX);
-    wayboard_commit_frame(wb, 0);
+    size_t len = strlen(str) + 1;
+    if (strings->size + len > strings->cap) {
+        strings->cap = MAX(strings->cap * 2, strings->size + len);
+        strings->data = realloc(strings->data, strings->cap);
+        assert(strings->data);
+    }
 
-    return 0;
+    size_t off = strings->size;
+    memcpy(strings->data + off, str, len);
+    strings->size += len;
+    return off;
 }
 
 static int
-init_wayland(struct wayboard *wb) {
-    wb->wl.display = wl_display_connect(NULL);
-    if (!wb->wl.display) {
-        perror("failed to connect to a wayland display");
+snapshot_load(struct cfg *cfg, const char *snapshot_path, const char *config_path) {
+    int fd = open(snapshot_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open snapshot '%s': %s\n", snapshot_path, strerror(errno));
         return 1;
     }
 
-    wb->wl.registry = wl_display_get_registry(wb->wl.display);
-    assert(wb->wl.registry);
-    wl_registry_add_listener(wb->wl.registry, &registry_listener, wb);
-    if (wl_display_roundtrip(wb->wl.display) == -1) {
-        perror("failed to roundtrip wayland display during init");
-        goto fail_roundtrip_globals;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct snapshot_header)) {
+        fprintf(stderr, "snapshot '%s' is truncated\n", snapshot_path);
+        close(fd);
+        return 1;
     }
 
-    if (!wb->wl.compositor || !wb->wl.shm || !wb->wl.xdg_wm_base) {
-        fprintf(stderr, "missing wayland globals\n");
-        goto fail_globals;
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "failed to mmap snapshot '%s': %s\n", snapshot_path, strerror(errno));
+        return 1;
     }
 
-    size_t shm_stride = wb->cfg.width * 4;
-    size_t shm_size = wb->cfg.height * shm_stride;
-    wb->state.shm_fd = memfd_create("wayboard-shm", MFD_CLOEXEC);
-    if (wb->state.shm_fd < 0) {
-        perror("failed to create memfd");
-        goto fail_memfd;
+    const struct snapshot_header *header = (const void *)data;
+    if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "snapshot '%s' was written by another version of wayboard\n",
+                snapshot_path);
+        goto fail;
     }
-    if (ftruncate(wb->state.shm_fd, shm_size) != 0) {
-        perror("failed to expand memfd");
-        goto fail_memfd_truncate;
+    if (header->size != (uint64_t)st.st_size ||
+        header->checksum != hash_bytes(data + sizeof(*header), st.st_size - sizeof(*header))) {
+        fprintf(stderr, "snapshot '%s' is corrupt\n", snapshot_path);
+        goto fail;
     }
-    wb->state.shm_data =
-        mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, wb->state.shm_fd, 0);
-    if (wb->state.shm_data == MAP_FAILED) {
-        perror("failed to mmap memfd");
-        goto fail_memfd_mmap;
+
+    uint64_t source_hash;
+    if (snapshot_hash_file(config_path, &source_hash) != 0) {
+        goto fail;
+    }
+    if (header->source_hash != source_hash) {
+        fprintf(stderr, "snapshot '%s' is out of date\n", snapshot_path);
+        goto fail;
     }
 
-    struct wl_shm_pool *shm_pool = wl_shm_create_pool(wb->wl.shm, wb->state.shm_fd, shm_size);
-    assert(shm_pool);
-    wb->wl.buffer = wl_shm_pool_create_buffer(shm_pool, 0, wb->cfg.width, wb->cfg.height,
-                                              shm_stride, WL_SHM_FORMAT_ARGB8888);
-    assert(wb->wl.buffer);
-    wl_buffer_add_listener(wb->wl.buffer, &buffer_listener, wb);
-    wl_shm_pool_destroy(shm_pool);
+    // The checksum only protects against accidental corruption, so the layout is still checked
+    // before anything is read from it.
+    const char *strings = data + header->strings_offset;
+    uint64_t num_windows = (uint64_t)header->num_windows * header->num_profiles;
+    if (header->num_windows == 0 || header->num_windows > MAX_WINDOWS ||
+        header->num_profiles == 0 || header->num_profiles > MAX_PROFILES ||
+        (uint64_t)header->windows_offset + num_windows * sizeof(struct snapshot_window) >
+            header->size ||
+        (uint64_t)header->keys_offset + header->num_keys * sizeof(struct snapshot_key) >
+            header->size ||
+        (uint64_t)header->profiles_offset +
+                header->num_profiles * sizeof(struct snapshot_profile) >
+            header->size ||
+        (uint64_t)header->strings_offset + header->strings_size != header->size ||
+        header->strings_size == 0 || strings[header->strings_size - 1] != '\0') {
+        fprintf(stderr, "snapshot '%s' is corrupt\n", snapshot_path);
+        goto fail;
+    }
 
-    wb->wl.surface = wl_compositor_create_surface(wb->wl.compositor);
-    assert(wb->wl.surface);
-    wb->wl.xdg_surface = xdg_wm_base_get_xdg_surface(wb->wl.xdg_wm_base, wb->wl.surface);
-    assert(wb->wl.xdg_surface);
-    wb->wl.xdg_toplevel = xdg_surface_get_toplevel(wb->wl.xdg_surface);
-    assert(wb->wl.xdg_toplevel);
-
-    xdg_surface_add_listener(wb->wl.xdg_surface, &xdg_surface_listener, wb);
-    xdg_toplevel_add_listener(wb->wl.xdg_toplevel, &xdg_toplevel_listener, wb);
-
-    xdg_toplevel_set_app_id(wb->wl.xdg_toplevel, "wayboard");
-    xdg_toplevel_set_title(wb->wl.xdg_toplevel, "wayboard");
-    xdg_toplevel_set_min_size(wb->wl.xdg_toplevel, wb->cfg.width, wb->cfg.height);
-    xdg_toplevel_set_max_size(wb->wl.xdg_toplevel, wb->cfg.width, wb->cfg.height);
-    wl_surface_commit(wb->wl.surface);
-    if (wl_display_roundtrip(wb->wl.display) == -1) {
-        perror("failed to roundtrip wayland display during xdg_toplevel init");
-        goto fail_roundtrip_globals;
+#define SNAPSHOT_STRING(off) ((off) != 0 && (off) < header->strings_size ? strings + (off) : NULL)
+
+    const struct snapshot_window *windows = (const void *)(data + header->windows_offset);
+    const struct snapshot_key *keys = (const void *)(data + header->keys_offset);
+    const struct snapshot_profile *profiles = (const void *)(data + header->profiles_offset);
+
+    cfg->profiles = calloc(header->num_profiles, sizeof(*cfg->profiles));
+    assert(cfg->profiles);
+    cfg->num_profiles = header->num_profiles;
+
+    for (size_t i = 0; i < header->num_profiles; i++) {
+        const struct snapshot_profile *sp = &profiles[i];
+        if (sp->chord_len > MAX_CHORD) {
+            fprintf(stderr, "snapshot '%s' is corrupt\n", snapshot_path);
+            goto fail_windows;
+        }
+
+        cfg->profiles[i].name = (char *)SNAPSHOT_STRING(sp->name);
+        cfg->profiles[i].chord_len = sp->chord_len;
+        for (size_t j = 0; j < sp->chord_len; j++) {
+            if (sp->chord[j] >= MAX_KEYS) {
+                fprintf(stderr, "snapshot '%s' is corrupt\n", snapshot_path);
+                goto fail_windows;
+            }
+            cfg->profiles[i].chord[j] = sp->chord[j];
+        }
     }
 
-    return 0;
+    cfg->windows = calloc(num_windows, sizeof(*cfg->windows));
+    assert(cfg->windows);
+    cfg->num_windows = header->num_windows;
 
-fail_memfd_mmap:
-fail_memfd_truncate:
-    close(wb->state.shm_fd);
+    for (size_t i = 0; i < num_windows; i++) {
+        const struct snapshot_window *sw = &windows[i];
+        struct cfg_window *win = &cfg->windows[i];
 
-fail_memfd:
-fail_globals:
-    if (wb->wl.compositor) {
-        wl_compositor_destroy(wb->wl.compositor);
+        if ((uint64_t)sw->first_key + sw->num_keys > header->num_keys ||
+            sw->num_sticks > MAX_STICKS || sw->num_triggers > MAX_TRIGGERS) {
+            fprintf(stderr, "snapshot '%s' is corrupt\n", snapshot_path);
+            goto fail_windows;
+        }
+
+        win->name = (char *)SNAPSHOT_STRING(sw->name);
+        win->width = sw->width;
+        win->height = sw->height;
+        win->motion = (struct cfg_motion){
+            sw->motion_x, sw->motion_y, sw->motion_w, sw->motion_h, sw->motion_speed,
+        };
+        win->scroll = (struct cfg_scroll){sw->scroll_x, sw->scroll_y, sw->scroll_w, sw->scroll_h};
+        win->rate = (struct cfg_rate){sw->rate_x, sw->rate_y, sw->rate_w, sw->rate_h};
+
+        for (size_t j = 0; j < sw->num_sticks; j++) {
+            if (sw->sticks[j].axis_x >= ABS_CNT || sw->sticks[j].axis_y >= ABS_CNT) {
+                fprintf(stderr, "snapshot '%s' is corrupt\n", snapshot_path);
+                goto fail_windows;
+            }
+            win->sticks[j] = (struct cfg_stick){
+                .x = sw->sticks[j].x,
+                .y = sw->sticks[j].y,
+                .w = sw->sticks[j].w,
+                .h = sw->sticks[j].h,
+                .axis_x = sw->sticks[j].axis_x,
+                .axis_y = sw->sticks[j].axis_y,
+            };
+        }
+        win->num_sticks = sw->num_sticks;
+        for (size_t j = 0; j < sw->num_triggers; j++) {
+            if (sw->triggers[j].axis >= ABS_CNT) {
+                fprintf(stderr, "snapshot '%s' is corrupt\n", snapshot_path);
+                goto fail_windows;
+            }
+            win->triggers[j] = (struct cfg_trigger){
+                .x = sw->triggers[j].x,
+                .y = sw->triggers[j].y,
+                .w = sw->triggers[j].w,
+                .h = sw->triggers[j].h,
+                .axis = sw->triggers[j].axis,
+            };
+        }
+        win->num_triggers = sw->num_triggers;
+
+        for (size_t j = sw->first_key; j < sw->first_key + sw->num_keys; j++) {
+            const struct snapshot_key *sk = &keys[j];
+            if (sk->code >= MAX_KEYS) {
+                fprintf(stderr, "snapshot '%s' is corrupt\n", snapshot_path);
+                goto fail_windows;
+            }
+
+            win->keys[sk->code] = (struct cfg_key){
+                .x = sk->x,
+                .y = sk->y,
+                .w = sk->w,
+                .h = sk->h,
+                .text_active = (char *)SNAPSHOT_STRING(sk->text_active),
+                .text_inactive = (char *)SNAPSHOT_STRING(sk->text_inactive),
+                .icon_active = (char *)SNAPSHOT_STRING(sk->icon_active),
+                .icon_inactive = (char *)SNAPSHOT_STRING(sk->icon_inactive),
+                .radius = sk->radius,
+                .border = sk->border,
+                .fg_active = sk->fg_active,
+                .fg_inactive = sk->fg_inactive,
+                .border_color = sk->border_color,
+            };
+        }
+
+        if (!snapshot_check_window(win)) {
+            fprintf(stderr, "snapshot '%s' has invalid values\n", snapshot_path);
+            goto fail_windows;
+        }
     }
-    if (wb->wl.shm) {
-        wl_shm_destroy(wb->wl.shm);
+
+    cfg->background = header->background;
+    cfg->fg_active = header->fg_active;
+    cfg->fg_inactive = header->fg_inactive;
+    cfg->txt_active = header->txt_active;
+    cfg->txt_inactive = header->txt_inactive;
+    cfg->border_color = header->border_color;
+    cfg->radius = header->radius;
+    cfg->border = header->border;
+    cfg->font = (char *)SNAPSHOT_STRING(header->font);
+    cfg->time_threshold = header->time_threshold;
+    cfg->threshold_life = header->threshold_life;
+    cfg->fade_time = header->fade_time;
+    cfg->shm_name = (char *)SNAPSHOT_STRING(header->shm_name);
+    cfg->record_path = (char *)SNAPSHOT_STRING(header->record_path);
+    cfg->record_max_size = header->record_max_size;
+
+#undef SNAPSHOT_STRING
+
+    if (cfg->radius < 0 || cfg->border < 0 || cfg->fade_time < 0) {
+        fprintf(stderr, "snapshot '%s' has invalid values\n", snapshot_path);
+        goto fail_windows;
     }
-    if (wb->wl.xdg_wm_base) {
-        xdg_wm_base_destroy(wb->wl.xdg_wm_base);
+    if (!cfg->font) {
+        fprintf(stderr, "snapshot '%s' is corrupt\n", snapshot_path);
+        goto fail_windows;
     }
 
-fail_roundtrip_globals:
-    wl_registry_destroy(wb->wl.registry);
-    wl_display_disconnect(wb->wl.display);
+    cfg->snapshot = data;
+    cfg->snapshot_size = st.st_size;
+    return 0;
+
+fail_windows:
+    free(cfg->profiles);
+    free(cfg->windows);
+    *cfg = (struct cfg){0};
+
+fail:
+    munmap(data, st.st_size);
     return 1;
 }
 
+#ifdef WAYBOARD_TRACE
 static void
-render_frame(struct wayboard *wb) {
-    // Wait until the SHM buffer is available for new content.
-    wayboard_spin_buffer_release(wb);
+trace_dump() {
+    FILE *file = fopen(trace_path, "w");
+    if (!file) {
+        fprintf(stderr, "failed to open trace file '%s': %s\n", trace_path, strerror(errno));
+        return;
+    }
 
-    // Unrender any keys which were previously in threshold.
-    for (size_t i = 0; i < MAX_KEYS; i++) {
-        if (!KEY_DEFINED(wb, i)) {
-            continue;
+    // Buffers of other threads may be written to while they are being dumped, in which case the
+    // oldest few spans of those threads can be garbled. The newest spans are what matter.
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    const char *sep = "\n";
+    for (struct trace_buffer *buf = atomic_load(&trace_buffers); buf; buf = buf->next) {
+        uint64_t head = atomic_load_explicit(&buf->head, memory_order_acquire);
+        uint64_t first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+
+        for (uint64_t i = first; i < head; i++) {
+            struct trace_event *event = &buf->events[i % TRACE_EVENTS];
+
+            fprintf(file,
+                    "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                    "\"dur\":%.3f}",
+                    sep, event->name, getpid(), buf->tid, event->start_nsec / 1e3,
+                    (event->end_nsec - event->start_nsec) / 1e3);
+            sep = ",\n";
         }
+    }
+    fprintf(file, "\n]}\n");
 
-        struct wb_key_state *ks = &wb->state.keys[i];
-        struct cfg_key *key = &wb->cfg.keys[i];
+    if (fclose(file) != 0) {
+        fprintf(stderr, "failed to write trace file '%s': %s\n", trace_path, strerror(errno));
+        return;
+    }
+    fprintf(stderr, "wrote trace to '%s'\n", trace_path);
+}
 
-        bool pressed = ks->last_press_usec > ks->last_release_usec;
-        uint64_t time_active_usec = ks->last_release_usec - ks->last_press_usec;
-        bool in_threshold = (wb->cfg.time_threshold > 0) && (ks->last_press_usec != 0) &&
-                            (time_active_usec < (uint64_t)wb->cfg.time_threshold * 1000) &&
-                            !pressed;
+static void
+trace_end(struct trace_span *span) {
+    if (span->start_nsec == 0) {
+        return;
+    }
 
-        if (in_threshold && usec_now() > ks->unrender_at_usec) {
-            pixman_image_fill_rectangles(PIXMAN_OP_SRC, wb->state.pixman_image, &wb->cfg.background,
-                                         1,
-                                         &(pixman_rectangle16_t){
-                                             key->x,
-                                             key->y,
-                                             key->w,
-                                             key->h,
-                                         });
-            wl_surface_damage_buffer(wb->wl.surface, key->x, key->y, key->w, key->h);
+    struct trace_buffer *buf = trace_local;
+    if (!buf) {
+        pthread_once(&trace_key_once, trace_init_key);
+
+        // The spans left in a reused buffer are kept, and are dumped as if this thread had
+        // recorded them. They ended before this thread started, so they never overlap its own.
+        for (buf = atomic_load(&trace_buffers); buf; buf = buf->next) {
+            bool in_use = false;
+            if (atomic_compare_exchange_strong(&buf->in_use, &in_use, true)) {
+                break;
+            }
+        }
+        if (!buf) {
+            buf = calloc(1, sizeof(*buf));
+            if (!buf) {
+                return;
+            }
+            buf->in_use = true;
 
-            ks->unrender_at_usec = UINT64_MAX;
+            buf->next = atomic_load(&trace_buffers);
+            while (!atomic_compare_exchange_weak(&trace_buffers, &buf->next, buf)) {
+            }
         }
+        buf->tid = gettid();
+        pthread_setspecific(trace_key, buf);
+        trace_local = buf;
     }
+
+    uint64_t head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+    buf->events[head % TRACE_EVENTS] = (struct trace_event){
+        .name = span->name,
+        .start_nsec = span->start_nsec,
+        .end_nsec = trace_now(),
+    };
+    atomic_store_explicit(&buf->head, head + 1, memory_order_release);
 }
 
 static void
-render_key(struct wayboard *wb, uint32_t keycode) {
-    assert(keycode < MAX_KEYS);
+trace_init_key() {
+    pthread_key_create(&trace_key, trace_release);
+}
 
-    if (!KEY_DEFINED(wb, keycode)) {
-        return;
-    }
+static inline uint64_t
+trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    struct wb_key_state *ks = &wb->state.keys[keycode];
-    struct cfg_key *key = &wb->cfg.keys[keycode];
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
 
-    // Determine the current state of the key.
-    //
-    //   - `time_active_usec` will underflow to a large value if the key is currently held. If the
-    //     key is not currently held, it will contain the last press duration.
-    //   - `in_threshold` is true if all of the following are true:
-    //     - the user has set `time_threshold` in their config
-    //     - the last press duration was lower than `time_threshold`
-    //     - the key has been pressed at least once
-    //     - the key is currently not pressed
-    bool pressed = ks->last_press_usec > ks->last_release_usec;
+static void
+trace_release(void *data) {
+    struct trace_buffer *buf = data;
+    atomic_store_explicit(&buf->in_use, false, memory_order_release);
+}
+#endif
 
-    uint64_t time_active_usec = ks->last_release_usec - ks->last_press_usec;
-    bool in_threshold = (wb->cfg.time_threshold > 0) && (ks->last_press_usec != 0) &&
-                        (time_active_usec < (uint64_t)wb->cfg.time_threshold * 1000) && !pressed;
+static inline uint64_t
+nsec_cpu_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
 
-    // If this is the first frame where the key is within the threshold, then the `unrender_at_usec`
-    // value should be updated.
-    uint64_t expected_unrender_at = ks->last_release_usec + (uint64_t)wb->cfg.threshold_life * 1000;
-    if (in_threshold && ks->unrender_at_usec != expected_unrender_at) {
-        ks->unrender_at_usec = expected_unrender_at;
-    }
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
 
-    bool render_threshold = in_threshold && usec_now() < ks->unrender_at_usec;
+static inline uint64_t
+usec_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    const pixman_color_t *foreground, *text;
-    if (pressed || render_threshold) {
-        foreground = &wb->cfg.fg_active;
-        text = &wb->cfg.txt_active;
-    } else {
-        foreground = &wb->cfg.fg_inactive;
-        text = &wb->cfg.txt_inactive;
-    }
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
 
-    // Wait until the SHM buffer is available for new content.
-    wayboard_spin_buffer_release(wb);
+static bool
+wayboard_check_chords(struct wayboard *wb, uint32_t code) {
+    for (size_t i = 0; i < wb->cfg.num_profiles; i++) {
+        struct cfg_profile *profile = &wb->cfg.profiles[i];
+        if (i == wb->state.profile || profile->chord_len == 0) {
+            continue;
+        }
 
-    // Fill the key rectangle with the correct foreground color.
-    pixman_image_fill_rectangles(PIXMAN_OP_SRC, wb->state.pixman_image, foreground, 1,
-                                 &(pixman_rectangle16_t){
-                                     key->x,
-                                     key->y,
-                                     key->w,
-                                     key->h,
-                                 });
+        // A chord only triggers on the press which completes it, so holding it down does not
+        // switch back and forth as other keys are pressed.
+        bool completes = false, held = true;
+        for (size_t j = 0; j < profile->chord_len && held; j++) {
+            struct wb_key_state *ks = &wb->state.keys[profile->chord[j]];
 
-    // Determine which string of text to render, if any.
-    char *text_str = NULL;
-    if (render_threshold) {
-        static char threshold_buf[256] = {0};
-        snprintf(threshold_buf, sizeof(threshold_buf), "%" PRIu64 " ms", time_active_usec / 1000);
+            completes |= profile->chord[j] == code;
+            held = ks->last_press_usec > ks->last_release_usec;
+        }
 
-        text_str = threshold_buf;
-    } else {
-        text_str = pressed ? key->text_active : key->text_inactive;
+        if (completes && held) {
+            wayboard_switch_profile(wb, i);
+            return true;
+        }
     }
 
-    // Render text, if any should be shown.
-    if (text_str != NULL) {
-        render_key_text(wb, key, text, text_str);
+    return false;
+}
+
+static void
+wayboard_commit_frame(struct wb_window *win, uint32_t time) {
+    TRACE_SPAN("commit_frame");
+
+    win->wl.frame_cb = wl_surface_frame(win->wl.surface);
+    wl_callback_add_listener(win->wl.frame_cb, &callback_frame_listener, win);
+
+    for (size_t i = 0; i < win->state.num_damage; i++) {
+        pixman_box32_t *box = &win->state.damage[i];
+        wl_surface_damage_buffer(win->wl.surface, box->x1, box->y1, box->x2 - box->x1,
+                                 box->y2 - box->y1);
     }
+    win->state.num_damage = 0;
 
-    // Damage the modified area of the buffer.
-    wl_surface_damage_buffer(wb->wl.surface, key->x, key->y, key->w, key->h);
+    wl_surface_attach(win->wl.surface, win->wl.buffer, 0, 0);
+    wl_surface_commit(win->wl.surface);
+
+    win->state.last_render = time;
+    win->state.buf_released = false;
+    win->state.dirty = false;
 }
 
-static void
-render_key_text(struct wayboard *wb, struct cfg_key *key, const pixman_color_t *text,
-                const char *text_str) {
-    // TODO: Cache rasterized text runs from fcft.
+static int
+wayboard_epoll_add(int epoll_fd, int fd, uint64_t source) {
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u64 = source,
+    };
 
-    // Convert the given text to UTF32.
-    size_t len = strlen(text_str);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        perror("failed to add file descriptor to epoll instance");
+        return 1;
+    }
+
+    return 0;
+}
 
-    char32_t *utf32 = calloc(len + 1, sizeof(char32_t));
-    assert(utf32);
+static void
+wayboard_fini_icons(struct wayboard *wb) {
+    while (wb->icons) {
+        struct wb_icon *icon = wb->icons;
+        wb->icons = icon->next;
 
-    mbstate_t mbstate = {0};
-    const char *in = text_str;
-    const char *const end = text_str + len + 1;
-    size_t pos = 0;
-    for (;;) {
-        size_t n = mbrtoc32(&utf32[pos], in, end - in, &mbstate);
+        pixman_image_unref(icon->image);
+        free(icon);
+    }
+}
 
-        switch (n) {
-        case 0: // null byte
-            goto done_utf32;
-        case (size_t)(-1): // error cases
-        case (size_t)(-2):
-        case (size_t)(-3):
-            fprintf(stderr, "failed to convert '%s' to UTF-32\n", text_str);
-            goto fail;
-        default: // normal character
-            break;
+static void
+wayboard_fini_input(struct wayboard *wb) {
+    switch (wb->backend) {
+    case BACKEND_LIBINPUT:
+        libinput_unref(wb->libinput);
+        udev_unref(wb->udev);
+        break;
+    case BACKEND_EVDEV:
+        for (size_t i = 0; i < wb->num_evdev; i++) {
+            close(wb->evdev[i].fd);
         }
-
-        pos++;
-        in += n;
+        wb->num_evdev = 0;
+        break;
     }
-done_utf32:;
 
-    // Rasterize the text with fcft and then render it into the shared memory buffer.
-    // It is assumed that the text run will be able to fit within the key rectangle.
-    //
-    // TODO: Use subpixel configuration of output
-    struct fcft_text_run *run =
-        fcft_rasterize_text_run_utf32(wb->font, pos, utf32, FCFT_SUBPIXEL_DEFAULT);
-    if (!run) {
-        fprintf(stderr, "failed to rasterize text run for '%s'\n", text_str);
-        goto fail;
+    free(wb->rate.devices);
+}
+
+static void
+wayboard_fini_overlaps(struct wayboard *wb) {
+    for (size_t i = 0; i < wb->num_windows * wb->cfg.num_profiles; i++) {
+        struct wb_layout *layout =
+            &wb->windows[i % wb->num_windows].layouts[i / wb->num_windows];
+
+        free(layout->overlap_keys);
+        layout->overlap_keys = NULL;
     }
+}
 
-    int text_width = 0;
-    int text_height = 0;
-    for (size_t i = 0; i < run->count; i++) {
-        if (!run->glyphs[i]) {
-            continue;
+static void
+wayboard_fini_render(struct wayboard *wb) {
+    if (wb->pool.num_helpers > 0) {
+        pthread_mutex_lock(&wb->pool.lock);
+        wb->pool.stop = true;
+        pthread_cond_broadcast(&wb->pool.wake);
+        pthread_mutex_unlock(&wb->pool.lock);
+
+        for (size_t i = 0; i < wb->pool.num_helpers; i++) {
+            pthread_join(wb->pool.helpers[i].thread, NULL);
         }
+        wb->pool.num_helpers = 0;
 
-        text_width += run->glyphs[i]->advance.x;
-        text_height = MAX(text_height, run->glyphs[i]->height);
+        pthread_cond_destroy(&wb->pool.idle);
+        pthread_cond_destroy(&wb->pool.wake);
+        pthread_mutex_destroy(&wb->pool.lock);
+    }
+    if (wb->label_color) {
+        pixman_image_unref(wb->label_color);
+    }
+    if (wb->solid) {
+        pixman_image_unref(wb->solid);
     }
-    int x = key->x + (key->w - text_width) / 2;
-    int y = key->y + (key->h - text_height) / 2;
+    if (wb->motion_mask) {
+        pixman_image_unref(wb->motion_mask);
+    }
+}
 
-    for (size_t i = 0; i < run->count; i++) {
-        const struct fcft_glyph *glyph = run->glyphs[i];
-        if (!glyph) {
-            continue;
-        }
+static void
+wayboard_fini_shapes(struct wayboard *wb) {
+    while (wb->shapes) {
+        struct wb_shape *shape = wb->shapes;
+        wb->shapes = shape->next;
 
-        if (pixman_image_get_format(glyph->pix) == PIXMAN_a8r8g8b8) {
-            pixman_image_composite32(PIXMAN_OP_OVER, glyph->pix, NULL, wb->state.pixman_image, 0, 0,
-                                     0, 0, x + glyph->x, y + wb->font->ascent - glyph->y,
-                                     glyph->width, glyph->height);
-        } else {
-            pixman_image_t *color = pixman_image_create_solid_fill(text);
-            pixman_image_composite32(PIXMAN_OP_OVER, color, glyph->pix, wb->state.pixman_image, 0,
-                                     0, 0, 0, x + glyph->x, y + wb->font->ascent - glyph->y,
-                                     glyph->width, glyph->height);
-            pixman_image_unref(color);
+        if (shape->outer) {
+            pixman_image_unref(shape->outer);
         }
-        x += glyph->advance.x;
+        if (shape->inner) {
+            pixman_image_unref(shape->inner);
+        }
+        free(shape);
     }
-
-    fcft_text_run_destroy(run);
-    free(utf32);
-    return;
-
-fail:
-    free(utf32);
-    return;
 }
 
-static inline uint64_t
-usec_now() {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
+static void
+wayboard_fini_shm(struct wayboard *wb) {
+    if (!wb->shm) {
+        return;
+    }
 
-    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+    char path[256];
+    snprintf(path, sizeof(path), "/%s", wb->cfg.shm_name);
+
+    munmap(wb->shm, sizeof(struct wb_shm));
+    shm_unlink(path);
 }
 
 static void
-wayboard_commit_frame(struct wayboard *wb, uint32_t time) {
-    wb->wl.frame_cb = wl_surface_frame(wb->wl.surface);
-    wl_callback_add_listener(wb->wl.frame_cb, &callback_frame_listener, wb);
-
-    wl_surface_attach(wb->wl.surface, wb->wl.buffer, 0, 0);
-    wl_surface_commit(wb->wl.surface);
+wayboard_fini_text(struct wayboard *wb) {
+    for (size_t i = 0; i < wb->text.num_entries; i++) {
+        fcft_text_run_destroy(wb->text.entries[i].run);
+        free(wb->text.entries[i].str);
+    }
+    wb->text.num_entries = 0;
 
-    wb->state.last_render = time;
-    wb->state.buf_released = false;
+    free(wb->text.entries);
+    free(wb->text.buckets);
+    free(wb->text.utf32);
 }
 
 static void
 wayboard_fini_wl(struct wayboard *wb) {
-    if (wb->wl.frame_cb) {
-        wl_callback_destroy(wb->wl.frame_cb);
+    for (size_t i = 0; i < wb->num_windows; i++) {
+        wayboard_fini_window(&wb->windows[i]);
     }
-
-    xdg_toplevel_destroy(wb->wl.xdg_toplevel);
-    xdg_surface_destroy(wb->wl.xdg_surface);
-    wl_surface_destroy(wb->wl.surface);
-    wl_buffer_destroy(wb->wl.buffer);
-
-    munmap(wb->state.shm_data, wb->cfg.width * wb->cfg.height * 4);
-    close(wb->state.shm_fd);
+    free(wb->windows);
 
     xdg_wm_base_destroy(wb->wl.xdg_wm_base);
     wl_shm_destroy(wb->wl.shm);
@@ -949,6 +5498,57 @@ wayboard_fini_wl(struct wayboard *wb) {
     wl_display_disconnect(wb->wl.display);
 }
 
+static void
+wayboard_fini_window(struct wb_window *win) {
+    if (win->wl.frame_cb) {
+        wl_callback_destroy(win->wl.frame_cb);
+    }
+    if (win->state.pixman_image) {
+        pixman_image_unref(win->state.pixman_image);
+    }
+    for (size_t i = 0; i < RENDER_MAX_THREADS; i++) {
+        if (win->state.tile_views[i]) {
+            pixman_image_unref(win->state.tile_views[i]);
+        }
+    }
+    for (size_t i = 0; win->layouts && i < win->wb->cfg.num_profiles; i++) {
+        if (win->layouts[i].idle) {
+            pixman_image_unref(win->layouts[i].idle);
+        }
+    }
+    free(win->layouts);
+
+    xdg_toplevel_destroy(win->wl.xdg_toplevel);
+    xdg_surface_destroy(win->wl.xdg_surface);
+    wl_surface_destroy(win->wl.surface);
+    wl_buffer_destroy(win->wl.buffer);
+
+    munmap(win->state.shm_data, win->cfg->width * win->cfg->height * 4);
+    close(win->state.shm_fd);
+}
+
+static void
+wayboard_flush_frames(struct wayboard *wb) {
+    // Windows which are waiting for a frame callback commit their damage from it instead, so that
+    // bursts of input events are not committed any faster than the compositor can show them.
+    for (size_t i = 0; i < wb->num_windows; i++) {
+        struct wb_window *win = &wb->windows[i];
+        if (win->wl.frame_cb) {
+            continue;
+        }
+
+        // Pointer, gamepad and report rate elements are otherwise drawn by the frame callback.
+        if (win->state.buf_released) {
+            render_pointer(win);
+            render_gamepad(win);
+            render_analyzer(win);
+        }
+        if (win->state.dirty) {
+            wayboard_commit_frame(win, win->state.last_render);
+        }
+    }
+}
+
 static void
 wayboard_process_key(struct wayboard *wb, uint32_t keycode, enum libinput_key_state state,
                      uint64_t usec) {
@@ -957,6 +5557,14 @@ wayboard_process_key(struct wayboard *wb, uint32_t keycode, enum libinput_key_st
 
 static void
 wayboard_process_code(struct wayboard *wb, uint32_t code, bool pressed, uint64_t usec) {
+    if (wb->stats.enabled) {
+        uint64_t latency = usec_now() - usec;
+
+        wb->stats.events++;
+        wb->stats.latency_sum_usec += latency;
+        wb->stats.latency_max_usec = MAX(wb->stats.latency_max_usec, latency);
+    }
+
     if (code >= MAX_KEYS) {
         fprintf(stderr, "warn: code %u over max processed (%d)\n", code, MAX_KEYS);
         return;
@@ -969,12 +5577,122 @@ wayboard_process_code(struct wayboard *wb, uint32_t code, bool pressed, uint64_t
         ks->last_release_usec = usec;
     }
 
-    render_key(wb, code);
+    // Publish the event before rendering so that readers see it as early as possible.
+    if (wb->shm) {
+        wb_shm_publish(wb->shm, code, pressed, usec);
+    }
+    if (wb->rec.header) {
+        recorder_write(wb, code, pressed, usec);
+    }
+
+    // Switching profiles redraws every window, including the keys which are held.
+    if (pressed && wb->cfg.num_profiles > 1 && wayboard_check_chords(wb, code)) {
+        return;
+    }
+
+    for (size_t i = 0; i < wb->num_windows; i++) {
+        render_key(&wb->windows[i], code);
+    }
+}
+
+static int
+wayboard_process_evdev(struct wayboard *wb, struct wb_evdev *dev) {
+    TRACE_SPAN("process_evdev");
+
+    struct input_event events[64];
+
+    for (;;) {
+        ssize_t n = read(dev->fd, events, sizeof(events));
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                recorder_flush(wb);
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+
+            // The device was most likely unplugged. Stop listening to it, but keep going.
+            if (errno == ENODEV) {
+                close(dev->fd);
+                dev->fd = -1;
+                return 0;
+            }
+
+            perror("failed to read evdev events");
+            return 1;
+        }
+
+        for (size_t i = 0; i < n / sizeof(*events); i++) {
+            struct input_event *event = &events[i];
+            uint64_t usec = (uint64_t)event->input_event_sec * 1000000 + event->input_event_usec;
+
+            // Every report from the device ends with a SYN_REPORT, so the analyzer looks at those
+            // alone.
+            if (event->type == EV_SYN) {
+                if (event->code == SYN_DROPPED) {
+                    dev->dropped = true;
+                } else if (event->code == SYN_REPORT && dev->dropped) {
+                    dev->dropped = false;
+                    evdev_resync(wb, dev);
+                } else if (event->code == SYN_REPORT && wb->rate.enabled) {
+                    rate_record(wb, rate_evdev(wb, dev), usec);
+                }
+                continue;
+            }
+
+            if (dev->dropped) {
+                continue;
+            }
+
+            // Wheels which support high resolution scrolling report it alongside the regular
+            // events, so only the regular events are used. Their sign is the opposite of libinput's
+            // for vertical scrolling.
+            if (event->type == EV_REL) {
+                switch (event->code) {
+                case REL_X:
+                    wayboard_process_motion(wb, event->value, 0);
+                    break;
+                case REL_Y:
+                    wayboard_process_motion(wb, 0, event->value);
+                    break;
+                case REL_WHEEL:
+                    wayboard_process_scroll(wb, 0, -event->value * 120, usec);
+                    break;
+                case REL_HWHEEL:
+                    wayboard_process_scroll(wb, event->value * 120, 0, usec);
+                    break;
+                }
+                continue;
+            }
+
+            // Axes of devices other than gamepads are ignored.
+            if (event->type == EV_ABS) {
+                if (dev->gamepad) {
+                    evdev_axis(wb, dev, event->code, event->value, usec);
+                }
+                continue;
+            }
+
+            // Ignore key repeats (value 2) along with everything other than keys and buttons.
+            if (event->type != EV_KEY || event->value > 1) {
+                continue;
+            }
+
+            wayboard_process_code(wb, evdev_code(event->code), event->value == 1, usec);
+        }
+    }
 }
 
 static int
 wayboard_process_libinput(struct wayboard *wb) {
-    int err = libinput_dispatch(wb->libinput);
+    TRACE_SPAN("process_libinput");
+
+    int err;
+    {
+        TRACE_SPAN("libinput_dispatch");
+        err = libinput_dispatch(wb->libinput);
+    }
     if (err != 0) {
         fprintf(stderr, "failed to dispatch libinput: %s\n", strerror(-err));
         return 1;
@@ -983,16 +5701,22 @@ wayboard_process_libinput(struct wayboard *wb) {
     for (;;) {
         struct libinput_event *event = libinput_get_event(wb->libinput);
         if (!event) {
+            recorder_flush(wb);
             return 0;
         }
 
         enum libinput_event_type type = libinput_event_get_type(event);
 
+        // Events from the same report of a device share its timestamp, which the analyzer counts
+        // once.
         if (type == LIBINPUT_EVENT_KEYBOARD_KEY) {
             struct libinput_event_keyboard *kbd_event = libinput_event_get_keyboard_event(event);
             uint32_t keycode = libinput_event_keyboard_get_key(kbd_event);
             enum libinput_key_state state = libinput_event_keyboard_get_key_state(kbd_event);
             uint64_t usec = libinput_event_keyboard_get_time_usec(kbd_event);
+            if (wb->rate.enabled) {
+                rate_record(wb, rate_libinput(wb, event), usec);
+            }
 
             // Utilities such as `wev` show XKB keycodes, which are 8 greater than libinput keycodes.
             wayboard_process_key(wb, keycode + 8, state, usec);
@@ -1006,130 +5730,566 @@ wayboard_process_libinput(struct wayboard *wb) {
             enum libinput_button_state bstate =
                 libinput_event_pointer_get_button_state(ptr_event);
             uint64_t usec = libinput_event_pointer_get_time_usec(ptr_event);
+            if (wb->rate.enabled) {
+                rate_record(wb, rate_libinput(wb, event), usec);
+            }
 
             wayboard_process_code(wb, button, bstate == LIBINPUT_BUTTON_STATE_PRESSED, usec);
             libinput_event_destroy(event);
             continue;
         }
 
+        if (type == LIBINPUT_EVENT_POINTER_MOTION) {
+            struct libinput_event_pointer *ptr_event = libinput_event_get_pointer_event(event);
+            if (wb->rate.enabled) {
+                rate_record(wb, rate_libinput(wb, event),
+                            libinput_event_pointer_get_time_usec(ptr_event));
+            }
+
+            wayboard_process_motion(wb, libinput_event_pointer_get_dx_unaccelerated(ptr_event),
+                                    libinput_event_pointer_get_dy_unaccelerated(ptr_event));
+            libinput_event_destroy(event);
+            continue;
+        }
+
+        // Wheels report scrolling in 1/120ths of a tick. Touchpads and other continuous sources
+        // report roughly 15 units per tick instead. The legacy axis events are sent alongside these
+        // and are ignored.
+        if (type == LIBINPUT_EVENT_POINTER_SCROLL_WHEEL ||
+            type == LIBINPUT_EVENT_POINTER_SCROLL_FINGER ||
+            type == LIBINPUT_EVENT_POINTER_SCROLL_CONTINUOUS) {
+            struct libinput_event_pointer *ptr_event = libinput_event_get_pointer_event(event);
+            double axis[2] = {0};
+            enum libinput_pointer_axis axes[2] = {
+                LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL,
+                LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL,
+            };
+
+            for (size_t i = 0; i < ARRAY_LEN(axes); i++) {
+                if (!libinput_event_pointer_has_axis(ptr_event, axes[i])) {
+                    continue;
+                }
+                axis[i] = type == LIBINPUT_EVENT_POINTER_SCROLL_WHEEL
+                              ? libinput_event_pointer_get_scroll_value_v120(ptr_event, axes[i])
+                              : libinput_event_pointer_get_scroll_value(ptr_event, axes[i]) * 8;
+            }
+
+            uint64_t usec = libinput_event_pointer_get_time_usec(ptr_event);
+            if (wb->rate.enabled) {
+                rate_record(wb, rate_libinput(wb, event), usec);
+            }
+
+            wayboard_process_scroll(wb, axis[0], axis[1], usec);
+            libinput_event_destroy(event);
+            continue;
+        }
+
         // Ignore all other events
         libinput_event_destroy(event);
     }
 }
 
+static inline void
+wayboard_process_motion(struct wayboard *wb, double dx, double dy) {
+    wb->pointer.events++;
+    wb->pointer.dx += dx;
+    wb->pointer.dy += dy;
+}
+
+static inline void
+wayboard_process_scroll(struct wayboard *wb, int x, int y, uint64_t usec) {
+    if (usec - wb->pointer.scroll_usec >= SCROLL_BURST_USEC) {
+        wb->pointer.scroll_x = 0;
+        wb->pointer.scroll_y = 0;
+    }
+
+    wb->pointer.events++;
+    wb->pointer.scroll_usec = usec;
+    wb->pointer.scroll_x += x;
+    wb->pointer.scroll_y += y;
+}
+
+static void
+wayboard_process_signals(struct wayboard *wb, int fd) {
+    struct signalfd_siginfo info;
+
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+        case SIGINT:
+        case SIGTERM:
+            wb->state.should_close = true;
+            break;
+        case SIGUSR1:
+#ifdef WAYBOARD_TRACE
+            if (trace_path) {
+                trace_dump();
+            }
+#endif
+            rate_print(wb);
+            break;
+        case SIGUSR2:
+            // With a single profile there is nothing to cycle through, but the signal is still
+            // taken so that it does not terminate wayboard.
+            if (wb->cfg.num_profiles > 1) {
+                wayboard_switch_profile(wb, (wb->state.profile + 1) % wb->cfg.num_profiles);
+            }
+            break;
+        }
+    }
+}
+
+static void
+wayboard_print_stats(struct wayboard *wb) {
+    if (!wb->stats.enabled) {
+        return;
+    }
+
+    uint64_t events = MAX(wb->stats.events, 1);
+    uint64_t batches = MAX(wb->stats.batches, 1);
+
+    fprintf(stderr, "backend:        %s\n", wb->backend == BACKEND_EVDEV ? "evdev" : "libinput");
+    fprintf(stderr, "events:         %" PRIu64 " in %" PRIu64 " wakeups\n", wb->stats.events,
+            wb->stats.batches);
+    fprintf(stderr, "cpu time:       %.3f ms (%.2f us/wakeup, %.2f us/event)\n",
+            wb->stats.cpu_nsec / 1e6, wb->stats.cpu_nsec / 1e3 / batches,
+            wb->stats.cpu_nsec / 1e3 / events);
+    fprintf(stderr, "event latency:  %.1f us average, %" PRIu64 " us max\n",
+            (double)wb->stats.latency_sum_usec / events, wb->stats.latency_max_usec);
+    fprintf(stderr, "text cache:     %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions",
+            wb->text.hits, wb->text.misses, wb->text.evictions);
+    fprintf(stderr, " (%zu/%zu entries)\n", wb->text.num_entries, wb->text.max_entries);
+}
+
 static int
 wayboard_run(struct wayboard *wb) {
-    struct pollfd pollfds[] = {
-        {.fd = libinput_get_fd(wb->libinput), .events = POLLIN},
-        {.fd = wl_display_get_fd(wb->wl.display), .events = POLLIN},
-    };
+    int ret = 1;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("failed to create epoll instance");
+        return 1;
+    }
+
+    // Signals are read from a signalfd instead of being handled asynchronously, so that they are
+    // handled between batches like any other event and shutting down can clean up.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR2);
+
+    // SIGUSR1 prints the analyzer's report and dumps the trace, and is otherwise left to its
+    // default action.
+    bool report = wb->rate.enabled;
+#ifdef WAYBOARD_TRACE
+    report |= trace_path != NULL;
+#endif
+    if (report) {
+        sigaddset(&signals, SIGUSR1);
+    }
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        perror("failed to create signalfd");
+        goto fail_signalfd;
+    }
+
+    // The session log is synced on a timer rather than after input events, so that the last
+    // events before a quiet period are not left unsynced.
+    int timer_fd = -1;
+    if (wb->rec.header) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_fd < 0) {
+            perror("failed to create timerfd");
+            goto fail_timerfd;
+        }
+
+        struct timespec interval = {
+            .tv_sec = RECORD_SYNC_USEC / 1000000,
+            .tv_nsec = (RECORD_SYNC_USEC % 1000000) * 1000,
+        };
+        timerfd_settime(timer_fd, 0, &(struct itimerspec){interval, interval}, NULL);
+    }
+
+    if (wayboard_epoll_add(epoll_fd, wl_display_get_fd(wb->wl.display), SOURCE_WAYLAND) != 0 ||
+        wayboard_epoll_add(epoll_fd, signal_fd, SOURCE_SIGNAL) != 0 ||
+        (timer_fd >= 0 && wayboard_epoll_add(epoll_fd, timer_fd, SOURCE_TIMER) != 0)) {
+        goto fail_sources;
+    }
+    switch (wb->backend) {
+    case BACKEND_LIBINPUT:
+        if (wayboard_epoll_add(epoll_fd, libinput_get_fd(wb->libinput), SOURCE_LIBINPUT) != 0) {
+            goto fail_sources;
+        }
+        break;
+    case BACKEND_EVDEV:
+        for (size_t i = 0; i < wb->num_evdev; i++) {
+            if (wayboard_epoll_add(epoll_fd, wb->evdev[i].fd, SOURCE_EVDEV + i) != 0) {
+                goto fail_sources;
+            }
+        }
+        break;
+    }
+
+    struct wl_display *display = wb->wl.display;
+    bool wl_blocked = false; // the socket was full on the last flush
 
     while (!wb->state.should_close) {
-        if (wl_display_flush(wb->wl.display) == -1) {
-            perror("failed to flush wayland display");
-            return 1;
+        // Events which were queued without being dispatched have to be dispatched before the
+        // display can be read from again.
+        while (wl_display_prepare_read(display) != 0) {
+            if (wl_display_dispatch_pending(display) == -1) {
+                perror("failed to dispatch wayland display");
+                goto fail_loop;
+            }
         }
-        if (poll(pollfds, ARRAY_LEN(pollfds), -1) < 0) {
-            perror("failed to poll fds");
-            return 1;
+
+        // If the socket is full, the rest of the requests are sent once it becomes writable.
+        {
+            TRACE_SPAN("wl_display_flush");
+            bool blocked = wl_display_flush(display) == -1;
+            if (blocked && errno != EAGAIN) {
+                perror("failed to flush wayland display");
+                wl_display_cancel_read(display);
+                goto fail_loop;
+            }
+            if (blocked != wl_blocked) {
+                wl_blocked = blocked;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, wl_display_get_fd(display),
+                          &(struct epoll_event){
+                              .events = EPOLLIN | (blocked ? EPOLLOUT : 0),
+                              .data.u64 = SOURCE_WAYLAND,
+                          });
+            }
         }
 
-        if (pollfds[0].revents & POLLIN) {
-            if (wayboard_process_libinput(wb) != 0) {
-                return 1;
+        struct epoll_event events[16];
+        int num_events = epoll_wait(epoll_fd, events, ARRAY_LEN(events), -1);
+        if (num_events < 0) {
+            wl_display_cancel_read(display);
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("failed to wait for events");
+            goto fail_loop;
+        }
+
+        // The display is read from before input is handled, but its events are only dispatched
+        // afterwards, so that input is never held up behind frame callbacks.
+        bool wl_readable = false;
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].data.u64 == SOURCE_WAYLAND) {
+                wl_readable = events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP);
+            }
+        }
+        if (wl_readable) {
+            TRACE_SPAN("wl_display_read_events");
+            if (wl_display_read_events(display) == -1) {
+                perror("failed to read wayland events");
+                goto fail_loop;
+            }
+        } else {
+            wl_display_cancel_read(display);
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            uint64_t source = events[i].data.u64;
+
+            uint64_t cpu_start = wb->stats.enabled ? nsec_cpu_now() : 0;
+            int err = 0;
+
+            switch (source) {
+            case SOURCE_WAYLAND:
+                continue;
+            case SOURCE_SIGNAL:
+                wayboard_process_signals(wb, signal_fd);
+                continue;
+            case SOURCE_TIMER:
+                if (read(timer_fd, &(uint64_t){0}, sizeof(uint64_t)) > 0) {
+                    recorder_sync(wb);
+                }
+                continue;
+            case SOURCE_LIBINPUT:
+                err = wayboard_process_libinput(wb);
+                break;
+            default:
+                // Removed devices close their file descriptor, which also removes it from the
+                // epoll instance.
+                if (wb->evdev[source - SOURCE_EVDEV].fd >= 0) {
+                    err = wayboard_process_evdev(wb, &wb->evdev[source - SOURCE_EVDEV]);
+                }
+                break;
+            }
+            if (err != 0) {
+                goto fail_loop;
+            }
+
+            if (wb->stats.enabled) {
+                wb->stats.cpu_nsec += nsec_cpu_now() - cpu_start;
+                wb->stats.batches++;
             }
         }
-        if (pollfds[1].revents & POLLIN) {
-            if (wl_display_dispatch(wb->wl.display) == -1) {
+        wayboard_flush_frames(wb);
+
+        {
+            TRACE_SPAN("wl_display_dispatch_pending");
+            if (wl_display_dispatch_pending(display) == -1) {
                 perror("failed to dispatch wayland display");
-                return 1;
+                goto fail_loop;
             }
         }
     }
+    ret = 0;
 
-    return 0;
+fail_loop:
+fail_sources:
+    if (timer_fd >= 0) {
+        close(timer_fd);
+    }
+
+fail_timerfd:
+    close(signal_fd);
+
+fail_signalfd:
+    close(epoll_fd);
+    return ret;
 }
 
 static void
-wayboard_spin_buffer_release(struct wayboard *wb) {
-    if (wb->state.buf_released) {
-        return;
-    }
+wayboard_switch_profile(struct wayboard *wb, size_t index) {
+    TRACE_SPAN("switch_profile");
 
-    struct timespec start;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    uint64_t start_usec = (uint64_t)start.tv_sec * 1000000 + (uint64_t)start.tv_nsec / 1000;
+    wb->state.profile = index;
 
-    while (!wb->state.buf_released) {
-        uint64_t now_usec = usec_now();
-        if (now_usec - start_usec > 10 * 1000000) {
-            fprintf(stderr, "no wl_buffer.release sent after 10 seconds\n");
-            goto fail;
-        }
+    for (size_t i = 0; i < wb->num_windows; i++) {
+        struct wb_window *win = &wb->windows[i];
 
-        if (wl_display_flush(wb->wl.display) == -1) {
-            fprintf(stderr, "failed to flush wayland display while awaiting buffer release\n");
-            goto fail;
-        }
-        if (wl_display_dispatch(wb->wl.display) == -1) {
-            fprintf(stderr, "failed to dispatch wayland display while awaiting buffer release\n");
-            goto fail;
-        }
-    }
+        win->layout = &win->layouts[index];
+        win->cfg = win->layout->cfg;
 
-    return;
+        // Keys of the old layout which were still fading out or showing their press duration are
+        // drawn over by the new layout, so they no longer need any work.
+        for (size_t j = 0; j < win->state.num_active; j++) {
+            win->state.is_active[win->state.active[j]] = false;
+        }
+        win->state.num_active = 0;
 
-fail:
-    wb->state.should_close = true;
-    return;
+        render_profile(win);
+    }
 }
 
 int
 main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "USAGE: %s CONFIG_FILE\n", argv[0] ? argv[0] : "wayboard");
-        return 1;
-    }
+    static const struct option long_options[] = {
+        {"analyze", no_argument, NULL, 'a'},
+        {"backend", required_argument, NULL, 'b'},
+        {"compile", no_argument, NULL, 'c'},
+        {"format", required_argument, NULL, 'F'},
+        {"fps", required_argument, NULL, 'f'},
+        {"output", required_argument, NULL, 'o'},
+        {"render", required_argument, NULL, 'r'},
+        {"snapshot", required_argument, NULL, 's'},
+        {"stats", no_argument, NULL, 'S'},
+        {"threads", required_argument, NULL, 'j'},
+        {"trace", required_argument, NULL, 't'},
+        {"window", required_argument, NULL, 'w'},
+        {0},
+    };
+    const char *name = argv[0] ? argv[0] : "wayboard";
 
     struct wayboard wb = {0};
 
-    if (init_libinput(&wb) != 0) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct offline off = {
+        .format = OFFLINE_Y4M,
+        .fps = 60,
+        .num_threads = MIN(MAX(num_cpus, 1), OFFLINE_MAX_THREADS),
+    };
+
+    bool compile = false;
+    const char *snapshot_path = NULL;
+    for (;;) {
+        int opt = getopt_long(argc, argv, "ab:cF:f:o:r:s:Sj:t:w:", long_options, NULL);
+        if (opt == -1) {
+            break;
+        }
+
+        switch (opt) {
+        case 'a':
+            wb.rate.enabled = true;
+            break;
+        case 'b':
+            if (strcmp(optarg, "libinput") == 0) {
+                wb.backend = BACKEND_LIBINPUT;
+            } else if (strcmp(optarg, "evdev") == 0) {
+                wb.backend = BACKEND_EVDEV;
+            } else {
+                fprintf(stderr, "unknown backend '%s'\n", optarg);
+                goto usage;
+            }
+            break;
+        case 'c':
+            compile = true;
+            break;
+        case 'F':
+            if (strcmp(optarg, "rgba") == 0) {
+                off.format = OFFLINE_RGBA;
+            } else if (strcmp(optarg, "y4m") == 0) {
+                off.format = OFFLINE_Y4M;
+            } else {
+                fprintf(stderr, "unknown format '%s'\n", optarg);
+                goto usage;
+            }
+            break;
+        case 'f':
+            off.fps = atoi(optarg);
+            if (off.fps <= 0 || off.fps > 1000) {
+                fprintf(stderr, "invalid frame rate '%s'\n", optarg);
+                goto usage;
+            }
+            break;
+        case 'o':
+            off.out_path = optarg;
+            break;
+        case 'r':
+            off.log_path = optarg;
+            break;
+        case 's':
+            snapshot_path = optarg;
+            break;
+        case 'S':
+            wb.stats.enabled = true;
+            break;
+        case 'j':
+            off.num_threads = atoi(optarg);
+            if (off.num_threads == 0 || off.num_threads > OFFLINE_MAX_THREADS) {
+                fprintf(stderr, "invalid number of threads '%s'\n", optarg);
+                goto usage;
+            }
+            break;
+        case 't':
+#ifdef WAYBOARD_TRACE
+            trace_path = optarg;
+            break;
+#else
+            fprintf(stderr, "wayboard was built without tracing (-Dtrace=true)\n");
+            return 1;
+#endif
+        case 'w':
+            off.window = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (compile) {
+        if (argc - optind != 2 || snapshot_path) {
+            goto usage;
+        }
+
+        return snapshot_compile(argv[optind], argv[optind + 1]);
+    }
+    if (argc - optind != 1) {
+        goto usage;
+    }
+    const char *config_path = argv[optind];
+    wb.render_threads = MIN(off.num_threads, RENDER_MAX_THREADS);
+
+    if (off.log_path) {
+        return offline_run(&wb, &off, config_path, snapshot_path);
+    }
+
+    if ((wb.backend == BACKEND_LIBINPUT ? init_libinput(&wb) : init_evdev(&wb)) != 0) {
         return 1;
     }
-    if (init_read_config(&wb, argv[1]) != 0) {
+    if (init_read_config(&wb, config_path, snapshot_path) != 0) {
         goto fail_config;
     }
+    init_rate(&wb);
+    if (init_shm(&wb) != 0) {
+        goto fail_shm;
+    }
+    if (init_recorder(&wb) != 0) {
+        goto fail_recorder;
+    }
     if (init_wayland(&wb) != 0) {
         goto fail_wayland;
     }
     if (init_fcft(&wb) != 0) {
         goto fail_fcft;
     }
+    if (init_shapes(&wb) != 0) {
+        goto fail_shapes;
+    }
+    init_overlaps(&wb);
+    if (init_icons(&wb) != 0) {
+        goto fail_icons;
+    }
     if (init_render(&wb) != 0) {
         goto fail_render;
     }
 
     int ret = wayboard_run(&wb);
 
-    pixman_image_unref(wb.state.pixman_image);
+#ifdef WAYBOARD_TRACE
+    if (trace_path) {
+        trace_dump();
+    }
+#endif
+
+    wayboard_fini_text(&wb);
+    wayboard_fini_render(&wb);
+    wayboard_fini_icons(&wb);
+    wayboard_fini_overlaps(&wb);
+    wayboard_fini_shapes(&wb);
     fcft_fini();
     wayboard_fini_wl(&wb);
+    recorder_close(&wb);
+    wayboard_fini_shm(&wb);
     cfg_destroy(&wb.cfg);
-    libinput_unref(wb.libinput);
-    udev_unref(wb.udev);
+    rate_print(&wb);
+    wayboard_fini_input(&wb);
+    wayboard_print_stats(&wb);
     return ret;
 
 fail_render:
+    wayboard_fini_text(&wb);
+    wayboard_fini_render(&wb);
+
+fail_icons:
+    wayboard_fini_icons(&wb);
+
+fail_shapes:
+    wayboard_fini_overlaps(&wb);
+    wayboard_fini_shapes(&wb);
     fcft_fini();
 
 fail_fcft:
     wayboard_fini_wl(&wb);
 
 fail_wayland:
+    recorder_close(&wb);
+
+fail_recorder:
+    wayboard_fini_shm(&wb);
+
+fail_shm:
     cfg_destroy(&wb.cfg);
 
 fail_config:
-    libinput_unref(wb.libinput);
-    udev_unref(wb.udev);
+    wayboard_fini_input(&wb);
+    return 1;
+
+usage:
+    fprintf(stderr,
+            "USAGE: %s [--analyze] [--backend libinput|evdev] [--snapshot SNAPSHOT_FILE]\n"
+            "       [--stats] [--threads N] [--trace TRACE_FILE] CONFIG_FILE\n"
+            "       %s --compile CONFIG_FILE SNAPSHOT_FILE\n"
+            "       %s --render SESSION_LOG [--format y4m|rgba] [--fps FPS] [--window INDEX]\n"
+            "       [--threads N] [--output FILE] [--snapshot SNAPSHOT_FILE] CONFIG_FILE\n",
+            name, name, name);
     return 1;
 }